@@ -6,24 +6,119 @@
  * Alex Li asl11
  */
 
+#define _GNU_SOURCE     // for memfd_create(), file sealing, tee(), and ucred
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
+#include <arpa/inet.h>
+
+#include <linux/ioprio.h>
+
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <regex.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 // You may assume that these constants are large enough.
 #define MAXLINE      1024   // max line size
 #define MAXARGS       128   // max args on a command line
-#define MAXJOBS        16   // max jobs at any point in time
+#define MAXJOBS      1024   // max jobs at any point in time
 #define MAXJID   (1 << 16)  // max job ID
+#define MAXDONE      1024   // max remembered job completions
+#define ENVSPARE       64   // spare envp slots for per-command overrides
+#define GLOBCACHE      64   // max directory listings cached for globbing
+#define DENTBUF   (1 << 20) // getdents64() buffer size
+#define ARGSLACK     2048   // bytes of ARG_MAX left unused, as in xargs
+#define MAXHEREDOCS     8   // max here-documents on a command line
+#define MAXPROCSUBS     8   // max process substitutions on a command line
+#define CAPTUREMAX  65536   // default size of a job's output capture buffer
+#define READCHUNK    4096   // bytes read from a pipe at a time
+#define ASTCACHE       64   // max parsed command sources cached
+#define MEMOMAX  (64 << 20) // default max size of the memo result store
+#define MAXFRAME    65536   // max payload of a job server frame
+#define MAXFUNCDEPTH 1000   // max nesting of function calls
+#define PSIPOLL         1   // seconds between pressure checks for held jobs
+#define HISTGRAMS   65536   // buckets of the history's trigram index
+#define WHEELSLOTS    512   // slots of the timer wheel
+#define WHEELTICK     100   // milliseconds per tick of the timer wheel
+#define TEEPIPE   (1 << 20) // size requested for the pipes of the tee builtin
+#define FILTERBUF (1 << 20) // initial input buffer of the filter builtins
+
+// The here-document redirections are:
+#define HERESTR 1   // <<<word
+#define HEREDOC 2   // <<DELIM
+#define HERETAB 3   // <<-DELIM, which strips leading tabs
+
+/*
+ * The tokens of the control-flow syntax, which are also the types of the
+ * nodes that they parse into.  The reserved words from TIF on are in the
+ * order of the "keywords" table.
+ */
+#define TEND    0   // end of the source
+#define TCMD    1   // simple command
+#define TFOR    2   // for NAME [in WORD ...]
+#define TFUNC   3   // NAME()
+#define TIF     4
+#define TTHEN   5
+#define TELIF   6
+#define TELSE   7
+#define TFI     8
+#define TWHILE  9
+#define TUNTIL 10
+#define TDO    11
+#define TDONE  12
+#define TLBRACE 13  // {
+#define TRBRACE 14  // }
+
+// The ways that break, continue, and return leave a command list are:
+#define LOOPBREAK 1
+#define LOOPCONT  2
+#define FUNCRET   3
+
+// The reasons that a background job may be held before exec are:
+#define HOLDTOKEN  1   // no jobserver token is free
+#define HOLDCPU    2   // CPU pressure is above TSH_PSI_CPU
+#define HOLDMEMORY 3   // memory pressure is above TSH_PSI_MEMORY
+#define HOLDIO     4   // I/O pressure is above TSH_PSI_IO
+
+// The kinds of filter builtins are:
+#define FCAT  1
+#define FGREP 2     // grep -F
+#define FHEAD 3
+#define FWC   4     // wc -l
+
+// The vector instructions that the filter builtins may use are:
+#define SIMDSCALAR 0   // none
+#define SIMDSSE2   1
+#define SIMDAVX2   2
 
 // The job states are:
 #define UNDEF 0 // undefined
@@ -44,16 +139,269 @@ struct Job {
 	pid_t pid;              // job PID
 	int jid;                // job ID [1, 2, ...]
 	int state;              // UNDEF, FG, BG, or ST
+	bool orphaned;          // leader exited, but its process group lives on
+	int status;             // leader's waitpid() status once orphaned
+	bool token;             // holds a jobserver token?
+	int gatefd;             // pipe the job waits on before exec, or -1
+	int hold;               // why it waits (HOLDTOKEN, ...), or 0
+	int policy;             // CPU scheduling policy in the background
+	int ioprio;             // I/O priority in the background
+	double start;           // CLOCK_MONOTONIC time when it was added
+	double utime;           // user CPU seconds of the reaped leader
+	double stime;           // system CPU seconds of the reaped leader
+	long maxrss;            // max resident set of the reaped leader, in KiB
+	bool sub;               // stands in for a file of another job?
+	int nsubs;              // number of its process substitutions
+	pid_t subs[MAXPROCSUBS];     // their jobs' PIDs
+	bool subsout[MAXPROCSUBS];   // which of them read from it
 	char cmdline[MAXLINE];  // command line
 };
 
-struct list {
-	char *name;
-	struct list *tail_list;
+/*
+ * A process substitution, "<(command)" or ">(command)", which is replaced
+ * by the name of a pipe to or from a job running "command".
+ */
+struct Procsub {
+	char *text;             // command between the parentheses
+	bool out;               // ">(...)", whose job reads from the pipe?
+	int argi;               // index of its word in argv
+	int fd;                 // the shell's end of the pipe, or -1
+	pid_t pid;              // PID of its job, or 0
+};
+
+/*
+ * A command line split into words, after quote removal and the expansion of
+ * shell variables.
+ */
+struct Cmd {
+	char **argv;            // NULL-terminated array of words
+	int argc;               // number of words in argv
+	int argmax;             // allocated size of argv
+	char **assigns;         // "NAME=value" words preceding argv[0]
+	int nassigns;           // number of words in assigns
+	int assignmax;          // allocated size of assigns
+	int infd;               // here-document for stdin, or -1
+	int outfd;              // file for stdout, or -1
+	int errfd;              // file for stderr, or -1
+	bool bg;                // run in the background?
+	bool sub;               // a process substitution's command?
+	struct Procsub subs[MAXPROCSUBS];  // process substitutions in argv
+	int nsubs;              // number of process substitutions
+};
+
+/*
+ * A growable, NUL-terminated string.
+ */
+struct Buf {
+	char *s;                // contents
+	size_t len;             // length of contents
+	size_t max;             // allocated size of s
+};
+
+/*
+ * A cached listing of a directory's entries, used for globbing.  A listing
+ * stays valid for as long as the directory's identity and modification time
+ * are unchanged, unless it was read so soon after the directory was
+ * modified that a later change might not move the modification time.
+ */
+struct Listing {
+	char *path;             // directory, or NULL if the slot is unused
+	dev_t dev;              // device and inode of the directory
+	ino_t ino;
+	struct timespec mtime;  // modification time when it was read
+	bool racy;              // read too soon after mtime to be trusted?
+	char *names;            // NUL-separated entry names, "." and ".." omitted
+	unsigned char *types;   // d_type of each entry
+	char **name;            // pointers to each entry's name
+	int n;                  // number of entries
+	int pinned;             // number of globdir() calls iterating over it
+	unsigned long lastuse;  // globclock value when last used
+};
+
+/*
+ * The header of a file that indexes the executables in a directory of PATH.
+ * It is followed by the directory's path, NUL-terminated and padded to a
+ * multiple of 4 bytes, then by the offsets from the start of the file of
+ * the executables' names, in the order of the names, and then by the
+ * names, each NUL-terminated.
+ */
+struct ExecHead {
+	char magic[8];          // "tshexec1"
+	uint64_t dev;           // device and inode of the directory
+	uint64_t ino;
+	int64_t sec;            // modification time of the directory
+	int64_t nsec;
+	uint32_t n;             // number of executables
+	uint32_t pathlen;       // length of the directory's path
+};
+
+/*
+ * A directory of PATH and the index of the executables in it.  As for a
+ * Listing, the index is valid while the directory's identity and
+ * modification time are unchanged.  Indexes are shared through files that
+ * every shell maps, but one read too soon after the directory was
+ * modified is kept only in memory.
+ */
+struct PathDir {
+	char *path;             // directory as given in PATH
+	bool indexed;           // absolute, and so indexed?
+	dev_t dev;              // device and inode of the directory, or 0
+	ino_t ino;              // if it does not exist
+	struct timespec mtime;  // modification time when it was indexed
+	bool racy;              // indexed too soon after mtime to be trusted?
+	struct ExecHead *index; // the index, or NULL if it has no executables
+	size_t indexlen;        // length of index
+	bool mapped;            // is index mapped rather than allocated?
+};
+
+/*
+ * The raw directory entry returned by the getdents64 system call.
+ */
+struct Dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/*
+ * A file descriptor watched by the event loop, and the function that is
+ * called when it is ready.
+ */
+struct Watch {
+	int fd;                 // file descriptor, or -1 once removed
+	short events;           // poll() events of interest
+	void (*handler)(int fd, void *arg);
+	void *arg;              // argument passed to handler
+};
+
+/*
+ * The captured output of a background job.  The job's stdout and stderr
+ * are a pipe that the event loop drains into a ring buffer holding the last
+ * "size" bytes.  If a spill directory is configured, all of the output is
+ * also written to a file once it exceeds the ring buffer.
+ */
+struct Capture {
+	int jid;                // job ID of the job
+	pid_t pid;              // PID of the job
+	int fd;                 // read end of the pipe, or -1 at end of file
+	char *ring;             // ring buffer
+	size_t size;            // size of ring
+	size_t total;           // total bytes captured
+	int spillfd;            // spill file, or -1
+	char *spillpath;        // path of the spill file, or NULL
+	bool spillfailed;       // could the spill file not be opened?
+	struct Capture *next;   // next capture in the list
+};
+
+/*
+ * A shell variable.  Variables are kept in a hash table, and the exported
+ * ones are also in the cached environment array "envp", where each one's
+ * "NAME=value" string sits at index "envidx".
+ */
+struct Var {
+	char *str;              // "NAME=value"
+	size_t namelen;         // length of NAME
+	bool exported;          // passed to commands in their environment?
+	int envidx;             // index in envp, if exported
+	struct Var *next;       // next variable in the same hash bucket
+};
+
+/*
+ * A token of the control-flow syntax: a simple command, left unexpanded
+ * for parseline() to expand each time that it runs, or a reserved word.
+ */
+struct Tok {
+	int type;               // TCMD, TFOR, TFUNC, or a reserved word
+	char *text;             // command, for's "in WORD ...", or NULL
+	char *name;             // for's variable or the function's name
+	bool heredoc;           // command reads a here-document?
+};
+
+/*
+ * A node of a parsed command list.  An "elif" is a TIF node that is the
+ * "alt" of the one before it.
+ */
+struct Node {
+	int type;               // TCMD, TIF, TWHILE, TUNTIL, TFOR, or TFUNC
+	char *text;             // command line, or for's "in WORD ..."
+	char *name;             // for's variable or the function's name
+	struct Node *cond;      // condition of if, while, and until
+	struct Node *body;      // list run by then, do, or the function
+	struct Node *alt;       // else or elif part of an if
+	struct Node *next;      // next command in the list
+};
+
+/*
+ * A parsed command source, shared by the source cache, the functions that
+ * it defines, and any runs of it in progress, and freed with the last of
+ * them.
+ */
+struct Ast {
+	char *src;              // source text
+	uint32_t hash;          // FNV-1a hash of src
+	struct Node *root;      // the source's command list
+	int refs;               // number of holders
+	unsigned long lastuse;  // astclock value when last used
+};
+
+/*
+ * A shell function.
+ */
+struct Func {
+	char *name;             // name it is called by
+	struct Ast *ast;        // source that defined it
+	struct Node *body;      // its commands, within ast
+	struct Func *next;      // next function in the list
+};
+
+/*
+ * A connection to the job server.
+ */
+struct Client {
+	int fd;                 // connected socket
+	short events;           // poll() events it is watched for
+	struct Buf in;          // bytes received but not yet handled
+	struct Buf out;         // replies not yet sent
+	size_t outpos;          // bytes of out already sent
+	int fds[3];             // file descriptors received for the next job
+	int nfds;               // number of entries in fds
+	uint32_t nextid;        // last job ID given out
+	struct Client *next;    // next client in the list
+};
+
+/*
+ * A job submitted to the job server.
+ */
+struct Sub {
+	struct Client *client;  // submitter, or NULL once it has gone
+	uint32_t id;            // the submitter's ID for the job
+	char *cmdline;          // command line
+	struct Cmd cmd;         // parsed command, until the job starts
+	pid_t pid;              // PID, once the job starts
+	struct Sub *next;       // next job in the queue or running list
 };
 
 typedef volatile struct Job *JobP;
 
+/*
+ * A record of a job that has terminated, written by sigchld_handler() so
+ * that the wait builtin can report its exit status after the job itself has
+ * been deleted from the jobs list.
+ */
+struct Done {
+	pid_t pid;              // PID of the terminated job
+	int jid;                // job ID it had when it terminated
+	int status;             // status as returned by waitpid()
+	double elapsed;         // seconds from its start until it terminated
+	double utime;           // user CPU seconds, from wait4()
+	double stime;           // system CPU seconds, from wait4()
+	long maxrss;            // max resident set in KiB, from wait4()
+	bool bg;                // not in the foreground when it terminated?
+	bool waited;            // already reported by the wait builtin?
+};
+
 /*
  * Define the jobs list using the "volatile" qualifier because it is accessed
  * by a signal handler (as well as the main program).
@@ -61,12 +409,260 @@ typedef volatile struct Job *JobP;
 static volatile struct Job jobs[MAXJOBS];
 static int nextjid = 1;            // next job ID to allocate
 
+/*
+ * The most recent job completions, kept as a circular buffer.  Like the jobs
+ * list, it is written by sigchld_handler().
+ */
+static volatile struct Done donejobs[MAXDONE];
+static volatile unsigned int ndone;   // total completions ever recorded
+
+static volatile sig_atomic_t interrupted;  // ctrl-c with no foreground job
+static int last_status;                    // exit status of the last command
+
 extern char **environ;             // defined by libc
 
 static char prompt[] = "tsh> ";    // command line prompt (DO NOT CHANGE)
 static bool verbose = false;       // If true, print additional output.
+static bool subreaper = false;     // If true, adopt orphaned descendants.
+
+static struct PathDir *pathdirs;   // the directories of PATH, in order
+static int npathdirs;              // number of entries in pathdirs
+
+static struct Var **vartab;        // hash table of shell variables
+static size_t nvarbuckets;         // number of buckets in vartab
+static size_t nvars;               // number of variables in vartab
+static char **envp;                // cached environment of exported vars
+static int envc;                   // number of strings in envp
+static bool envdirty = true;       // has the set of exported vars changed?
+
+static struct Listing listings[GLOBCACHE]; // directory listing cache
+static unsigned long globclock;            // counts listing cache lookups
+
+static struct Watch *watches;      // file descriptors watched by eventloop()
+static int nwatches;               // number of entries in watches
+static int maxwatches;             // allocated size of watches
+static struct Capture *captures;   // captured output of background jobs
+
+static struct Ast *asts[ASTCACHE]; // parsed command source cache
+static unsigned long astclock;     // counts source cache lookups
+static struct Func *funcs;         // shell functions
+static char **posargs;             // running function's name and arguments
+static int nposargs;               // number of strings in posargs
+static int loopdepth;              // loops running in the current function
+static int funcdepth;              // function calls running
+static int loopctl;                // LOOPBREAK, LOOPCONT, FUNCRET, or 0
+static int loopcount;              // loops left for break or continue
+
+static struct Client *clients;     // connections to the job server
+static struct Sub *queue;          // submitted jobs waiting to start
+static struct Sub **queuetail = &queue; // where the next one is queued
+static struct Sub *running;        // submitted jobs that have started
+static int chldpipe[2] = { -1, -1 }; // written to by sigchld_handler()
+
+static int histfd = -1;            // history file, opened for appending
+static struct History *hist;       // index of the history file
+static struct HistPend *histpend;  // command lines waiting on their jobs
+static pid_t lastbg;               // background job started by runcmd()
+
+static struct Sample *samples;     // processes sampled, sorted by PID
+static int nsamples;               // number of entries in samples
+static int maxsamples;             // allocated size of samples
+
+static int poolfd = -1;            // jobserver token pipe, read by the shell
+static int poolfds[2] = { -1, -1 }; // the token pipe as passed to commands
+static int poolsize;               // tokens that the pool holds in all
+static int poolexcess;             // tokens to remove as they come back
+static bool poolwatched;           // is eventloop() watching poolfd?
+static int psitimer = -1;          // timerfd for rechecking pressure
+static bool psiwatched;            // is eventloop() watching psitimer?
+
+static struct Timer *wheel[WHEELSLOTS]; // scheduled commands by due tick
+static long long wheeltick;        // last tick whose timers have run
+static double wheelbase;           // monotime() at tick 0
+static int wheelfd = -1;           // timerfd set for the next due tick
+static int ntimers;                // timers on the wheel
+static int nexttimer = 1;          // next timer ID to allocate
+
+static struct Hook *hooks;         // on-exit hooks of running jobs
+static char *chldtrap;             // action of "trap action CHLD", or NULL
+static unsigned int hookdone;      // completions in donejobs seen by hooks
+static bool atprompt;              // is main() reading a command line?
+
+static struct Coproc *coprocs;     // coprocesses, in the order started
+
+static int simd;                   // SIMD level used by the filter builtins
+
+/*
+ * A process's identity as read from /proc/<pid>/stat.
+ */
+struct Proc {
+	pid_t pid;              // process ID
+	pid_t ppid;             // parent's process ID
+	pid_t pgrp;             // process group ID
+};
+
+/*
+ * The resource usage of a job's processes since their last samples.
+ */
+struct Usage {
+	double cpu;             // CPU seconds used per second
+	double rss;             // resident set size, in bytes
+	double rrate;           // bytes read per second
+	double wrate;           // bytes written per second
+	int nprocs;             // number of processes
+};
+
+/*
+ * The cached /proc files of a process sampled by "jobs -t", and its
+ * counters as of the last sample.
+ */
+struct Sample {
+	pid_t pid;              // process ID
+	int statfd;             // /proc/<pid>/stat
+	int iofd;               // /proc/<pid>/io, or -1 if unreadable
+	int kidsfd;             // /proc/<pid>/task/<pid>/children, or -1
+	unsigned long long ticks;  // user + system CPU time, in clock ticks
+	unsigned long long rbytes; // bytes read
+	unsigned long long wbytes; // bytes written
+	double when;            // time of the last sample, or -1 if none
+	struct Usage last;      // usage as of the last sample
+	bool seen;              // found by the current refresh?
+};
+
+/*
+ * A distinct command line in the history, and statistics on its runs.
+ */
+struct HistCmd {
+	off_t off;              // offset of its text in the history file
+	size_t len;             // length of its text
+	unsigned long count;    // times it was run
+	unsigned long failures; // times it exited with a nonzero status
+	double total;           // total seconds it took
+	int next;               // next command in its hash chain, or -1
+};
+
+/*
+ * A command line that has started a background job, and which is to be
+ * added to the history once the job terminates.
+ */
+struct HistPend {
+	pid_t pid;              // PID of the job
+	time_t when;            // when the command line started
+	char *line;             // command line
+	struct HistPend *next;  // next pending command line
+};
+
+/*
+ * The index of the history file, which is mapped into memory and indexed
+ * incrementally as it grows, including by other shells.  Offsets rather
+ * than pointers are kept, so that the mapping may move.
+ */
+struct History {
+	int fd;                 // history file, for mapping
+	char *map;              // mapping of the history file
+	size_t maplen;          // length of the mapping
+	size_t end;             // bytes of the file indexed
+	off_t *ents;            // offsets of the entries, oldest first
+	size_t nents;           // number of entries
+	size_t maxents;         // allocated size of ents
+	struct HistCmd *cmds;   // distinct command lines, by first use
+	int ncmds;              // number of distinct command lines
+	int maxcmds;            // allocated size of cmds
+	int *tab;               // hash table of cmds, heads of chains or -1
+	int tabsize;            // buckets in tab, a power of two
+	int *sorted;            // cmds in order of their text
+	int nsorted;            // number of cmds in sorted
+	struct {
+		int *ids;       // cmds with a trigram hashing here, ascending
+		int n;          // number of entries in ids
+		int max;        // allocated size of ids
+	} grams[HISTGRAMS];     // trigram index of cmds
+};
+
+/*
+ * A command scheduled by the at or every builtin.  It is kept on the timer
+ * wheel in the slot of its due tick modulo WHEELSLOTS, so a slot holds the
+ * timers of every revolution of the wheel.
+ */
+struct Timer {
+	int id;                 // timer ID, shown as @id
+	long long due;          // tick of the next run
+	long long period;       // ticks between runs, or 0 to run once
+	bool overlap;           // run even while the last run is going?
+	char *spec;             // the time as given, such as "30s"
+	struct Cmd cmd;         // command, whose stdin is reopened for each run
+	char *cmdline;          // command line to show for its jobs
+	pid_t pid;              // PID of the last run, or 0
+	unsigned long runs;     // runs started
+	unsigned long skips;    // runs skipped while the last was going
+	struct Timer *next;     // next timer in the same slot
+};
+
+/*
+ * An action that the on-exit builtin has the shell run when a job
+ * finishes.
+ */
+struct Hook {
+	pid_t pid;              // PID of the job
+	int jid;                // job ID of the job
+	char *action;           // command line to run
+	struct Hook *next;      // next hook, in the order added
+};
+
+/*
+ * A coprocess, a job that the shell keeps running to answer requests.  Its
+ * stdin and stdout are a socket, over which the ask builtin sends requests
+ * and reads replies.
+ */
+struct Coproc {
+	char *name;             // name given to the coproc builtin
+	struct Cmd cmd;         // command, run again if its job dies
+	char *cmdline;          // command line to show for its job
+	int fd;                 // the shell's end of the socket, or -1
+	pid_t pid;              // PID of its job, or 0
+	double start;           // monotime() when its job last started
+	unsigned long requests; // requests answered
+	unsigned long restarts; // times its job was started again
+	struct Buf in;          // replies read ahead
+	size_t inpos;           // start of the unread replies in "in"
+	struct Coproc *next;    // next coprocess, in the order started
+};
+
+/*
+ * The state of a filter builtin that reads lines: grep -F, head, or wc -l.
+ */
+struct Filter {
+	const char *name;       // name of the builtin, for messages
+	int kind;               // FGREP, FHEAD, or FWC
+	const char *pat;        // grep's pattern
+	size_t patlen;          // length of pat
+	const char *prefix;     // file name to print before each line, or NULL
+	bool count;             // grep -c: count the selected lines instead?
+	bool invert;            // grep -v: select the lines that do not match?
+	bool quiet;             // grep: stop at the first selected line?
+	long long lines;        // lines left for head, or lines counted
+	char *in;               // input not yet used
+	size_t insize;          // allocated size of in
+	struct Buf out;         // output not yet written
+	int outfd;              // file for the output
+	bool outpipe;           // is outfd a pipe?
+};
+
+/*
+ * The reserved words, which are recognized only as the first word of a
+ * command.
+ */
+static const char *const keywords[] = {
+	"if", "then", "elif", "else", "fi", "while", "until", "do", "done",
+	"{", "}"
+};
 
-static struct list *paths;
+/*
+ * What "jobs" says that a held job is waiting for, by hold reason.
+ */
+static const char *const holdname[] = {
+	NULL, "job token", "cpu pressure", "memory pressure", "io pressure"
+};
 
 /*
  * The following array can be used to map a signal number to its name.
@@ -111,9 +707,30 @@ static const char *const signame[NSIG] = {
 
 // You must implement the following functions:
 
-static int	builtin_cmd(char **argv);
+static int	builtin_cmd(struct Cmd *cmd);
+static int	do_ask(struct Cmd *cmd);
+static int	do_batch(struct Cmd *cmd);
+static int	do_bench(struct Cmd *cmd);
 static void	do_bgfg(char **argv);
+static int	do_break(char **argv);
+static int	do_coproc(struct Cmd *cmd);
+static int	do_export(char **argv);
+static int	do_filter(struct Cmd *cmd);
+static int	do_output(char **argv);
+static int	do_history(char **argv);
+static int	do_jobs(char **argv);
+static int	do_kill(char **argv);
+static int	do_memo(struct Cmd *cmd);
+static int	do_onexit(char **argv);
+static int	do_schedule(struct Cmd *cmd);
+static int	do_tee(struct Cmd *cmd);
+static int	do_trap(char **argv);
+static int	do_unset(char **argv);
+static int	do_wait(char **argv);
 static void	eval(const char *cmdline);
+static void	runcmd(struct Cmd *cmd, const char *cmdline);
+static pid_t	launch(const struct Cmd *cmd, const char *cmdline, int state,
+		    int *jidp);
 static void	initpath(const char *pathstr);
 static void	waitfg(pid_t pid);
 
@@ -123,10 +740,203 @@ static void	sigtstp_handler(int signum);
 
 // We are providing the following functions to you:
 
-static int	parseline(const char *cmdline, char **argv); 
+static int	parseline(const char *cmdline, struct Cmd *cmd); 
+static const char *expandvar(const char *p, struct Buf *buf);
+static int	readheredoc(const char *delim, int type, bool expand);
+static int	memfdstr(const char *s, size_t len);
+static bool	readline(struct Buf *line);
+
+static bool	eventloop(const sigset_t *mask, int infd);
+static void	addwatch(int fd, short events, void (*handler)(int, void *),
+		    void *arg);
+static void	delwatch(int fd);
+
+static bool	capturing(void);
+static void	newcapture(JobP job, int fd);
+static void	draincapture(int fd, void *arg);
+static struct Capture *getcapture(const char *id);
+static void	freecmd(struct Cmd *cmd);
+static int	waitbatch(pid_t *pids, int *npids, const sigset_t *mask);
+static void	pushword(char ***vecp, int *np, int *maxp, char *word);
 
 static void	sigquit_handler(int signum);
 
+static void	listenjobs(const char *path);
+static void	acceptclient(int fd, void *arg);
+static void	serveclient(int fd, void *arg);
+static void	clientframe(struct Client *client, char type,
+		    const char *payload, uint32_t len);
+static void	startsubs(void);
+static void	reapsubs(int fd, void *arg);
+static void	sendframe(struct Client *client, char type, uint32_t id,
+		    int32_t value, const char *text);
+static bool	flushclient(struct Client *client);
+static void	closeclient(struct Client *client);
+static void	freesub(struct Sub *sub);
+static void	runserver(void);
+
+static bool	jobserver(void);
+static bool	taketoken(void);
+static void	granttokens(int fd, void *arg);
+static void	recheckpressure(int fd, void *arg);
+static int	pressure(void);
+static void	startheld(void);
+static void	watchheld(void);
+static void	releasejob(JobP job);
+
+static bool	histopen(void);
+static void	histrecord(const char *line, time_t when, double start);
+static void	histappend(const char *line, time_t when, int status,
+		    double elapsed);
+static void	histflush(void);
+static bool	histload(void);
+static int	histcmd(const char *text, size_t len);
+static void	histgrams(int id);
+static void	histsort(void);
+static int	cmphist(const void *a, const void *b);
+static int	cmpcount(const void *a, const void *b);
+static double	monotime(void);
+
+static bool	parsewhen(const char *spec, bool clock, double *secsp);
+static long long nowtick(void);
+static void	addtimer(struct Timer *timer);
+static void	armwheel(void);
+static void	firetimers(int fd, void *arg);
+static void	runtimer(struct Timer *timer);
+static bool	deltimer(int id);
+static void	freetimer(struct Timer *timer);
+static void	listtimers(void);
+
+static void	runhooks(void);
+static void	setjobvars(const struct Done *done);
+static void	runaction(const char *action);
+
+static int	startprocsubs(struct Cmd *cmd);
+static void	endprocsubs(struct Cmd *cmd, bool done);
+static void	killprocsubs(JobP job, int status);
+
+static struct Coproc *getcoproc(const char *name);
+static int	startcoproc(struct Coproc *cp);
+static int	restartcoproc(struct Coproc *cp);
+static void	checkcoprocs(void);
+static bool	coprocalive(const struct Coproc *cp);
+static void	freecoproc(struct Coproc *cp);
+static int	coprocio(struct Coproc *cp, const char *s, size_t len);
+static int	coprocreply(struct Coproc *cp, bool framed);
+
+static int	fanout(const char *name, int in, const int *outs, int nouts);
+static int	putall(const char *name, int fd, const char *s, size_t len,
+		    bool pipe);
+static void	holdsigpipe(sigset_t *prev);
+static void	releasesigpipe(const sigset_t *prev);
+
+static bool	isfilter(const char *name);
+static int	filterfd(struct Filter *f, int fd);
+static void	grepbuf(struct Filter *f, const char *s, size_t len);
+static void	filterput(struct Filter *f, const char *s, size_t len);
+static ssize_t	readsome(const char *name, int fd, char *buf, size_t len);
+static bool	isdevnull(int fd);
+static void	setsimd(void);
+static size_t	countlines(const char *s, size_t len);
+static const char *findstr(const char *s, size_t len, const char *pat,
+		    size_t patlen);
+#if defined(__x86_64__)
+static size_t	countsse2(const char *s, size_t len);
+static size_t	countavx2(const char *s, size_t len);
+static const char *findsse2(const char *s, size_t len, const char *pat,
+		    size_t patlen);
+static const char *findavx2(const char *s, size_t len, const char *pat,
+		    size_t patlen);
+#endif
+
+static void	printstats(const char *label, double *v, int n);
+static double	mean(const double *v, int n);
+static double	stddev(const double *v, int n);
+static int	cmpdouble(const void *a, const void *b);
+static const char *fmttime(double secs, char *buf, size_t size);
+static double	tvsecs(const struct timeval *tv);
+
+static bool	execdir(struct Buf *dir);
+static void	indexdir(struct PathDir *dir);
+static bool	loadindex(struct PathDir *dir, int fd, const struct stat *st);
+static void	buildindex(struct PathDir *dir, const char *file,
+		    const struct stat *st);
+static void	freeindex(struct PathDir *dir);
+static bool	refreshpath(void);
+static bool	hasexec(const struct PathDir *dir, const char *name);
+static int	findexec(const char *name, struct Buf *path);
+
+static bool	memodir(struct Buf *dir);
+static uint64_t	hashfd(int fd);
+static int	replaymemo(const char *path, const struct Buf *desc);
+static void	storememo(const char *path, const struct Buf *desc, int status,
+		    int outfd, int errfd);
+static void	trimmemo(const char *path, long long max);
+static int	cmpmtime(const void *a, const void *b);
+static int	memotmp(const char *dir);
+static off_t	copyfd(int from, int to, off_t len);
+
+static int	readprocs(struct Proc **procsp);
+static int	countdescendants(const struct Proc *procs, int nprocs,
+		    pid_t pgid);
+static void	killtrees(const pid_t *pgids, int npgids, int signum);
+static struct Sample *getsample(pid_t pid);
+static pid_t	readsample(struct Sample *sample, double now,
+		    struct Usage *usage);
+static void	sampletree(pid_t pid, pid_t pgid, double now,
+		    struct Usage *usage);
+static void	dropsample(struct Sample *sample);
+static void	prunesamples(void);
+static void	listusage(JobP jobs, const bool *mark);
+static const char *fmtsize(double n, char *buf, size_t size);
+static void	bgclass(const struct Cmd *cmd, int *policyp, int *iopriop);
+static void	setclass(pid_t pid, bool group, int policy, int ioprio);
+static int	parsesig(const char *name);
+
+static void	initvars(char **env);
+static struct Var *lookupvar(const char *name, size_t namelen);
+static const char *getvar(const char *name);
+static const char *cmdvar(const struct Cmd *cmd, const char *name);
+static void	setvar(const char *str, bool export);
+static void	unsetvar(const char *name);
+static char	**getenvp(void);
+static void	applyoverrides(char ***envpp, const struct Cmd *cmd);
+static bool	isname(const char *s, size_t len);
+static size_t	varhash(const char *name, size_t len);
+
+static int	globword(const char *pat, struct Cmd *cmd);
+static int	globdir(struct Buf *path, char **comps, int ncomps,
+		    struct Cmd *cmd, size_t *sizep);
+static struct Listing *getlisting(const char *path);
+static bool	hasmeta(const char *pat);
+static bool	matchpat(const char *pat, const char *name);
+static bool	matchone(const char **patp, char c);
+static size_t	argsize(char **argv);
+static size_t	argmax(void);
+static int	cmpstr(const void *a, const void *b);
+
+static int	getast(const char *src, struct Ast **astp);
+static void	releaseast(struct Ast *ast);
+static int	tokenize(const char *src, struct Tok **toksp);
+static const char *cmdend(const char *p, bool *heredocp);
+static const char *subend(const char *p);
+static int	parselist(struct Tok **tokp, struct Node **listp,
+		    bool nested);
+static int	parseif(struct Tok **tokp, struct Node *node);
+static int	expect(struct Tok **tokp, int type);
+static void	freenode(struct Node *node);
+static void	runlist(struct Ast *ast, struct Node *node);
+static void	runloop(struct Ast *ast, struct Node *node);
+static struct Func *getfunc(const char *name);
+static void	callfunc(struct Func *func, struct Cmd *cmd);
+
+static void	bufputc(struct Buf *buf, char c);
+static void	bufputn(struct Buf *buf, const char *s, size_t n);
+
+static void	adddone(JobP job, int status);
+static volatile struct Done *getdone(pid_t pid, int jid);
+static int	exitstatus(int status);
+
 static int	addjob(JobP jobs, pid_t pid, int state, const char *cmdline);
 static void	clearjob(JobP job);
 static int	deletejob(JobP jobs, pid_t pid); 
@@ -134,7 +944,8 @@ static pid_t	fgpid(JobP jobs);
 static JobP	getjobjid(JobP jobs, int jid); 
 static JobP	getjobpid(JobP jobs, pid_t pid);
 static void	initjobs(JobP jobs);
-static void	listjobs(JobP jobs);
+static void	listjobs(JobP jobs, const bool *mark);
+static int	selectjobs(JobP jobs, const char *sel, bool *mark);
 static int	maxjid(JobP jobs); 
 static int	pid2jid(pid_t pid); 
 
@@ -151,6 +962,7 @@ static ssize_t	sio_putl(long v);
 static ssize_t	sio_puts(const char s[]);
 static void	sio_reverse(char s[]);
 static size_t	sio_strlen(const char s[]);
+static ssize_t	sio_writen(int fd, const void *buf, size_t n);
 
 /*
  * Requires:
@@ -168,9 +980,14 @@ main(int argc, char **argv)
 {
 	struct sigaction action;
 	int c;
-	char cmdline[MAXLINE];
-	char *path = NULL;
+	struct Buf cmdline = { NULL, 0, 0 };
+	struct Buf line = { NULL, 0, 0 };
+	struct Ast *ast;
+	int r;
+	time_t when;
+	double start;
 	bool emit_prompt = true;	// Emit a prompt by default.
+	const char *sockpath = NULL;	// Don't serve jobs by default.
 
 	/*
 	 * Redirect stderr to stdout (so that driver will get all output
@@ -179,7 +996,7 @@ main(int argc, char **argv)
 	dup2(1, 2);
 
 	// Parse the command line.
-	while ((c = getopt(argc, argv, "hvp")) != -1) {
+	while ((c = getopt(argc, argv, "hvpsl:")) != -1) {
 		switch (c) {
 		case 'h':             // Print a help message.
 			usage();
@@ -191,6 +1008,12 @@ main(int argc, char **argv)
 			// This is handy for automatic testing.
 			emit_prompt = false;
 			break;
+		case 's':             // Reap and track orphaned descendants.
+			subreaper = true;
+			break;
+		case 'l':             // Serve jobs on a socket.
+			sockpath = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -260,30 +1083,79 @@ main(int argc, char **argv)
 	if (sigaction(SIGQUIT, &action, NULL) < 0)
 		unix_error("sigaction error");
 	
+	/*
+	 * Become a child subreaper, so that the descendants of a job whose
+	 * leader has exited are re-parented to the shell rather than to init.
+	 * They can then still be reaped, counted, and killed as part of the job.
+	 */
+	if (subreaper && prctl(PR_SET_CHILD_SUBREAPER, 1) == -1)
+		unix_error("prctl error");
+
+	// Initialize the shell variables from the environment.
+	initvars(environ);
+
 	// Initialize the search path.
-	path = getenv("PATH");
-	initpath(path);
+	initpath(getvar("PATH") != NULL ? getvar("PATH") : "");
 	
 	// Initialize the jobs list.
 	initjobs(jobs);
 
+	// Serve jobs submitted by other processes.
+	if (sockpath != NULL)
+		listenjobs(sockpath);
+
 	// Execute the shell's read/eval loop.
 	while (true) {
 		
+		// Run the hooks of the jobs that finished during the last line.
+		runhooks();
+
+		// Start again the coprocesses whose jobs have died.
+		checkcoprocs();
+
+		// Log the command lines whose background jobs have finished.
+		histflush();
+
 		// Read the command line.
 		if (emit_prompt) {
 			printf("%s", prompt);
 			fflush(stdout);
 		}
-		if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-			app_error("fgets error");
-		if (feof(stdin)) { // End of file (ctrl-d)
+		atprompt = true;
+		r = readline(&cmdline);
+		atprompt = false;
+		if (!r) { // End of file (ctrl-d)
 			fflush(stdout);
+			if (sockpath != NULL)
+				runserver();
 			exit(0);
 		}
 
+		// Read more lines while a compound command is unfinished.
+		while ((r = getast(cmdline.s, &ast)) == 0) {
+			if (emit_prompt) {
+				printf("> ");
+				fflush(stdout);
+			}
+			if (!readline(&line)) {
+				printf("Syntax error: unexpected end of "
+				    "file\n");
+				break;
+			}
+			bufputn(&cmdline, line.s, line.len);
+		}
+
 		// Evaluate the command line.
-		eval(cmdline);
+		if (r == 1) {
+			interrupted = 0;
+			lastbg = 0;
+			when = time(NULL);
+			start = monotime();
+			runlist(ast, ast->root);
+			histrecord(cmdline.s, when, start);
+			releaseast(ast);
+		} else
+			last_status = 2;
 		fflush(stdout);
 		fflush(stdout);
 	}
@@ -307,42 +1179,179 @@ main(int argc, char **argv)
  *   cmdline: The text from the command line to be passed to parseline
  *
  * Effects:
- *   First checks if the cmdline contains a built in command. If so, 
- *	 execute it and move on to the next command line. If not, we assume 
- *   that the first argument must be a command, and we run the command on 
- *   the paths in initpath. Fork to a child process, and parent process
- *   will wait depending on whether or not parseline returns a background
- *   job or foreground job. Calls waitfg to do this. 
+ *   First checks if the cmdline calls a shell function or contains a built
+ *   in command. If so, run it in the shell and move on to the next command
+ *   line. If the cmdline holds
+ *   only "NAME=value" assignments, sets those shell variables. If not, we
+ *   assume that the first argument must be a command, and launch runs it
+ *   as a new job. The parent process will wait depending on whether or
+ *   not parseline returns a background job or foreground job. Calls waitfg
+ *   to do this. 
  */
 static void
 eval(const char *cmdline) 
 {
-	char *argv[MAXARGS];
-	int bg = parseline(cmdline, argv);
-	pid_t pid; //, childpid;
+	struct Cmd cmd;
 
-	if (argv[0] == NULL) {
-		// Ignore empty console input.
+	if (parseline(cmdline, &cmd) == -1) {
+		last_status = 2;
 		return;
 	}
+	runcmd(&cmd, cmdline);
+	freecmd(&cmd);
+}
+
+/* 
+ * runcmd - Run a parsed command.
+ *
+ * Requires:
+ *   "cmd" is a command from parseline(), and "cmdline" is the command line
+ *   to show for its job.
+ *
+ * Effects:
+ *   Does the work of eval() once the command line is parsed: sets the
+ *   variables of a bare assignment, calls a function, runs a builtin, or
+ *   launches a job and, unless it is a background job, waits for it.  The
+ *   jobs of the command's process substitutions are started first, except
+ *   for at and every, which start them anew for each run.
+ */
+static void
+runcmd(struct Cmd *cmd, const char *cmdline)
+{
+	struct Func *func;
+	pid_t pid;
+	int i, jid;
+	bool deferred;
 
+	lastbg = 0;
+	if (cmd->argc == 0) {
+		// Bare assignments set shell variables.
+		for (i = 0; i < cmd->nassigns; i++)
+			setvar(cmd->assigns[i], false);
+		if (cmd->nassigns > 0)
+			last_status = 0;
+		return;
+	}
 
-	if (strcmp(argv[0],"quit") == 0 || (strcmp(argv[0],"jobs") == 0 ||
-		strcmp(argv[0],"bg") == 0 || strcmp(argv[0],"fg") == 0)) {
-		builtin_cmd(argv);
+	deferred = strcmp(cmd->argv[0], "at") == 0 ||
+	    strcmp(cmd->argv[0], "every") == 0;
+	if (!deferred && startprocsubs(cmd) == -1) {
+		last_status = 2;
 		return;
-	} 
+	}
+	if ((func = getfunc(cmd->argv[0])) != NULL) {
+		callfunc(func, cmd);
+		endprocsubs(cmd, true);
+		return;
+	}
+	if (builtin_cmd(cmd)) {
+		if (!deferred)
+			endprocsubs(cmd, true);
+		return;
+	}
 
 	// Not a built-in command,
 
+	pid = launch(cmd, cmdline, cmd->bg ? BG : FG, &jid);
+	// The job owns its substitutions now and ends them when it finishes.
+	endprocsubs(cmd, pid == 0);
+	if (pid != 0) {
+		if (!cmd->bg) {
+			//Run in foreground
+			waitfg(pid);
+		} else {
+			// Here we print the job information after adding.
+			printf("[%i] (%i) %s", jid, pid, cmdline);
+			last_status = 0;
+			lastbg = pid;
+		}
+	}
+	// Either is a bg task, or fg task finished. 
+}
+
+/* 
+ * launch - Start a job running a command.
+ *
+ * Requires:
+ *   "cmd" is a command from parseline() that is not a builtin, "cmdline" is
+ *   the command line to show for the job, and "state" is FG or BG.
+ *
+ * Effects:
+ *   Forks a child in a new process group to run the command, and adds it to
+ *   the jobs list in "state".  The child runs the command that findexec()
+ *   found, or else searches the directories of PATH, or of a PATH
+ *   assignment on the command, for it, and runs it
+ *   with the command's assignments added to its environment and any
+ *   here-document as its stdin, and, if it is a background job in capture
+ *   mode, sends its output to the shell.  Files
+ *   that the command has for its stdout and stderr take precedence.  A
+ *   background job started while pressure() is high, or, if the jobserver
+ *   is on, when no token is free in its pool, waits before exec until
+ *   startheld() or the fg command releases it.  A background job runs in
+ *   the scheduling class given by bgclass().  The job inherits the pipes
+ *   of the command's process substitutions, whose jobs killprocsubs()
+ *   ends when it finishes.
+ *   Returns the child's PID and stores its job ID in "*jidp", or returns 0
+ *   if the job could not be added.
+ */
+static pid_t
+launch(const struct Cmd *cmd, const char *cmdline, int state, int *jidp)
+{
+	char **cenvp;
+	const char *pathover;
+	JobP job;
+	pid_t pid;
+	int cappipe[2] = { -1, -1 };
+	int gate[2] = { -1, -1 };
+	static struct Buf exec;
+	bool pooled, token = false;
+	int found, hold, k, policy, ioprio;
+	char c;
+
+	// The jobserver may change MAKEFLAGS, so consult it first.
+	pooled = jobserver() && state == BG;
+
+	// Bring the cached environment up to date before the child copies it.
+	cenvp = getenvp();
+
+	// A PATH assignment on the command line replaces PATH for its lookup.
+	for (k = 0, pathover = NULL; k < cmd->nassigns; k++)
+		if (strncmp(cmd->assigns[k], "PATH=", 5) == 0)
+			pathover = cmd->assigns[k] + 5;
+
+	// Look the command up while the shell can still refresh the index.
+	found = strchr(cmd->argv[0], '/') == NULL && pathover == NULL ?
+	    findexec(cmd->argv[0], &exec) : -1;
+
+	// In capture mode, a background job writes to a pipe to the shell.
+	if (cmd->bg && capturing() && pipe2(cappipe, O_CLOEXEC) == -1)
+		unix_error("pipe error in launch");
+
+	bgclass(cmd, &policy, &ioprio);
+
+	// A held background job waits for a byte on its gate.
+	hold = state == BG ? pressure() : 0;
+	if (hold == 0 && pooled && !(token = taketoken()))
+		hold = HOLDTOKEN;
+	if (hold != 0 && pipe2(gate, O_CLOEXEC) == -1)
+		unix_error("pipe error in launch");
+
 	sigset_t temp; 
+	if (sigemptyset(&temp) == -1) {
+		unix_error("error on sigemptyset in launch");
+	}
 	if (sigaddset(&temp, SIGCHLD) == -1) {
-		unix_error("error on sigaddset in eval"); 
+		unix_error("error on sigaddset in launch"); 
 	}
 
-	
+	/*
+	 * A ctrl-c or ctrl-z that arrives before the job is added would find
+	 * no foreground job and be lost, so it is held until then as well.
+	 */
+	if (sigaddset(&temp, SIGINT) == -1 || sigaddset(&temp, SIGTSTP) == -1)
+		unix_error("error on sigaddset in launch");
 	if (sigprocmask(SIG_BLOCK, &temp, NULL) == -1) {
-		unix_error("error on sigprocmask in eval");
+		unix_error("error on sigprocmask in launch");
 	}
 	// Blocking here to avoid datarace if child executes before addjob.
 	pid = fork();
@@ -351,117 +1360,592 @@ eval(const char *cmdline)
 		// Child
 		setpgid(0,0);
 		if (sigprocmask(SIG_UNBLOCK, &temp, NULL) == -1) {
-			unix_error("error on sigprocmask in eval");
+			unix_error("error on sigprocmask in launch");
 		}
 
-		// Try to execute on every path in path. 
-
-		struct list *head;
-		execve(argv[0],argv,environ);
-		char* temppath;
-		for (head = paths; head != NULL && head->name != NULL; head = head->tail_list) {
-			temppath = malloc(strlen(head->name) * 4 + strlen(argv[0]) * 4 + 8);
-			temppath = strcpy(temppath, head->name);
-			temppath = strcat(temppath,"/");
-			temppath = strcat(temppath, argv[0]);
-			execve(temppath, argv, environ);
-			//Sio_puts(temppath);
-			//Sio_puts("\n");
-			free(temppath);
+		/*
+		 * Layer the command's own assignments over the environment.
+		 * The child has its own copy-on-write copy of envp, so it is
+		 * patched in place rather than copied.
+		 */
+		applyoverrides(&cenvp, cmd);
+		if (cmd->infd != -1 && dup2(cmd->infd, STDIN_FILENO) == -1)
+			unix_error("dup2 error in launch");
+		if (cappipe[1] != -1 &&
+		    (dup2(cappipe[1], STDOUT_FILENO) == -1 ||
+		    dup2(cappipe[1], STDERR_FILENO) == -1))
+			unix_error("dup2 error in launch");
+		if ((cmd->outfd != -1 &&
+		    dup2(cmd->outfd, STDOUT_FILENO) == -1) ||
+		    (cmd->errfd != -1 && dup2(cmd->errfd, STDERR_FILENO) == -1))
+			unix_error("dup2 error in launch");
+		if (gate[0] != -1) {
+			// The shell's handlers must not run in the waiting child.
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTSTP, SIG_DFL);
+			signal(SIGCHLD, SIG_DFL);
+			signal(SIGQUIT, SIG_DFL);
+			while (read(gate[0], &c, 1) == -1 && errno == EINTR)
+				;
+		}
 
+		/*
+		 * Run the command that the index found.  If the index could
+		 * not tell, or is out of date, try every directory in PATH,
+		 * or in the command's own PATH assignment, where an empty
+		 * entry is the current directory.
+		 */
+		char **argv = cmd->argv;
+		char temppath[PATH_MAX];
+		const char *p, *end;
+		int i;
+		if (found == -1 && strchr(argv[0], '/') != NULL)
+			execve(argv[0], argv, cenvp);
+		else if (found == 1)
+			execve(exec.s, argv, cenvp);
+		for (p = pathover; p != NULL &&
+		    strchr(argv[0], '/') == NULL; p = end + 1) {
+			if ((end = strchr(p, ':')) == NULL)
+				end = p + strlen(p);
+			if (snprintf(temppath, sizeof(temppath), "%.*s/%s",
+			    end == p ? 1 : (int)(end - p), end == p ? "." : p,
+			    argv[0]) < (int)sizeof(temppath))
+				execve(temppath, argv, cenvp);
+			if (*end == '\0')
+				break;
+		}
+		for (i = 0; i < npathdirs && found != 0 && pathover == NULL &&
+		    strchr(argv[0], '/') == NULL; i++) {
+			if (snprintf(temppath, sizeof(temppath), "%s/%s",
+			    pathdirs[i].path, argv[0]) < (int)sizeof(temppath))
+				execve(temppath, argv, cenvp);
 		}
 		// Should never make it past the execve calls unless command DNE.
 		Sio_puts(argv[0]);
 		Sio_puts(": Command not found\n");
-		exit(0);
+		exit(127);
 		
-	} else {
-		// Parent
-		if (addjob(jobs, pid, bg+1, cmdline) == 0) {
-			// addjob can fail if we have more than the allotted number of jobs
-			// in the jobs struct. 
-			return;
-		} 
+	}
 
-		// Continue handling the job. 
+	// Parent
+	if (cappipe[1] != -1)
+		close(cappipe[1]);
+	/*
+	 * The shell, not just the child, puts the child in its process group,
+	 * and the shell alone sets the child's class, so that a later fg or
+	 * bg finds the group and cannot be undone by a child yet to run.
+	 */
+	setpgid(pid, pid);
+	if (state == BG)
+		setclass(pid, false, policy, ioprio);
+	if (addjob(jobs, pid, state, cmdline) == 0) {
+		// addjob can fail if we have more than the allotted number of jobs
+		// in the jobs struct. 
 		if (sigprocmask(SIG_UNBLOCK, &temp, NULL) == -1) {
-			unix_error("error on sigprocmask in eval");
+			unix_error("error on sigprocmask in launch");
 		}
-		if (bg == 0) {
-			//Run in foreground
-			waitfg(pid);
-		} else {
-			// Here we print the job information after adding.
-			printf("[%i] (%i) %s", getjobpid(jobs,pid)->jid, pid, cmdline);
+		if (cappipe[0] != -1)
+			close(cappipe[0]);
+		if (token)
+			write(poolfds[1], "+", 1);
+		if (gate[0] != -1) {
+			write(gate[1], "", 1);
+			close(gate[0]);
+			close(gate[1]);
 		}
+		return (0);
+	} 
+	if (cappipe[0] != -1)
+		newcapture(getjobpid(jobs, pid), cappipe[0]);
+	getjobpid(jobs, pid)->token = token;
+	getjobpid(jobs, pid)->policy = policy;
+	getjobpid(jobs, pid)->ioprio = ioprio;
+	job = getjobpid(jobs, pid);
+	job->sub = cmd->sub;
+	for (k = 0; k < cmd->nsubs; k++) {
+		job->subs[k] = cmd->subs[k].pid;
+		job->subsout[k] = cmd->subs[k].out;
 	}
-	return; // Either is a bg task, or fg task finished. 
-}
+	job->nsubs = cmd->nsubs;
+	if (gate[0] != -1) {
+		close(gate[0]);
+		getjobpid(jobs, pid)->gatefd = gate[1];
+		getjobpid(jobs, pid)->hold = hold;
+		watchheld();
+	}
+	// The job may be reaped as soon as SIGCHLD is unblocked.
+	*jidp = getjobpid(jobs, pid)->jid;
 
+	// Continue handling the job. 
+	if (sigprocmask(SIG_UNBLOCK, &temp, NULL) == -1) {
+		unix_error("error on sigprocmask in launch");
+	}
+	return (pid);
+}
 
 /* 
  * parseline - Parse the command line and build the argv array.
  *
  * Requires:
- *   "cmdline" is a NUL ('\0') terminated string with a trailing
- *   '\n' character.  "cmdline" must contain less than MAXARGS
- *   arguments.
+ *   "cmdline" is a NUL ('\0') terminated string.
  *
  * Effects:
- *   Builds "argv" array from space delimited arguments on the command line.
- *   The final element of "argv" is set to NULL.  Characters enclosed in
- *   single quotes are treated as a single argument.  Returns true if
- *   the user has requested a BG job and false if the user has requested
- *   a FG job.
+ *   Splits the command line into space delimited words and stores them in
+ *   "cmd", which must later be released with freecmd().  Characters
+ *   enclosed in single quotes are taken literally, and characters enclosed
+ *   in double quotes are taken literally except for "$" expansions and
+ *   backslash escapes of '"', '\\', and '$'.  Outside of quotes, a
+ *   backslash escapes the next character.  Shell variables are expanded by
+ *   expandvar().  Words of the form "NAME=value" that precede the command
+ *   name are stored as assignments rather than as arguments.  Other words
+ *   containing an unquoted '*', '?', or '[' are expanded by globword() into
+ *   the sorted list of matching paths.  A word introduced by "<<<" becomes
+ *   the command's stdin, and one introduced by "<<" or "<<-" is the
+ *   delimiter of a here-document whose body is read by readheredoc() from
+ *   the lines that follow.  A word "<(command)" or ">(command)", whose
+ *   command may contain spaces, quotes, and further substitutions, is a
+ *   process substitution, which runcmd() has startprocsubs() replace.  An
+ *   unquoted '&' requests a BG job.
+ *   Returns true if the user has requested a BG job, false if the user has
+ *   requested a FG job, and -1 (after printing a message) if the command
+ *   line has an unterminated quote or expands beyond ARG_MAX.
  */
 static int
-parseline(const char *cmdline, char **argv) 
+parseline(const char *cmdline, struct Cmd *cmd) 
 {
-	int argc;                   // number of args
-	int bg;                     // background job?
-	static char array[MAXLINE]; // local copy of command line
-	char *buf = array;          // ptr that traverses command line
-	char *delim;                // points to first space delimiter
+	struct Buf word = { NULL, 0, 0 };
+	struct Buf pat = { NULL, 0, 0 };   // the word as a glob pattern
+	const char *p = cmdline, *q;
+	struct {
+		char *delim;        // line that ends the body
+		int type;           // HEREDOC or HERETAB
+		bool expand;        // expand "$" in the body?
+	} heredocs[MAXHEREDOCS];
+	size_t mark;
+	int i, fd, nmatches, nheredocs = 0, redir;
+	bool quoted;                // does the word contain any quotes?
+	bool assign;                // is the word an assignment?
+	bool glob;                  // does it contain unquoted *, ?, or [?
 
-	strcpy(buf, cmdline);
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->infd = cmd->outfd = cmd->errfd = -1;
+	pushword(&cmd->argv, &cmd->argc, &cmd->argmax, NULL);
 
-	// Replace trailing '\n' with space.
-	buf[strlen(buf) - 1] = ' ';
+	for (;;) {
+		// Ignore spaces.
+		while (*p == ' ' || *p == '\t' || *p == '\n')
+			p++;
+		if (*p == '\0')
+			break;
+		if (*p == '&') {
+			cmd->bg = true;
+			p++;
+			continue;
+		}
 
-	// Ignore leading spaces.
-	while (*buf != '\0' && *buf == ' ')
-		buf++;
+		// Is the word the target of a here-document redirection?
+		redir = 0;
+		if (strncmp(p, "<<<", 3) == 0) {
+			redir = HERESTR;
+			p += 3;
+		} else if (strncmp(p, "<<-", 3) == 0) {
+			redir = HERETAB;
+			p += 3;
+		} else if (strncmp(p, "<<", 2) == 0) {
+			redir = HEREDOC;
+			p += 2;
+		}
+		if (redir != 0) {
+			while (*p == ' ' || *p == '\t')
+				p++;
+			if (*p == '\0' || *p == '\n' || *p == '&') {
+				printf("Syntax error: missing here-document "
+				    "word\n");
+				goto error;
+			}
+		} else if ((*p == '<' || *p == '>') && p[1] == '(') {
+			// The word stays as it is until the job starts.
+			if ((q = subend(p + 2)) == NULL) {
+				printf("Syntax error: unterminated process "
+				    "substitution\n");
+				goto error;
+			}
+			if (cmd->nsubs == MAXPROCSUBS) {
+				printf("Syntax error: too many process "
+				    "substitutions\n");
+				goto error;
+			}
+			cmd->subs[cmd->nsubs].text = strndup(p + 2,
+			    q - (p + 2));
+			cmd->subs[cmd->nsubs].out = *p == '>';
+			cmd->subs[cmd->nsubs].argi = cmd->argc;
+			cmd->subs[cmd->nsubs].fd = -1;
+			cmd->subs[cmd->nsubs].pid = 0;
+			cmd->nsubs++;
+			pushword(&cmd->argv, &cmd->argc, &cmd->argmax,
+			    strndup(p, q + 1 - p));
+			p = q + 1;
+			continue;
+		}
 
-	// Build the argv list.
-	argc = 0;
-	if (*buf == '\'') {
-		buf++;
-		delim = strchr(buf, '\'');
-	} else
-		delim = strchr(buf, ' ');
-	while (delim != NULL) {
-		argv[argc++] = buf;
-		*delim = '\0';
-		buf = delim + 1;
-		while (*buf != '\0' && *buf == ' ')	// Ignore spaces.
-			buf++;
-		if (*buf == '\'') {
-			buf++;
-			delim = strchr(buf, '\'');
-		} else
-			delim = strchr(buf, ' ');
-	}
-	argv[argc] = NULL;
+		// Build the next word.
+		word.len = 0;
+		bufputn(&word, "", 0);
+		quoted = assign = glob = false;
+		pat.len = 0;
+		bufputn(&pat, "", 0);
+		while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' &&
+		    *p != '&') {
+			mark = word.len;
+			switch (*p) {
+			case '\'':
+				if ((q = strchr(p + 1, '\'')) == NULL)
+					goto unterminated;
+				bufputn(&word, p + 1, q - (p + 1));
+				p = q + 1;
+				quoted = true;
+				break;
+			case '"':
+				for (p++; *p != '"'; ) {
+					if (*p == '\0')
+						goto unterminated;
+					if (*p == '\\' && p[1] != '\0' &&
+					    strchr("\"\\$", p[1]) != NULL) {
+						bufputc(&word, p[1]);
+						p += 2;
+					} else if (*p == '$')
+						p = expandvar(p, &word);
+					else
+						bufputc(&word, *p++);
+				}
+				p++;
+				quoted = true;
+				break;
+			case '\\':
+				if (p[1] != '\0' && p[1] != '\n')
+					bufputc(&word, *++p);
+				p++;
+				quoted = true;
+				break;
+			case '$':
+				p = expandvar(p, &word);
+				break;
+			case '=':
+				// Only an unquoted NAME before the first '='.
+				if (!quoted && !assign && cmd->argc == 0 &&
+				    isname(word.s, word.len))
+					assign = true;
+				bufputc(&word, *p++);
+				bufputc(&pat, '=');
+				continue;
+			default:
+				if (*p == '*' || *p == '?' || *p == '[')
+					glob = true;
+				bufputc(&pat, *p);
+				bufputc(&word, *p++);
+				continue;
+			}
 
-	// Ignore blank line.
-	if (argc == 0)
-		return (1);
+			/*
+			 * Quoted and expanded text is matched literally by
+			 * globbing, so escape any pattern characters in it.
+			 */
+			for (; mark < word.len; mark++) {
+				if (strchr("*?[]\\", word.s[mark]) != NULL)
+					bufputc(&pat, '\\');
+				bufputc(&pat, word.s[mark]);
+			}
+		}
+
+		if (redir == HERESTR) {
+			// The word itself, plus a newline, is the input.
+			bufputc(&word, '\n');
+			if ((fd = memfdstr(word.s, word.len)) == -1)
+				goto error;
+			if (cmd->infd != -1)
+				close(cmd->infd);
+			cmd->infd = fd;
+			continue;
+		} else if (redir != 0) {
+			// The body follows the command line.
+			if (nheredocs == MAXHEREDOCS) {
+				printf("Syntax error: too many here-documents\n");
+				goto error;
+			}
+			heredocs[nheredocs].delim = strdup(word.s);
+			heredocs[nheredocs].type = redir;
+			heredocs[nheredocs].expand = !quoted;
+			nheredocs++;
+			continue;
+		}
+
+		// An unquoted expansion to nothing is not a word.
+		if (word.len == 0 && !quoted)
+			continue;
+		if (assign) {
+			pushword(&cmd->assigns, &cmd->nassigns,
+			    &cmd->assignmax, strdup(word.s));
+		} else if (!glob || (nmatches = globword(pat.s, cmd)) == 0) {
+			// A pattern that matches nothing is kept as is.
+			pushword(&cmd->argv, &cmd->argc, &cmd->argmax,
+			    strdup(word.s));
+		} else if (nmatches == -1)
+			goto toolong;
+	}
+	free(word.s);
+	free(pat.s);
+
+	// Read the bodies of the here-documents, in order.
+	for (i = 0; i < nheredocs; i++) {
+		fd = readheredoc(heredocs[i].delim, heredocs[i].type,
+		    heredocs[i].expand);
+		free(heredocs[i].delim);
+		heredocs[i].delim = NULL;
+		if (fd == -1)
+			goto error;
+		if (cmd->infd != -1)
+			close(cmd->infd);
+		cmd->infd = fd;
+	}
+	return (cmd->bg);
+
+toolong:
+	printf("%s: Argument list too long\n", word.s);
+	goto error;
+
+unterminated:
+	printf("Syntax error: unterminated quote\n");
+error:
+	for (i = 0; i < nheredocs; i++)
+		free(heredocs[i].delim);
+	free(word.s);
+	free(pat.s);
+	freecmd(cmd);
+	return (-1);
+}
+
+/*
+ * Requires:
+ *   "delim" is a properly terminated string, and "type" is HEREDOC or
+ *   HERETAB.
+ *
+ * Effects:
+ *   Reads the body of a here-document from the input, up to a line equal
+ *   to "delim", and returns a sealed memfd holding it, positioned at its
+ *   start.  For HERETAB, leading tabs are stripped from every line.  If
+ *   "expand" is true, "$" expressions in the body are expanded and a
+ *   backslash escapes '$' and '\\'.  Returns -1 (after printing a message)
+ *   if the memfd cannot be created.
+ */
+static int
+readheredoc(const char *delim, int type, bool expand)
+{
+	struct Buf line = { NULL, 0, 0 };
+	struct Buf body = { NULL, 0, 0 };
+	const char *p;
+	size_t len;
+	int fd;
+
+	bufputn(&body, "", 0);
+	for (;;) {
+		if (!readline(&line)) {
+			printf("Warning: here-document delimited by "
+			    "end-of-file (wanted '%s')\n", delim);
+			break;
+		}
+		p = line.s;
+		if (type == HERETAB)
+			p += strspn(p, "\t");
+		len = strcspn(p, "\n");
+		if (len == strlen(delim) && strncmp(p, delim, len) == 0)
+			break;
+		if (!expand) {
+			bufputn(&body, p, strlen(p));
+			continue;
+		}
+		while (*p != '\0') {
+			if (*p == '\\' && (p[1] == '$' || p[1] == '\\')) {
+				bufputc(&body, p[1]);
+				p += 2;
+			} else if (*p == '$')
+				p = expandvar(p, &body);
+			else
+				bufputc(&body, *p++);
+		}
+	}
+	fd = memfdstr(body.s, body.len);
+	free(line.s);
+	free(body.s);
+	return (fd);
+}
+
+/*
+ * Requires:
+ *   "s" points to at least "len" characters.
+ *
+ * Effects:
+ *   Returns a new memfd holding the first "len" characters of "s",
+ *   positioned at its start.  The memfd is sealed, so that it can be
+ *   handed to a child as stdin without the data ever being copied to a
+ *   pipe or a file.  Returns -1 (after printing a message) on error.
+ */
+static int
+memfdstr(const char *s, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	if ((fd = memfd_create("tsh-heredoc", MFD_CLOEXEC |
+	    MFD_ALLOW_SEALING)) == -1) {
+		printf("memfd_create error: %s\n", strerror(errno));
+		return (-1);
+	}
+	while (len > 0) {
+		if ((n = write(fd, s, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			printf("here-document write error: %s\n",
+			    strerror(errno));
+			close(fd);
+			return (-1);
+		}
+		s += n;
+		len -= n;
+	}
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+	    F_SEAL_WRITE | F_SEAL_SEAL) == -1 ||
+	    lseek(fd, 0, SEEK_SET) == -1) {
+		printf("here-document seal error: %s\n", strerror(errno));
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * Requires:
+ *   "p" points to a '$' in a command line, and "buf" is a valid Buf.
+ *
+ * Effects:
+ *   Expands the "$" expression at "p", appending its value to "buf", and
+ *   returns a pointer to the character following the expression.  The
+ *   expressions are "$NAME" and "${NAME}" for shell variables, "$?" for
+ *   the exit status of the last command, "$$" for the shell's PID, and
+ *   "$N", "${N}", and "$#" for the running function's name and arguments
+ *   and the number of arguments.  Unset variables expand to nothing, and a
+ *   '$' that does not start an expression is kept as is.
+ */
+static const char *
+expandvar(const char *p, struct Buf *buf)
+{
+	struct Var *var;
+	const char *name, *end;
+	char num[32];
+	int i;
+
+	name = p + 1;
+	if (*name == '?' || *name == '$' || *name == '#') {
+		snprintf(num, sizeof(num), "%d", *name == '?' ? last_status :
+		    *name == '$' ? (int)getpid() :
+		    nposargs > 0 ? nposargs - 1 : 0);
+		bufputn(buf, num, strlen(num));
+		return (name + 1);
+	}
+	if (isdigit((unsigned char)*name) || (*name == '{' &&
+	    isdigit((unsigned char)name[1]) &&
+	    name[1 + strspn(name + 1, "0123456789")] == '}')) {
+		if (*name == '{') {
+			i = atoi(name + 1);
+			p = strchr(name, '}') + 1;
+		} else {
+			i = *name - '0';
+			p = name + 1;
+		}
+		if (i < nposargs)
+			bufputn(buf, posargs[i], strlen(posargs[i]));
+		return (p);
+	}
+	if (*name == '{') {
+		name++;
+		if ((end = strchr(name, '}')) == NULL ||
+		    !isname(name, end - name)) {
+			bufputc(buf, '$');
+			return (p + 1);
+		}
+		p = end + 1;
+	} else {
+		for (end = name; isalnum((unsigned char)*end) || *end == '_';
+		    end++)
+			continue;
+		if (!isname(name, end - name)) {
+			bufputc(buf, '$');
+			return (p + 1);
+		}
+		p = end;
+	}
+	if ((var = lookupvar(name, end - name)) != NULL)
+		bufputn(buf, var->str + var->namelen + 1,
+		    strlen(var->str + var->namelen + 1));
+	return (p);
+}
+
+/*
+ * Requires:
+ *   "cmd" was filled in by parseline().
+ *
+ * Effects:
+ *   Frees the words held by "cmd", and closes its here-document and any
+ *   other files for its stdio.
+ */
+static void
+freecmd(struct Cmd *cmd)
+{
+	int i;
+
+	for (i = 0; i < cmd->nsubs; i++)
+		free(cmd->subs[i].text);
+	cmd->nsubs = 0;
+	for (i = 0; i < cmd->argc; i++)
+		free(cmd->argv[i]);
+	for (i = 0; i < cmd->nassigns; i++)
+		free(cmd->assigns[i]);
+	if (cmd->infd != -1)
+		close(cmd->infd);
+	if (cmd->outfd != -1)
+		close(cmd->outfd);
+	if (cmd->errfd != -1)
+		close(cmd->errfd);
+	cmd->infd = cmd->outfd = cmd->errfd = -1;
+	free(cmd->argv);
+	free(cmd->assigns);
+	cmd->argv = cmd->assigns = NULL;
+	cmd->argc = cmd->nassigns = 0;
+}
 
-	// Should the job run in the background?
-	if ((bg = (*argv[argc - 1] == '&')) != 0)
-		argv[--argc] = NULL;
+/*
+ * Requires:
+ *   "*vecp" is a NULL-terminated array of "*np" words, allocated with
+ *   "*maxp" entries (or NULL, with both counts 0).
+ *
+ * Effects:
+ *   Appends "word" to the array, growing it as necessary, and keeps it
+ *   NULL-terminated.  A NULL "word" just makes sure that the array exists.
+ */
+static void
+pushword(char ***vecp, int *np, int *maxp, char *word)
+{
 
-	return (bg);
+	if (word == NULL && *np > 0)
+		return;
+	if (*np + 2 > *maxp) {
+		*maxp = *maxp == 0 ? 16 : *maxp * 2;
+		if ((*vecp = realloc(*vecp, *maxp * sizeof(**vecp))) == NULL)
+			unix_error("realloc error in pushword");
+	}
+	(*vecp)[*np] = word;
+	if (word != NULL)
+		(*np)++;
+	(*vecp)[*np] = NULL;
 }
 
 /* 
@@ -469,543 +1953,8766 @@ parseline(const char *cmdline, char **argv)
  *  it immediately.  
  *
  * Requires:
- *   argv, an array of strings representing a tokenized commandline
+ *   cmd, a command from parseline() with at least one word
  *
  * Effects:
- *   Implements the builtin commands: bg and fg call do_bgfg, quit exits, and
- *   jobs calls listjobs.
+ *   Implements the builtin commands: at and every call do_schedule, ask
+ *   calls do_ask, batch calls do_batch, bench calls do_bench, bg and fg
+ *   call do_bgfg, break,
+ *   continue, and return call do_break, cat, grep, head, and wc call
+ *   do_filter, coproc calls do_coproc, quit
+ *   exits, history calls do_history, jobs calls do_jobs, export calls
+ *   do_export, kill calls do_kill, memo calls do_memo, on-exit calls
+ *   do_onexit, output and tail call do_output, tee calls do_tee, trap
+ *   calls do_trap, unset calls do_unset, wait calls do_wait, and true,
+ *   ":", and false just succeed or fail.  Returns 1 if argv[0] was a
+ *   builtin command and 0 otherwise, which includes a filter that
+ *   do_filter() leaves to the external command.
  */
 static int
-builtin_cmd(char **argv) 
+builtin_cmd(struct Cmd *cmd) 
 {
-	if(strcmp(argv[0], "bg") == 0 || strcmp(argv[0], "fg") == 0) {
+	char **argv = cmd->argv;
+	int status;
+
+	if(strcmp(argv[0], "at") == 0 || strcmp(argv[0], "every") == 0) {
+		last_status = do_schedule(cmd);
+	} else if(strcmp(argv[0], "ask") == 0) {
+		last_status = do_ask(cmd);
+	} else if(strcmp(argv[0], "batch") == 0) {
+		last_status = do_batch(cmd);
+	} else if(strcmp(argv[0], "bench") == 0) {
+		last_status = do_bench(cmd);
+	} else if(strcmp(argv[0], "bg") == 0 || strcmp(argv[0], "fg") == 0) {
 		do_bgfg(argv);
+	} else if(strcmp(argv[0], "break") == 0 ||
+	    strcmp(argv[0], "continue") == 0 ||
+	    strcmp(argv[0], "return") == 0) {
+		last_status = do_break(argv);
+	} else if(isfilter(argv[0])) {
+		if ((status = do_filter(cmd)) == -1)
+			return (0);
+		last_status = status;
+	} else if(strcmp(argv[0], "coproc") == 0) {
+		last_status = do_coproc(cmd);
+	} else if(strcmp(argv[0], "true") == 0 || strcmp(argv[0], ":") == 0) {
+		last_status = 0;
+	} else if(strcmp(argv[0], "false") == 0) {
+		last_status = 1;
 	} else if(strcmp(argv[0], "quit") == 0) {
 		exit(0);
+	} else if(strcmp(argv[0], "history") == 0) {
+		last_status = do_history(argv);
 	} else if(strcmp(argv[0], "jobs") == 0) {
-		listjobs(jobs);
+		last_status = do_jobs(argv);
+	} else if(strcmp(argv[0], "export") == 0) {
+		last_status = do_export(argv);
+	} else if(strcmp(argv[0], "kill") == 0) {
+		last_status = do_kill(argv);
+	} else if(strcmp(argv[0], "memo") == 0) {
+		last_status = do_memo(cmd);
+	} else if(strcmp(argv[0], "on-exit") == 0) {
+		last_status = do_onexit(argv);
+	} else if(strcmp(argv[0], "output") == 0 ||
+	    strcmp(argv[0], "tail") == 0) {
+		last_status = do_output(argv);
+	} else if(strcmp(argv[0], "tee") == 0) {
+		last_status = do_tee(cmd);
+	} else if(strcmp(argv[0], "trap") == 0) {
+		last_status = do_trap(argv);
+	} else if(strcmp(argv[0], "unset") == 0) {
+		last_status = do_unset(argv);
+	} else if(strcmp(argv[0], "wait") == 0) {
+		last_status = do_wait(argv);
 	} else {
-		app_error("Not a built-in command");
-		return(1);
+		return(0);
 	}
-	return(0);
+	return(1);
 }
 
 /* 
- * do_bgfg - Execute the built-in bg and fg commands.
+ * do_ask - Execute the built-in ask command.
  *
  * Requires:
- *   argv, an array of string representing the commandline in tokens 
+ *   cmd, a command from parseline() whose first word is "ask"
  *
  * Effects:
- *   Implements the bg and fg builtin commands. Will take a jobid or a PID,
- *   then use the kill command to send SIGCONT to those jobs. Lots of error 
- *   handling to make sure that the ids are of the correct format and 
- *   actually have associated job pointers. 
+ *   Implements "ask [-f] name [request ...]", which sends a request to the
+ *   coprocess "name" and prints its reply, so that no process is started
+ *   per request.  The request is the words joined by spaces or, if there
+ *   are none, the command's here-document.  A request and its reply are
+ *   each a line, and each line of a here-document is a request of its
+ *   own.  With -f, they are instead each framed by their length in bytes,
+ *   in decimal, on a line before them, so that they may hold newlines.
+ *   If the coprocess's job has died, it is started again first, and if it
+ *   dies, gives a malformed reply, or is interrupted during a request, it
+ *   is started again afterward, as its replies can no longer be matched
+ *   to requests.  Returns 0, 1 if a request failed or on a usage error,
+ *   or 128 + SIGINT if interrupted.
  */
-static void
-do_bgfg(char **argv) 
+static int
+do_ask(struct Cmd *cmd)
 {
-	char* job = argv[1];
-	bool isPid = true; 
-	int id;
-	pid_t pid;
-	if (job[0] == '%') {
-		isPid = false;
-		memmove(job, job+1, strlen(job));
-	}
-	id = atoi(job);
-	pid = (pid_t) id;
-	if (id < 0) {
-		printf("%s: argument must be a PID or %%jobid\n", argv[0]);
-		return;
+	struct Coproc *cp;
+	struct Buf req = { NULL, 0, 0 };
+	char **argv = cmd->argv, head[32], buf[READCHUNK];
+	bool framed = false;
+	size_t start, end;
+	ssize_t n;
+	int i, r = 1;
+
+	if (argv[1] != NULL && strcmp(argv[1], "-f") == 0) {
+		framed = true;
+		argv++;
+	}
+	if (argv[1] == NULL || (argv[2] == NULL && cmd->infd == -1)) {
+		printf("ask: usage: ask [-f] name request ... | ask [-f] name "
+		    "<<DELIM\n");
+		return (1);
+	}
+	if ((cp = getcoproc(argv[1])) == NULL) {
+		printf("ask: %s: No such coprocess\n", argv[1]);
+		return (1);
 	}
+	if (!coprocalive(cp) && restartcoproc(cp) == 0)
+		return (1);
 
-	if (strcmp(argv[0], "bg") == 0) {
-		// Send SIGCONT to the specified job.
-		if (isPid) {
-			if (getjobpid(jobs, pid) == NULL) {
-				printf("(%i) No such process\n", id);
-				return;
+	bufputn(&req, "", 0);
+	if (argv[2] != NULL) {
+		for (i = 2; argv[i] != NULL; i++) {
+			bufputn(&req, argv[i], strlen(argv[i]));
+			if (argv[i + 1] != NULL)
+				bufputc(&req, ' ');
+		}
+	} else {
+		while ((n = read(cmd->infd, buf, sizeof(buf))) != 0) {
+			if (n == -1 && errno != EINTR)
+				unix_error("read error in do_ask");
+			if (n > 0)
+				bufputn(&req, buf, n);
+		}
+	}
+
+	interrupted = 0;
+	if (framed) {
+		snprintf(head, sizeof(head), "%zu\n", req.len);
+		if ((r = coprocio(cp, head, strlen(head))) == 1 &&
+		    (r = coprocio(cp, req.s, req.len)) == 1)
+			r = coprocreply(cp, true);
+		if (r == 1)
+			cp->requests++;
+	} else {
+		if (argv[2] != NULL || (req.len > 0 &&
+		    req.s[req.len - 1] != '\n'))
+			bufputc(&req, '\n');
+		// Wait for each reply before sending the next request.
+		for (start = 0, r = 1; start < req.len && r == 1;
+		    start = end) {
+			end = (char *)memchr(req.s + start, '\n',
+			    req.len - start) - req.s + 1;
+			if ((r = coprocio(cp, req.s + start, end - start)) ==
+			    1 && (r = coprocreply(cp, false)) == 1)
+				cp->requests++;
+		}
+	}
+	free(req.s);
+	if (r == 1)
+		return (0);
+	if (r == 0)
+		printf("ask: %s: coprocess ended without replying\n",
+		    cp->name);
+	restartcoproc(cp);
+	return (r == -1 ? 128 + SIGINT : 1);
+}
+
+/* 
+ * do_batch - Execute the built-in batch command.
+ *
+ * Requires:
+ *   cmd, a command from parseline() whose first word is "batch"
+ *
+ * Effects:
+ *   Implements "batch [-0] [-a file] [-n max] [-P procs] command [arg ...]",
+ *   which reads items from its stdin (a here-document, the file, or else
+ *   the shell's own input up to end of file), one per line or, with -0,
+ *   separated by NULs, and runs the command with as many of them appended
+ *   to its arguments as fit in argmax(), or at most "max" of them.  So one
+ *   process is created per batch rather than per item.  Batches are started
+ *   as soon as they fill, as jobs named after their arguments, and up to
+ *   "procs" of them (1 by default) run at once: in the foreground if one,
+ *   otherwise in the background.  Items too large to pass even alone are
+ *   skipped.  Returns 0 if every batch succeeded, 123 if any failed, or
+ *   128 + SIGINT if interrupted.
+ */
+static int
+do_batch(struct Cmd *cmd)
+{
+	struct Cmd batch;
+	struct Buf in = { NULL, 0, 0 }, line = { NULL, 0, 0 };
+	sigset_t mask, prev;
+	pid_t pid, pids[MAXJOBS];
+	size_t base, limit, size, start, pos, len;
+	char **argv = cmd->argv, delim = '\n', *nl;
+	int i, fd, jid, nfixed, maxitems = 0, maxprocs = 1, nitems = 0;
+	int npids = 0, status = 0;
+	bool eof = false, flush;
+	ssize_t n;
+
+	fd = cmd->infd;
+	for (argv++; *argv != NULL && (*argv)[0] == '-'; argv++) {
+		if (strcmp(*argv, "-0") == 0)
+			delim = '\0';
+		else if (strcmp(*argv, "-a") == 0 && argv[1] != NULL) {
+			if (fd != cmd->infd)
+				close(fd);
+			if ((fd = open(*++argv, O_RDONLY | O_CLOEXEC)) == -1) {
+				printf("%s: %s\n", *argv, strerror(errno));
+				return (1);
 			}
-			printf("[%i] (%i) %s", getjobpid(jobs,pid)->jid, pid, getjobpid(jobs,pid)->cmdline);
-			getjobpid(jobs,pid)->state = BG;
-			if (kill(pid, SIGCONT) == 1) {
-				unix_error("Error sending SIGCONT in do_bgfg");
-			} 
+		} else if (strcmp(*argv, "-n") == 0 && argv[1] != NULL)
+			maxitems = atoi(*++argv);
+		else if (strcmp(*argv, "-P") == 0 && argv[1] != NULL)
+			maxprocs = atoi(*++argv);
+		else
+			break;
+	}
+	if (*argv == NULL || maxitems < 0 || maxprocs < 1) {
+		printf("batch: usage: batch [-0] [-a file] [-n max] "
+		    "[-P procs] command [arg ...]\n");
+		if (fd != cmd->infd)
+			close(fd);
+		return (2);
+	}
+	if (maxprocs > MAXJOBS)
+		maxprocs = MAXJOBS;
+
+	/*
+	 * The batches share the command's assignments, which are added to
+	 * their environment, but not its stdin, which holds the items.
+	 */
+	batch = *cmd;
+	batch.argv = NULL;
+	batch.argc = batch.argmax = 0;
+	batch.nsubs = 0;
+	batch.bg = false;
+	if ((batch.infd = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1)
+		unix_error("open error in do_batch");
+	for (i = 0; argv[i] != NULL; i++)
+		pushword(&batch.argv, &batch.argc, &batch.argmax,
+		    strdup(argv[i]));
+	nfixed = batch.argc;
+	base = argsize(batch.argv);
+	if (cmd->nassigns > 0)
+		base += argsize(cmd->assigns);
+	limit = argmax();
+	bufputn(&in, "", 0);
+
+	if (sigemptyset(&mask) == -1)
+		unix_error("sigemptyset error in do_batch");
+	if (sigaddset(&mask, SIGCHLD) == -1)
+		unix_error("sigaddset error in do_batch");
+	interrupted = 0;
+	size = base;
+	pos = 0;
+	while (!interrupted && (!eof || pos < in.len || nitems > 0)) {
+		// Take the next complete item, or read more input.
+		start = pos;
+		flush = false;
+		if ((nl = memchr(in.s + pos, delim, in.len - pos)) != NULL)
+			len = nl - (in.s + pos);
+		else if (eof && pos < in.len)
+			len = in.len - pos;
+		else if (eof) {
+			len = 0;
+			flush = true;
 		} else {
-			if (getjobjid(jobs,id) == NULL) {
-				printf("%%%i No such job\n", id);
-				return;
-			}
-			pid = getjobjid(jobs, id)->pid;
-			printf("[%i] (%i) %s", id, pid, getjobpid(jobs,pid)->cmdline);
-			getjobpid(jobs,pid)->state = BG;
-			if (kill(pid, SIGCONT) == 1) {
-				unix_error("Error sending SIGCONT in do_bgfg");
+			memmove(in.s, in.s + pos, in.len - pos);
+			in.len -= pos;
+			pos = 0;
+			if (fd == -1) {
+				if (!readline(&line))
+					eof = true;
+				else
+					bufputn(&in, line.s, line.len);
+				continue;
 			}
-		}
-	} else if (strcmp(argv[0], "fg") == 0) {
-		// Send SIGCONT to the specified job.
-		if (isPid) {
-			if (getjobpid(jobs, pid) == NULL) {
-				printf("(%i) No such process\n", id);
-				return;
+			if (in.len + READCHUNK + 1 > in.max) {
+				in.max = in.len + READCHUNK + 1;
+				if ((in.s = realloc(in.s, in.max)) == NULL)
+					unix_error("realloc error in do_batch");
 			}
-			getjobpid(jobs,pid)->state = FG;
-			if (kill(pid, SIGCONT) == 1) {
-				unix_error("Error sending SIGCONT in do_bgfg");
+			if ((n = read(fd, in.s + in.len, READCHUNK)) == -1) {
+				if (errno != EINTR)
+					unix_error("read error in do_batch");
+				continue;
 			}
-		} else {
-			if (getjobjid(jobs,id) == NULL) {
-				printf("%%%i No such job\n", id);
+			if (n == 0)
+				eof = true;
+			in.len += n;
+			in.s[in.len] = '\0';
+			continue;
+		}
+
+		if (!flush) {
+			pos += len + (nl != NULL);
+			if (len == 0 && delim == '\n')
+				continue;
+			if (base + len + 1 + sizeof(char *) > limit) {
+				printf("batch: item too long, skipped\n");
+				status = 123;
+				continue;
 			}
-			pid = getjobjid(jobs, id)->pid;
-			getjobpid(jobs,pid)->state = FG;
-			if (kill(pid, SIGCONT) == 1) {
-				unix_error("Error sending SIGCONT in do_bgfg");
-				return;
+			if (size + len + 1 + sizeof(char *) <= limit &&
+			    (maxitems == 0 || nitems < maxitems)) {
+				pushword(&batch.argv, &batch.argc,
+				    &batch.argmax, strndup(in.s + start, len));
+				size += len + 1 + sizeof(char *);
+				nitems++;
+				continue;
 			}
+			// The item starts the next batch.
+			pos = start;
 		}
-		// Wait for current foreground process to finish.
-		waitfg(pid);
-	} else {
-		app_error("Not a bg or fg command");
+
+		// Wait for a free slot, then start the batch.
+		if (sigprocmask(SIG_BLOCK, &mask, &prev) == -1)
+			unix_error("sigprocmask error in do_batch");
+		while (npids == maxprocs && !interrupted)
+			if (waitbatch(pids, &npids, &prev) != 0)
+				status = 123;
+		if (sigprocmask(SIG_SETMASK, &prev, NULL) == -1)
+			unix_error("sigprocmask error in do_batch");
+		if (interrupted)
+			break;
+		line.len = 0;
+		for (i = 0; i < batch.argc; i++) {
+			bufputn(&line, batch.argv[i], strlen(batch.argv[i]));
+			bufputc(&line, i + 1 < batch.argc ? ' ' : '\n');
+		}
+		pid = launch(&batch, line.s, maxprocs == 1 ? FG : BG, &jid);
+		if (pid == 0)
+			status = 123;
+		else if (maxprocs == 1) {
+			waitfg(pid);
+			if (last_status != 0)
+				status = 123;
+		} else
+			pids[npids++] = pid;
+		while (batch.argc > nfixed)
+			free(batch.argv[--batch.argc]);
+		batch.argv[batch.argc] = NULL;
+		size = base;
+		nitems = 0;
+	}
+
+	// Wait for the batches still running.
+	if (sigprocmask(SIG_BLOCK, &mask, &prev) == -1)
+		unix_error("sigprocmask error in do_batch");
+	while (npids > 0 && !interrupted)
+		if (waitbatch(pids, &npids, &prev) != 0)
+			status = 123;
+	if (interrupted) {
+		// Take the running batches down with the shell's command.
+		killtrees(pids, npids, SIGINT);
+		status = 128 + SIGINT;
 	}
+	if (sigprocmask(SIG_SETMASK, &prev, NULL) == -1)
+		unix_error("sigprocmask error in do_batch");
+
+	if (fd != cmd->infd)
+		close(fd);
+	batch.assigns = NULL;
+	batch.nassigns = 0;
+	freecmd(&batch);
+	free(in.s);
+	free(line.s);
+	return (status);
 }
 
 /* 
- * waitfg - Block until process pid is no longer the foreground process.
+ * do_bench - Execute the built-in bench command.
  *
  * Requires:
- *   A pid, which represents the process id of the process we want to wait on.
+ *   cmd, a command from parseline() whose first word is "bench"
  *
  * Effects:
- *   Uses the child handler to ensure that the job is deleted from the jobs 
- *   array when the child finishes normally or is terminated/stopped. Uses
- *   a while loop to sleep forever until the childhandler reaps. 
+ *   Implements "bench [-i] [-n runs] [-w warmups] command ...", which runs
+ *   each command, a single word that parseline() splits into a simple
+ *   command without a here-document, "warmups" times (0 by default) and
+ *   then "runs" times (10 by default) as a foreground job, with its stdin
+ *   and stdout at /dev/null unless it has files of its own.  Each run
+ *   goes through launch(), so the times include the shell's own cost of
+ *   starting a job, except that a filter that do_filter() runs in the
+ *   shell runs there, so that it can be compared with the external
+ *   command.  Other builtins are not run, as they could change
+ *   or end the shell, but launched as external commands.  Prints the
+ *   mean, standard deviation, minimum, median, 90th and 99th
+ *   percentiles, and maximum of the wall time of the runs and of the user
+ *   and system CPU times that wait4(), or for a filter getrusage(),
+ *   reported for them, and, for several commands, how much faster the
+ *   fastest one is than each of the others.
+ *   Stops at the first run that fails unless -i is given.  Returns 0, 1
+ *   if a run failed or could not start, 2 on a usage error, or 128 +
+ *   SIGINT if interrupted.
  */
-static void
-waitfg(pid_t pid)
+static int
+do_bench(struct Cmd *cmd)
 {
-	int fpid;
-	fpid = fgpid(jobs);
-	while (fpid != 0 && pid == fgpid(jobs)) {
-		fpid = (fgpid(jobs));
-		sleep(1);
+	volatile struct Done *done;
+	struct Cmd bc;
+	struct Buf line = { NULL, 0, 0 };
+	struct rusage before, after;
+	sigset_t mask, prev;
+	char **argv = cmd->argv, **cmds;
+	double *wall, *user, *sys, *means, *sds, start, end, ratio;
+	pid_t pid;
+	int i, k, jid, ncmds, best, saveout, runs = 10, warmups = 0;
+	int fstatus, status = 0;
+	bool ignore = false, inshell, heredoc;
+
+	for (argv++; *argv != NULL && (*argv)[0] == '-'; argv++) {
+		if (strcmp(*argv, "-i") == 0)
+			ignore = true;
+		else if (strcmp(*argv, "-n") == 0 && argv[1] != NULL)
+			runs = atoi(*++argv);
+		else if (strcmp(*argv, "-w") == 0 && argv[1] != NULL)
+			warmups = atoi(*++argv);
+		else
+			break;
+	}
+	if (*argv == NULL || runs < 1 || warmups < 0) {
+		printf("bench: usage: bench [-i] [-n runs] [-w warmups] "
+		    "command ...\n");
+		return (2);
+	}
+	cmds = argv;
+	for (ncmds = 0; cmds[ncmds] != NULL; ncmds++)
+		;
+	if ((wall = malloc(runs * sizeof(*wall))) == NULL ||
+	    (user = malloc(runs * sizeof(*user))) == NULL ||
+	    (sys = malloc(runs * sizeof(*sys))) == NULL ||
+	    (means = malloc(ncmds * sizeof(*means))) == NULL ||
+	    (sds = malloc(ncmds * sizeof(*sds))) == NULL)
+		unix_error("malloc error in do_bench");
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if ((saveout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3)) == -1)
+		unix_error("fcntl error in do_bench");
+	interrupted = 0;
+
+	for (i = 0; i < ncmds && status == 0; i++) {
+		/*
+		 * A word is one simple command, and the body of a
+		 * here-document would have to come from the shell's input.
+		 */
+		if (cmdend(cmds[i], &heredoc) < cmds[i] + strlen(cmds[i]) ||
+		    heredoc) {
+			printf("bench: '%s': only a simple command without a "
+			    "here-document can be run\n", cmds[i]);
+			status = 2;
+			break;
+		}
+		if (parseline(cmds[i], &bc) == -1) {
+			status = 2;
+			break;
+		}
+		if (bc.argc == 0) {
+			printf("bench: '%s': no command to run\n", cmds[i]);
+			freecmd(&bc);
+			status = 2;
+			break;
+		}
+		bc.bg = false;
+		if ((bc.infd == -1 && (bc.infd = open("/dev/null",
+		    O_RDONLY | O_CLOEXEC)) == -1) || (bc.outfd == -1 &&
+		    (bc.outfd = open("/dev/null", O_WRONLY | O_CLOEXEC)) == -1))
+			unix_error("open error in do_bench");
+		line.len = 0;
+		bufputn(&line, cmds[i], strlen(cmds[i]));
+		bufputc(&line, '\n');
+
+		for (k = -warmups; k < runs; k++) {
+			if (startprocsubs(&bc) == -1) {
+				status = 2;
+				break;
+			}
+
+			// A filter runs in the shell, with its stdout moved.
+			fflush(stdout);
+			if (dup2(bc.outfd, STDOUT_FILENO) == -1)
+				unix_error("dup2 error in do_bench");
+			getrusage(RUSAGE_SELF, &before);
+			start = monotime();
+			inshell = isfilter(bc.argv[0]) &&
+			    (fstatus = do_filter(&bc)) != -1;
+			end = monotime();
+			getrusage(RUSAGE_SELF, &after);
+			fflush(stdout);
+			if (dup2(saveout, STDOUT_FILENO) == -1)
+				unix_error("dup2 error in do_bench");
+			if (inshell) {
+				endprocsubs(&bc, true);
+				last_status = fstatus;
+				done = NULL;
+				if (k >= 0) {
+					wall[k] = end - start;
+					user[k] = tvsecs(&after.ru_utime) -
+					    tvsecs(&before.ru_utime);
+					sys[k] = tvsecs(&after.ru_stime) -
+					    tvsecs(&before.ru_stime);
+				}
+			} else {
+				start = monotime();
+				pid = launch(&bc, line.s, FG, &jid);
+				endprocsubs(&bc, pid == 0);
+				if (pid == 0) {
+					status = 1;
+					break;
+				}
+				waitfg(pid);
+				if (k >= 0)
+					wall[k] = monotime() - start;
+				sigprocmask(SIG_BLOCK, &mask, &prev);
+				if ((done = getdone(pid, 0)) != NULL && k >= 0) {
+					user[k] = done->utime;
+					sys[k] = done->stime;
+				}
+				sigprocmask(SIG_SETMASK, &prev, NULL);
+			}
+			if (interrupted) {
+				status = 128 + SIGINT;
+				break;
+			}
+			// A stopped run is still a job, with no record yet.
+			if ((!inshell && done == NULL) ||
+			    (last_status != 0 && !ignore)) {
+				printf("bench: '%s' failed with status %d%s\n",
+				    cmds[i], last_status, !inshell &&
+				    done == NULL ? "" :
+				    "; use -i to ignore failures");
+				status = 1;
+				break;
+			}
+		}
+		freecmd(&bc);
+		if (status != 0)
+			break;
+
+		printf("Benchmark %d: %s\n", i + 1, cmds[i]);
+		printf("  %d runs after %d warm-up runs\n", runs, warmups);
+		printf("  %-5s %10s %10s %10s %10s %10s %10s %10s\n", "",
+		    "mean", "stddev", "min", "p50", "p90", "p99", "max");
+		means[i] = mean(wall, runs);
+		sds[i] = stddev(wall, runs);
+		printstats("wall", wall, runs);
+		printstats("user", user, runs);
+		printstats("sys", sys, runs);
 	}
 
+	if (status == 0 && ncmds > 1) {
+		for (best = 0, i = 1; i < ncmds; i++)
+			if (means[i] < means[best])
+				best = i;
+		printf("Summary\n  '%s' ran\n", cmds[best]);
+		for (i = 0; i < ncmds; i++) {
+			if (i == best)
+				continue;
+			// The error of a ratio of two independent means.
+			ratio = means[i] / means[best];
+			printf("    %.2f +/- %.2f times faster than '%s'\n",
+			    ratio, ratio * hypot(sds[i] / means[i],
+			    sds[best] / means[best]), cmds[i]);
+		}
+	}
+	close(saveout);
+	free(line.s);
+	free(wall);
+	free(user);
+	free(sys);
+	free(means);
+	free(sds);
+	return (status);
 }
 
 /* 
- * initpath - Perform all necessary initialization of the search path,
- *  which may be simply saving the path.
+ * do_bgfg - Execute the built-in bg and fg commands.
  *
  * Requires:
- *   "pathstr" is a valid search path.
+ *   argv, an array of string representing the commandline in tokens 
  *
  * Effects:
- *   Creates and stores a linkedlist in the global field paths. Represents a 
- *   list of all the possible paths to try and execute a command in.
+ *   Implements "bg selector ..." and "fg selector", where each selector
+ *   is a PID or one of the job selectors accepted by selectjobs().  bg
+ *   sends SIGCONT to every selected job and gives it its background
+ *   scheduling class; fg, which must select exactly one job, releases it
+ *   if it is held, restores the normal scheduling class, sends it
+ *   SIGCONT, and waits for it.  The jobs are selected and then acted on
+ *   in one pass over the jobs list each. 
  */
 static void
-initpath(const char *pathstr)
-{	
-	struct list *pathList = malloc(sizeof(struct list));
-	char *original = malloc((strlen(pathstr) + 1) * 4);
-	strcpy(original, pathstr);
-	char *found;
+do_bgfg(char **argv) 
+{
+	static bool mark[MAXJOBS];
+	bool fg = strcmp(argv[0], "fg") == 0;
+	sigset_t mask, prev;
+	pid_t pid = 0;
+	int i, n;
 
-	while ((found = strsep(&original,":")) != NULL) {
-		if (strcmp(found, "") == 0) {
-			getcwd(found, sizeof(found));
-		}
-		struct list *pathListTemp = malloc(sizeof(struct list));
-		pathListTemp->name = found;
-		pathListTemp->tail_list = pathList;
-		pathList = pathListTemp;
+	if (argv[1] == NULL) {
+		printf("%s command requires PID or %%jobid argument\n",
+		    argv[0]);
+		return;
 	}
 
-	paths = pathList;
+	// Block SIGCHLD so that no selected job is deleted meanwhile.
+	if (sigemptyset(&mask) == -1)
+		unix_error("sigemptyset error in do_bgfg");
+	if (sigaddset(&mask, SIGCHLD) == -1)
+		unix_error("sigaddset error in do_bgfg");
+	if (sigprocmask(SIG_BLOCK, &mask, &prev) == -1)
+		unix_error("sigprocmask error in do_bgfg");
 
-	if (verbose) {
-		struct list *head;
-		for (head = paths; head != NULL; head = head->tail_list) {
-			printf(head->name);
-			printf("\n");
+	memset(mark, 0, sizeof(mark));
+	for (i = 1, n = 0; argv[i] != NULL; i++) {
+		switch (selectjobs(jobs, argv[i], mark)) {
+		case -1:
+			printf("%s: argument must be a PID or %%jobid\n",
+			    argv[0]);
+			break;
+		case 0:
+			if (argv[i][0] == '%')
+				printf("%s: No such job\n", argv[i]);
+			else
+				printf("(%s) No such process\n", argv[i]);
+			break;
 		}
 	}
-}
+	for (i = 0; i < MAXJOBS; i++)
+		if (mark[i])
+			n++;
+	if (fg && n > 1) {
+		printf("fg: more than one job selected\n");
+		n = 0;
+	}
 
-/*
- * The signal handlers follow.
- */
+	for (i = 0; i < MAXJOBS && n > 0; i++) {
+		if (!mark[i])
+			continue;
+		pid = jobs[i].pid;
+		if (fg) {
+			jobs[i].state = FG;
+			releasejob(&jobs[i]);
+			setclass(pid, true, SCHED_OTHER,
+			    IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0));
+		} else {
+			printf("[%d] (%d) %s", jobs[i].jid, (int)pid,
+			    jobs[i].cmdline);
+			jobs[i].state = BG;
+			setclass(pid, true, jobs[i].policy, jobs[i].ioprio);
+		}
+		if (kill(-pid, SIGCONT) == -1)
+			unix_error("Error sending SIGCONT in do_bgfg");
+	}
+
+	if (sigprocmask(SIG_SETMASK, &prev, NULL) == -1)
+		unix_error("sigprocmask error in do_bgfg");
+	// Wait for current foreground process to finish.
+	if (fg && n == 1)
+		waitfg(pid);
+}
 
 /* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *  a child job terminates (becomes a zombie), or stops because it
- *  received a SIGSTOP or SIGTSTP signal.  The handler reaps all
- *  available zombie children, but doesn't wait for any other
- *  currently running children to terminate.  
+ * do_break - Execute the built-in break, continue, and return commands.
  *
  * Requires:
- *   Signum, although this input isn't used nor necessary
+ *   argv, an array of string representing the commandline in tokens 
  *
  * Effects:
- *   Uses waitpid to check if a job was terminated or stopped, then reaps
- *   the child and prints the required message. Deletes the job from the 
- *   jobs array when done, so that waitfg can stop sleeping. 
+ *   Implements "break [n]" and "continue [n]", which end the body of the
+ *   nth enclosing loop (1 by default) and then that loop or its current
+ *   iteration, and "return [status]", which ends the running function.
+ *   Each takes effect once the running command list sees it.  Returns 0
+ *   for break and continue, the given status (or last_status) for return,
+ *   or 1 if not within a loop or function.
  */
-static void
-sigchld_handler(int signum)
+static int
+do_break(char **argv)
 {
-	pid_t pid;
-	int status;
-
-	// Don't know what to do with signum
-	(void)signum;
-
+	int n = argv[1] != NULL ? atoi(argv[1]) : 1;
 
-	while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
-		// Reap Children mwahaha
-		if (WIFSTOPPED(status)) {
-			Sio_puts("Job [");
-			Sio_putl(getjobpid(jobs,pid)->jid);
-			Sio_puts("] (");
-			Sio_putl(pid);
-			Sio_puts(") stopped by signal SIG");
-			Sio_puts(signame[WSTOPSIG(status)]);
-			Sio_puts("\n");
-			getjobpid(jobs,pid)->state = 3; //3 = ST
-		} else if ((status)) {
-			Sio_puts("Job [");
-			Sio_putl(getjobpid(jobs,pid)->jid);
-			Sio_puts("] (");
-			Sio_putl(pid);
-			Sio_puts(") terminated by signal SIG");
-			Sio_puts(signame[WTERMSIG(status)]);
-			Sio_puts("\n");
-			deletejob(jobs, pid);
-		} else {
-			deletejob(jobs,pid);
+	if (strcmp(argv[0], "return") == 0) {
+		if (funcdepth == 0) {
+			printf("return: not in a function\n");
+			return (1);
 		}
+		loopctl = FUNCRET;
+		return (argv[1] != NULL ? n : last_status);
 	}
-
+	if (loopdepth == 0) {
+		printf("%s: not in a loop\n", argv[0]);
+		return (1);
+	}
+	if (n < 1) {
+		printf("%s: usage: %s [n]\n", argv[0], argv[0]);
+		return (1);
+	}
+	loopctl = strcmp(argv[0], "break") == 0 ? LOOPBREAK : LOOPCONT;
+	loopcount = n < loopdepth ? n : loopdepth;
+	return (0);
 }
 
 /* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenever the
- *  user types ctrl-c at the keyboard.  Catch it and send it along
- *  to the foreground job.  
+ * do_coproc - Execute the built-in coproc command.
+ *
+ * Requires:
+ *   cmd, a command from parseline() whose first word is "coproc"
  *
+ * Effects:
+ *   Implements "coproc name command [arg ...]", which starts the command
+ *   as a background job whose stdin and stdout are a socket to the shell,
+ *   for the ask builtin to send it requests, "coproc -d name", which ends
+ *   the coprocess by closing the socket and sending its job SIGTERM, and
+ *   "coproc", which lists the coprocesses.  The shell starts a coprocess's
+ *   job again whenever it dies.  Returns 0, or 1 on a usage error or if
+ *   the job cannot be started.
+ */
+static int
+do_coproc(struct Cmd *cmd)
+{
+	struct Coproc *cp, **cpp;
+	struct Buf line = { NULL, 0, 0 };
+	char **argv = cmd->argv;
+	int i, jid;
+
+	if (argv[1] == NULL) {
+		for (cp = coprocs; cp != NULL; cp = cp->next)
+			printf("%s (%d) %lu requests, %lu restarts: %s",
+			    cp->name, (int)cp->pid, cp->requests,
+			    cp->restarts, cp->cmdline);
+		return (0);
+	}
+	if (strcmp(argv[1], "-d") == 0) {
+		if (argv[2] == NULL || argv[3] != NULL) {
+			printf("coproc: usage: coproc -d name\n");
+			return (1);
+		}
+		for (cpp = &coprocs; *cpp != NULL; cpp = &(*cpp)->next)
+			if (strcmp((*cpp)->name, argv[2]) == 0)
+				break;
+		if ((cp = *cpp) == NULL) {
+			printf("coproc: %s: No such coprocess\n", argv[2]);
+			return (1);
+		}
+		*cpp = cp->next;
+		freecoproc(cp);
+		return (0);
+	}
+	if (argv[2] == NULL) {
+		printf("coproc: usage: coproc [name command [arg ...] | "
+		    "-d name]\n");
+		return (1);
+	}
+	if (!isname(argv[1], strlen(argv[1]))) {
+		printf("coproc: %s: not a valid name\n", argv[1]);
+		return (1);
+	}
+	if (getcoproc(argv[1]) != NULL) {
+		printf("coproc: %s: already running\n", argv[1]);
+		return (1);
+	}
+
+	if ((cp = calloc(1, sizeof(*cp))) == NULL)
+		unix_error("calloc error in do_coproc");
+	cp->name = strdup(argv[1]);
+	cp->cmd.infd = cp->cmd.outfd = cp->cmd.errfd = -1;
+	cp->fd = -1;
+	bufputn(&line, "coproc ", 7);
+	for (i = 1; argv[i] != NULL; i++) {
+		if (i > 1)
+			pushword(&cp->cmd.argv, &cp->cmd.argc,
+			    &cp->cmd.argmax, strdup(argv[i]));
+		bufputn(&line, argv[i], strlen(argv[i]));
+		bufputc(&line, argv[i + 1] != NULL ? ' ' : '\n');
+	}
+	cp->cmdline = line.s;
+	for (i = 0; i < cmd->nassigns; i++)
+		pushword(&cp->cmd.assigns, &cp->cmd.nassigns,
+		    &cp->cmd.assignmax, strdup(cmd->assigns[i]));
+	if ((jid = startcoproc(cp)) == 0) {
+		freecoproc(cp);
+		return (1);
+	}
+	for (cpp = &coprocs; *cpp != NULL; cpp = &(*cpp)->next)
+		;
+	*cpp = cp;
+	printf("[%d] (%d) %s", jid, (int)cp->pid, cp->cmdline);
+	return (0);
+}
+
+/* 
+ * do_export - Execute the built-in export command.
+ *
+ * Requires:
+ *   argv, an array of string representing the commandline in tokens 
+ *
+ * Effects:
+ *   Implements "export [NAME[=value] ...]".  Each NAME is marked for export
+ *   to the environment of commands, after first being set to "value" if
+ *   one is given.  With no arguments, prints every exported variable.
+ *   Returns 0, or 1 if some NAME is not a valid variable name.
+ */
+static int
+do_export(char **argv)
+{
+	struct Var *var;
+	size_t i;
+	int status = 0;
+
+	if (argv[1] == NULL) {
+		for (i = 0; i < nvarbuckets; i++)
+			for (var = vartab[i]; var != NULL; var = var->next)
+				if (var->exported)
+					printf("export %s\n", var->str);
+		return (0);
+	}
+	for (argv++; *argv != NULL; argv++) {
+		if (!isname(*argv, strcspn(*argv, "="))) {
+			printf("export: %s: not a valid identifier\n", *argv);
+			status = 1;
+		} else if (strchr(*argv, '=') != NULL)
+			setvar(*argv, true);
+		else if ((var = lookupvar(*argv, strlen(*argv))) != NULL) {
+			if (!var->exported) {
+				var->exported = true;
+				envdirty = true;
+			}
+		} else {
+			struct Buf str = { NULL, 0, 0 };
+
+			// Export an unset variable as empty.
+			bufputn(&str, *argv, strlen(*argv));
+			bufputc(&str, '=');
+			setvar(str.s, true);
+			free(str.s);
+		}
+	}
+	return (status);
+}
+
+/* 
+ * do_filter - Execute the built-in cat, grep, head, and wc commands.
+ *
+ * Requires:
+ *   cmd, a command from parseline() whose first word is "cat", "grep",
+ *   "head", or "wc"
+ *
+ * Effects:
+ *   Implements "cat [file ...]", "grep -F [-c] [-v] pattern [file ...]",
+ *   "head [-n lines | -lines] [file ...]", and "wc -l [file ...]" in the
+ *   shell, so that a short filter does not cost a process.  Each reads its
+ *   files in turn, where "-" or no file at all stands for its stdin (a
+ *   here-document, or else the shell's own input), and writes to its file
+ *   for stdout, if it has one, or else to the shell's stdout.  cat copies
+ *   through fanout(), and the others use filterfd(), which counts lines and
+ *   searches for the pattern with vector instructions.  For several files,
+ *   grep puts the file name before each line or count, head puts a header
+ *   before each file, and wc ends with a total.  head leaves the unread
+ *   rest of a seekable input at its offset, for whatever reads it next.
+ *   Any other option, a pattern with a newline, a background command, or
+ *   one with assignments is left to the external command.  Returns -1 if
+ *   it is left to the external command, 128 + SIGINT if interrupted, or
+ *   128 + SIGPIPE if the reader of the output went away.  Otherwise, grep
+ *   returns 0 if it selected a line, 1 if not, or 2 on an error, and the
+ *   others 0 or 1 on an error.
+ */
+static int
+do_filter(struct Cmd *cmd)
+{
+	struct Filter f;
+	struct stat st;
+	sigset_t prev;
+	char **argv = cmd->argv + 1, *end, num[32];
+	const char *s, *file;
+	long long lines = 10, total = 0, size = 0;
+	bool fixed = false;
+	int i, fd, n, nfiles, width = 1, r = 0, status = 0;
+
+	if (cmd->bg || cmd->nassigns > 0)
+		return (-1);
+	memset(&f, 0, sizeof(f));
+	f.name = cmd->argv[0];
+	if (strcmp(f.name, "cat") == 0)
+		f.kind = FCAT;
+	else if (strcmp(f.name, "wc") == 0) {
+		if (*argv == NULL || strcmp(*argv++, "-l") != 0)
+			return (-1);
+		f.kind = FWC;
+	} else if (strcmp(f.name, "head") == 0) {
+		f.kind = FHEAD;
+		if (*argv != NULL && (*argv)[0] == '-' && (*argv)[1] != '\0') {
+			s = *argv++ + 1;
+			if (strcmp(s, "n") == 0) {
+				if (*argv == NULL)
+					return (-1);
+				s = *argv++;
+			} else if (s[0] == 'n')
+				s++;
+			if (!isdigit((unsigned char)s[0]))
+				return (-1);
+			errno = 0;
+			lines = strtoll(s, &end, 10);
+			if (*end != '\0' || errno != 0)
+				return (-1);
+		}
+	} else {
+		f.kind = FGREP;
+		for (; *argv != NULL && (*argv)[0] == '-' &&
+		    (*argv)[1] != '\0'; argv++) {
+			for (s = *argv + 1; *s != '\0'; s++) {
+				if (*s == 'F')
+					fixed = true;
+				else if (*s == 'c')
+					f.count = true;
+				else if (*s == 'v')
+					f.invert = true;
+				else
+					return (-1);
+			}
+		}
+		if (!fixed || *argv == NULL || strchr(*argv, '\n') != NULL)
+			return (-1);
+		f.pat = *argv++;
+		f.patlen = strlen(f.pat);
+	}
+	for (nfiles = 0; argv[nfiles] != NULL; nfiles++)
+		if (argv[nfiles][0] == '-' && argv[nfiles][1] != '\0')
+			return (-1);
+	// Like coreutils, wc aligns several counts to the digits of the size.
+	for (i = 0; f.kind == FWC && nfiles > 1 && i < nfiles; i++) {
+		if ((strcmp(argv[i], "-") == 0 ? fstat(cmd->infd != -1 ?
+		    cmd->infd : STDIN_FILENO, &st) : stat(argv[i], &st)) == 0 &&
+		    S_ISREG(st.st_mode))
+			size += st.st_size;
+		else
+			width = 7;
+	}
+	if (size > 0 && (n = snprintf(num, sizeof(num), "%lld", size)) > width)
+		width = n;
+
+	f.outfd = cmd->outfd != -1 ? cmd->outfd : STDOUT_FILENO;
+	f.outpipe = fstat(f.outfd, &st) == 0 && S_ISFIFO(st.st_mode);
+	// Like GNU grep, only the status matters if the output is discarded.
+	f.quiet = f.kind == FGREP && isdevnull(f.outfd);
+	fflush(stdout);
+	setsimd();
+	interrupted = 0;
+	holdsigpipe(&prev);
+	for (i = 0; r == 0 && (i == 0 || i < nfiles); i++) {
+		file = nfiles == 0 ? "-" : argv[i];
+		if (strcmp(file, "-") == 0)
+			fd = cmd->infd != -1 ? cmd->infd : STDIN_FILENO;
+		else if ((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1) {
+			printf("%s: %s: %s\n", f.name, file, strerror(errno));
+			fflush(stdout);
+			status = f.kind == FGREP ? 2 : 1;
+			continue;
+		}
+		if (f.kind == FHEAD && nfiles > 1) {
+			if (i > 0)
+				bufputc(&f.out, '\n');
+			bufputn(&f.out, "==> ", 4);
+			s = strcmp(file, "-") == 0 ? "standard input" : file;
+			bufputn(&f.out, s, strlen(s));
+			bufputn(&f.out, " <==\n", 5);
+		}
+		f.lines = f.kind == FHEAD ? lines : 0;
+		f.prefix = f.kind == FGREP && nfiles > 1 ? file : NULL;
+		if (f.kind == FCAT)
+			r = fanout(f.name, fd, &f.outfd, 1);
+		else
+			r = filterfd(&f, fd);
+		if (fd != STDIN_FILENO && fd != cmd->infd)
+			close(fd);
+		if (r != 0)
+			break;
+
+		if (f.kind == FWC || (f.kind == FGREP && f.count)) {
+			if (f.prefix != NULL) {
+				bufputn(&f.out, f.prefix, strlen(f.prefix));
+				bufputc(&f.out, ':');
+			}
+			n = snprintf(num, sizeof(num), "%*lld", width,
+			    f.lines);
+			bufputn(&f.out, num, n);
+			if (f.kind == FWC && nfiles > 0) {
+				bufputc(&f.out, ' ');
+				bufputn(&f.out, file, strlen(file));
+			}
+			bufputc(&f.out, '\n');
+		}
+		total += f.lines;
+		if (f.kind == FWC && i == nfiles - 1 && nfiles > 1) {
+			n = snprintf(num, sizeof(num), "%*lld total\n", width,
+			    total);
+			bufputn(&f.out, num, n);
+		}
+		if (f.out.len > 0)
+			r = putall(f.name, f.outfd, f.out.s, f.out.len,
+			    f.outpipe);
+		f.out.len = 0;
+	}
+	releasesigpipe(&prev);
+	fflush(stdout);
+	free(f.in);
+	free(f.out.s);
+
+	if (r == -1)
+		return (128 + SIGINT);
+	if (r == 2)
+		return (128 + SIGPIPE);
+	if (r == 1)
+		return (f.kind == FGREP ? 2 : 1);
+	if (f.kind == FGREP && status == 0 && total == 0)
+		return (1);
+	return (status);
+}
+
+/* 
+ * do_history - Execute the built-in history command.
+ *
+ * Requires:
+ *   argv, an array of string representing the commandline in tokens 
+ *
+ * Effects:
+ *   Implements "history [n]", which prints the last n entries (20 by
+ *   default) with their start times, exit statuses, and durations;
+ *   "history -p prefix" and "history -g text", which print the distinct
+ *   command lines that begin with "prefix" or contain "text", with the
+ *   number of times each was run; and "history -s [n]", which prints the
+ *   n (10 by default) most often run command lines with their failure
+ *   counts and mean durations.  Searches use the index built by
+ *   histload().  Returns 0, or 1 on a usage error or if history is off.
+ */
+static int
+do_history(char **argv)
+{
+	const struct HistCmd *cmd;
+	const char *p, *q;
+	char date[32], *end;
+	long long when, ms;
+	size_t i, n, len, best;
+	int *ids, status, lo, hi, mid, g, k;
+	time_t t;
+
+	if (!histload()) {
+		printf("history: no history file\n");
+		return (1);
+	}
+	if (argv[1] == NULL || isdigit((unsigned char)argv[1][0])) {
+		n = argv[1] != NULL ? strtoul(argv[1], NULL, 10) : 20;
+		for (i = hist->nents > n ? hist->nents - n : 0;
+		    i < hist->nents; i++) {
+			p = hist->map + hist->ents[i];
+			when = strtoll(p, &end, 10);
+			ms = strtoll(end, &end, 10);
+			status = strtol(end, &end, 10);
+			q = end + 1;
+			t = when;
+			strftime(date, sizeof(date), "%F %T", localtime(&t));
+			printf("%7zu  %s %4d %9.3fs  %.*s\n", i + 1, date,
+			    status, ms / 1000.0, (int)((const char *)
+			    memchr(q, '\n', hist->map + hist->end - q) - q), q);
+		}
+		return (0);
+	}
+	if ((strcmp(argv[1], "-p") == 0 || strcmp(argv[1], "-g") == 0) &&
+	    argv[2] != NULL && argv[3] == NULL) {
+		len = strlen(argv[2]);
+		if (argv[1][1] == 'p') {
+			// Binary search for the first line not below the prefix.
+			histsort();
+			for (lo = 0, hi = hist->nsorted; lo < hi; ) {
+				mid = (lo + hi) / 2;
+				cmd = &hist->cmds[hist->sorted[mid]];
+				k = memcmp(hist->map + cmd->off, argv[2],
+				    cmd->len < len ? cmd->len : len);
+				if (k < 0 || (k == 0 && cmd->len < len))
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			for (; lo < hist->nsorted; lo++) {
+				cmd = &hist->cmds[hist->sorted[lo]];
+				if (cmd->len < len || memcmp(hist->map +
+				    cmd->off, argv[2], len) != 0)
+					break;
+				printf("%8lu  %.*s\n", cmd->count,
+				    (int)cmd->len, hist->map + cmd->off);
+			}
+			return (0);
+		}
+
+		// Check only the lines in the query's rarest trigram bucket.
+		ids = NULL;
+		n = hist->ncmds;
+		for (i = 0; i + 3 <= len; i++) {
+			g = (((unsigned char)argv[2][i] << 16 |
+			    (unsigned char)argv[2][i + 1] << 8 |
+			    (unsigned char)argv[2][i + 2]) * 2654435761u) >>
+			    16 & (HISTGRAMS - 1);
+			if ((size_t)hist->grams[g].n < n) {
+				n = hist->grams[g].n;
+				ids = hist->grams[g].ids;
+			}
+		}
+		for (i = 0; i < n; i++) {
+			best = ids != NULL ? (size_t)ids[i] : i;
+			cmd = &hist->cmds[best];
+			if (memmem(hist->map + cmd->off, cmd->len, argv[2],
+			    len) != NULL)
+				printf("%8lu  %.*s\n", cmd->count,
+				    (int)cmd->len, hist->map + cmd->off);
+		}
+		return (0);
+	}
+	if (strcmp(argv[1], "-s") == 0 && (argv[2] == NULL ||
+	    argv[3] == NULL)) {
+		n = argv[2] != NULL ? strtoul(argv[2], NULL, 10) : 10;
+		if ((ids = malloc((hist->ncmds + 1) * sizeof(int))) == NULL)
+			unix_error("malloc error in do_history");
+		for (k = 0; k < hist->ncmds; k++)
+			ids[k] = k;
+		qsort(ids, hist->ncmds, sizeof(int), cmpcount);
+		printf("%8s %8s %10s  %s\n", "RUNS", "FAILED", "MEAN", "COMMAND");
+		for (i = 0; i < n && i < (size_t)hist->ncmds; i++) {
+			cmd = &hist->cmds[ids[i]];
+			printf("%8lu %8lu %9.3fs  %.*s\n", cmd->count,
+			    cmd->failures, cmd->total / cmd->count,
+			    (int)cmd->len, hist->map + cmd->off);
+		}
+		free(ids);
+		return (0);
+	}
+	printf("history: usage: history [n] | -p prefix | -g text | -s [n]\n");
+	return (1);
+}
+
+/* 
+ * do_jobs - Execute the built-in jobs command.
+ *
+ * Requires:
+ *   argv, an array of string representing the commandline in tokens 
+ *
+ * Effects:
+ *   Implements "jobs [selector ...]", which prints the jobs list, and "jobs
+ *   -t [-i interval] [selector ...]", which prints each job's CPU, memory,
+ *   and I/O usage, summed over its process group, as listusage() does.
+ *   Only the jobs chosen by the selectors, if any, are printed.  With an
+ *   interval in seconds, which is a separate option so that it cannot be
+ *   mistaken for a PID, the table is redrawn every interval until ctrl-c
+ *   or until no jobs remain.  Without selectors, the jobs list is followed
+ *   by the commands scheduled by at and every.  Returns 0, or 1 on a usage
+ *   error or if a selector is invalid or selects no job.
+ */
+static int
+do_jobs(char **argv)
+{
+	static bool mark[MAXJOBS];
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	sigset_t mask, prev;
+	uint64_t ticks;
+	double interval = 0;
+	char *end;
+	bool usage = false, *marks = NULL;
+	int fd, i, status = 0;
+
+	if (argv[1] != NULL && strcmp(argv[1], "-t") == 0) {
+		usage = true;
+		argv++;
+		if (argv[1] != NULL && strcmp(argv[1], "-i") == 0) {
+			if (argv[2] == NULL || (interval = strtod(argv[2],
+			    &end)) <= 0 || *end != '\0' || end == argv[2] ||
+			    !isfinite(interval) || interval > 1e9) {
+				printf("jobs: usage: jobs [-t [-i interval]] "
+				    "[selector ...]\n");
+				return (1);
+			}
+			argv += 2;
+		}
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	if (argv[1] != NULL) {
+		memset(mark, 0, sizeof(mark));
+		marks = mark;
+	}
+	for (i = 1; argv[i] != NULL; i++) {
+		switch (selectjobs(jobs, argv[i], mark)) {
+		case -1:
+			printf("jobs: argument must be a PID or %%jobid\n");
+			status = 1;
+			break;
+		case 0:
+			printf("%s: No such job\n", argv[i]);
+			status = 1;
+			break;
+		}
+	}
+	if (!usage) {
+		listjobs(jobs, marks);
+		if (marks == NULL)
+			listtimers();
+	} else if (interval == 0) {
+		listusage(jobs, marks);
+		prunesamples();
+	}
+	if (interval == 0) {
+		sigprocmask(SIG_SETMASK, &prev, NULL);
+		return (status);
+	}
+
+	its.it_interval.tv_sec = its.it_value.tv_sec = (time_t)interval;
+	its.it_interval.tv_nsec = its.it_value.tv_nsec =
+	    (long)((interval - (time_t)interval) * 1e9);
+	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1 ||
+	    timerfd_settime(fd, 0, &its, NULL) == -1)
+		unix_error("timerfd error in do_jobs");
+	interrupted = 0;
+	for (;;) {
+		if (isatty(STDOUT_FILENO))
+			printf("\033[H\033[2J");
+		listusage(jobs, marks);
+		prunesamples();
+		fflush(stdout);
+		for (i = 0; i < MAXJOBS && (jobs[i].pid == 0 ||
+		    (marks != NULL && !marks[i])); i++)
+			;
+		if (i == MAXJOBS)
+			break;
+		while (!interrupted && !eventloop(&prev, fd))
+			;
+		if (interrupted)
+			break;
+		read(fd, &ticks, sizeof(ticks));
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+	close(fd);
+	return (status);
+}
+
+/* 
+ * do_kill - Execute the built-in kill command.
+ *
+ * Requires:
+ *   argv, an array of string representing the commandline in tokens 
+ *
+ * Effects:
+ *   Implements "kill [-signal] selector ...", where each selector is a
+ *   PID or one of the job selectors accepted by selectjobs().  The signal,
+ *   SIGTERM by default, may be given by number or by name, with or without
+ *   the "SIG" prefix.  The selected jobs are signalled together as whole
+ *   process trees by killtrees(), and the stopped ones are also continued
+ *   so that they can act on the signal.  A PID that is not a job is
+ *   signalled on its own.  Returns 0 if every target was signalled and 1
+ *   otherwise.
+ */
+static int
+do_kill(char **argv)
+{
+	static bool mark[MAXJOBS];
+	static pid_t pgids[MAXJOBS], stopped[MAXJOBS];
+	sigset_t mask, prev;
+	pid_t pid;
+	int i = 1, npgids = 0, nstopped = 0, signum = SIGTERM, status = 0;
+
+	if (argv[i] != NULL && argv[i][0] == '-') {
+		if ((signum = parsesig(&argv[i][1])) == -1) {
+			printf("%s: %s: invalid signal specification\n",
+			    argv[0], &argv[i][1]);
+			return (1);
+		}
+		i++;
+	}
+	if (argv[i] == NULL) {
+		printf("%s: usage: kill [-signal] [%%jobid | pid] ...\n",
+		    argv[0]);
+		return (1);
+	}
+
+	// Block SIGCHLD so that no job is deleted while it is signalled.
+	if (sigemptyset(&mask) == -1)
+		unix_error("sigemptyset error in do_kill");
+	if (sigaddset(&mask, SIGCHLD) == -1)
+		unix_error("sigaddset error in do_kill");
+	if (sigprocmask(SIG_BLOCK, &mask, &prev) == -1)
+		unix_error("sigprocmask error in do_kill");
+
+	memset(mark, 0, sizeof(mark));
+	for (; argv[i] != NULL; i++) {
+		switch (selectjobs(jobs, argv[i], mark)) {
+		case -1:
+			printf("%s: argument must be a PID or %%jobid\n",
+			    argv[0]);
+			status = 1;
+			break;
+		case 0:
+			if (argv[i][0] == '%') {
+				printf("%s: No such job\n", argv[i]);
+				status = 1;
+				break;
+			}
+			pid = atoi(argv[i]);
+			if (kill(pid, signum) == -1) {
+				printf("(%d) No such process\n", pid);
+				status = 1;
+			}
+			break;
+		}
+	}
+	for (i = 0; i < MAXJOBS; i++) {
+		if (!mark[i])
+			continue;
+		pgids[npgids++] = jobs[i].pid;
+		if (jobs[i].state == ST && signum != SIGCONT)
+			stopped[nstopped++] = jobs[i].pid;
+	}
+	killtrees(pgids, npgids, signum);
+	killtrees(stopped, nstopped, SIGCONT);
+
+	if (sigprocmask(SIG_SETMASK, &prev, NULL) == -1)
+		unix_error("sigprocmask error in do_kill");
+	return (status);
+}
+
+/* 
+ * do_memo - Execute the built-in memo command.
+ *
+ * Requires:
+ *   cmd, a command from parseline() whose first word is "memo"
+ *
+ * Effects:
+ *   Implements "memo [-e NAME] [-i file] [-s file] ... command [arg ...]",
+ *   which runs the command as eval() would, but remembers its stdout,
+ *   stderr, and exit status in the store named by TSH_MEMO_DIR (or
+ *   "tsh-memo" in the user's cache directory).  The result is keyed by the
+ *   current directory, the command's words and assignments, any
+ *   here-document, the values of the -e variables, the contents of the -i
+ *   files, and the size and modification time of the -s files.  When the
+ *   key is found, the result is replayed without running anything.
+ *   Otherwise the command's output is shown once it finishes, and stored
+ *   unless it was interrupted or ended by a signal.  Returns the command's
+ *   exit status, or 2 on a usage error.
+ */
+static int
+do_memo(struct Cmd *cmd)
+{
+	struct Cmd sub;
+	struct Buf desc = { NULL, 0, 0 }, dir = { NULL, 0, 0 };
+	struct Buf line = { NULL, 0, 0 };
+	struct stat st;
+	char **argv = cmd->argv, name[17], cwd[PATH_MAX];
+	const char *value;
+	uint64_t hash;
+	int i, fd, outfd, errfd, saveout, saveerr, status;
+
+	if (!memodir(&dir)) {
+		free(dir.s);
+		return (2);
+	}
+
+	// Describe everything that the result depends on.
+	bufputn(&desc, "", 0);
+	if (getcwd(cwd, sizeof(cwd)) != NULL)
+		bufputn(&desc, cwd, strlen(cwd) + 1);
+	for (argv++; *argv != NULL && (*argv)[0] == '-' && argv[1] != NULL;
+	    argv += 2) {
+		if (strcmp(*argv, "-e") == 0) {
+			value = getvar(argv[1]);
+			bufputc(&desc, 'e');
+			bufputn(&desc, argv[1], strlen(argv[1]) + 1);
+			if (value != NULL)
+				bufputn(&desc, value, strlen(value));
+			bufputc(&desc, value != NULL ? '\0' : '\1');
+		} else if (strcmp(*argv, "-i") == 0) {
+			bufputc(&desc, 'i');
+			bufputn(&desc, argv[1], strlen(argv[1]) + 1);
+			if ((fd = open(argv[1], O_RDONLY | O_CLOEXEC)) != -1) {
+				hash = hashfd(fd);
+				close(fd);
+				bufputn(&desc, (char *)&hash, sizeof(hash));
+			}
+			bufputc(&desc, fd != -1 ? '\0' : '\1');
+		} else if (strcmp(*argv, "-s") == 0) {
+			bufputc(&desc, 's');
+			bufputn(&desc, argv[1], strlen(argv[1]) + 1);
+			if (stat(argv[1], &st) == 0) {
+				bufputn(&desc, (char *)&st.st_size,
+				    sizeof(st.st_size));
+				bufputn(&desc, (char *)&st.st_mtim,
+				    sizeof(st.st_mtim));
+			}
+			bufputc(&desc, '\0');
+		} else
+			break;
+	}
+	if (*argv == NULL || cmd->bg) {
+		printf("memo: usage: memo [-e NAME] [-i file] [-s file] ... "
+		    "command [arg ...]\n");
+		free(desc.s);
+		free(dir.s);
+		return (2);
+	}
+	bufputc(&desc, '\0');
+	for (i = 0; i < cmd->nassigns; i++)
+		bufputn(&desc, cmd->assigns[i], strlen(cmd->assigns[i]) + 1);
+	bufputc(&desc, '\0');
+	for (i = 0; argv[i] != NULL; i++)
+		bufputn(&desc, argv[i], strlen(argv[i]) + 1);
+	if (cmd->infd != -1) {
+		hash = hashfd(cmd->infd);
+		lseek(cmd->infd, 0, SEEK_SET);
+		bufputn(&desc, (char *)&hash, sizeof(hash));
+	}
+	hash = 14695981039346656037u;
+	for (i = 0; i < (int)desc.len; i++) {
+		hash ^= (unsigned char)desc.s[i];
+		hash *= 1099511628211u;
+	}
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+	bufputc(&dir, '/');
+	bufputn(&dir, name, strlen(name));
+
+	fflush(stdout);
+	if ((status = replaymemo(dir.s, &desc)) != -1) {
+		free(desc.s);
+		free(dir.s);
+		return (status);
+	}
+
+	// Run the command with its output going to temporary files.
+	dir.s[dir.len - strlen(name) - 1] = '\0';
+	if ((outfd = memotmp(dir.s)) == -1 || (errfd = memotmp(dir.s)) == -1)
+		unix_error("memo: temporary file error");
+	dir.s[dir.len - strlen(name) - 1] = '/';
+	if ((saveout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3)) == -1 ||
+	    (saveerr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3)) == -1 ||
+	    dup2(outfd, STDOUT_FILENO) == -1 || dup2(errfd, STDERR_FILENO) == -1)
+		unix_error("dup2 error in do_memo");
+	sub = *cmd;
+	sub.argv = argv;
+	sub.argc = cmd->argc - (argv - cmd->argv);
+	sub.nsubs = 0;
+	for (i = 0; argv[i] != NULL; i++) {
+		bufputn(&line, argv[i], strlen(argv[i]));
+		bufputc(&line, argv[i + 1] != NULL ? ' ' : '\n');
+	}
+	interrupted = 0;
+	runcmd(&sub, line.s);
+	status = last_status;
+	fflush(stdout);
+	if (dup2(saveout, STDOUT_FILENO) == -1 ||
+	    dup2(saveerr, STDERR_FILENO) == -1)
+		unix_error("dup2 error in do_memo");
+	close(saveout);
+	close(saveerr);
+
+	if (!interrupted && status < 128)
+		storememo(dir.s, &desc, status, outfd, errfd);
+	lseek(outfd, 0, SEEK_SET);
+	lseek(errfd, 0, SEEK_SET);
+	copyfd(outfd, STDOUT_FILENO, -1);
+	copyfd(errfd, STDERR_FILENO, -1);
+	close(outfd);
+	close(errfd);
+	free(desc.s);
+	free(dir.s);
+	free(line.s);
+	return (status);
+}
+
+/* 
+ * do_onexit - Execute the built-in on-exit command.
+ *
+ * Requires:
+ *   argv, an array of string representing the commandline in tokens 
+ *
+ * Effects:
+ *   Implements "on-exit selector action ...", which adds the action, the
+ *   remaining words joined by spaces, as a completion hook of each job
+ *   that the selector chooses, and "on-exit", which lists the hooks.  When
+ *   a job finishes, runhooks() runs its hooks, in the order added, from
+ *   the main loop.  Returns 0, or 1 on a usage error or if the selector is
+ *   invalid or selects no job.
+ */
+static int
+do_onexit(char **argv)
+{
+	static bool mark[MAXJOBS];
+	struct Buf action = { NULL, 0, 0 };
+	struct Hook *hook, **tail;
+	sigset_t mask, prev;
+	int i, n;
+
+	if (argv[1] == NULL) {
+		for (hook = hooks; hook != NULL; hook = hook->next)
+			printf("[%d] (%d) %s\n", hook->jid, (int)hook->pid,
+			    hook->action);
+		return (0);
+	}
+	if (argv[2] == NULL) {
+		printf("on-exit: usage: on-exit [%%jobid | pid] action\n");
+		return (1);
+	}
+	for (i = 2; argv[i] != NULL; i++) {
+		bufputn(&action, argv[i], strlen(argv[i]));
+		if (argv[i + 1] != NULL)
+			bufputc(&action, ' ');
+	}
+
+	// Block SIGCHLD so that no selected job finishes meanwhile.
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	memset(mark, 0, sizeof(mark));
+	if ((n = selectjobs(jobs, argv[1], mark)) == -1)
+		printf("on-exit: argument must be a PID or %%jobid\n");
+	else if (n == 0)
+		printf("%s: No such job\n", argv[1]);
+	for (tail = &hooks; *tail != NULL; tail = &(*tail)->next)
+		;
+	for (i = 0; i < MAXJOBS && n > 0; i++) {
+		if (!mark[i])
+			continue;
+		if ((hook = malloc(sizeof(*hook))) == NULL ||
+		    (hook->action = strdup(action.s)) == NULL)
+			unix_error("malloc error in do_onexit");
+		hook->pid = jobs[i].pid;
+		hook->jid = jobs[i].jid;
+		hook->next = NULL;
+		*tail = hook;
+		tail = &hook->next;
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+	free(action.s);
+	return (n > 0 ? 0 : 1);
+}
+
+/* 
+ * do_output - Execute the built-in output and tail commands.
+ *
+ * Requires:
+ *   argv, an array of string representing the commandline in tokens 
+ *
+ * Effects:
+ *   Implements "output %jobid|pid" and "tail [-n lines] %jobid|pid", which
+ *   print the captured output of a background job: all of it that is
+ *   still held, or just its last lines (10 by default).  If output was
+ *   spilled to a file, "output" prints the whole file.  Returns 0, or 1 if
+ *   the job has no captured output.
+ */
+static int
+do_output(char **argv)
+{
+	struct Capture *cap;
+	char buf[READCHUNK];
+	size_t start, i;
+	ssize_t n;
+	int fd, lines = 10;
+	bool tail = strcmp(argv[0], "tail") == 0;
+
+	if (tail && argv[1] != NULL && strcmp(argv[1], "-n") == 0 &&
+	    argv[2] != NULL) {
+		lines = atoi(argv[2]);
+		argv += 2;
+	}
+	if (argv[1] == NULL || argv[2] != NULL) {
+		printf("%s: usage: %s %s%%jobid|pid\n", argv[0], argv[0],
+		    tail ? "[-n lines] " : "");
+		return (1);
+	}
+	if ((cap = getcapture(argv[1])) == NULL) {
+		printf("%s: No captured output\n", argv[1]);
+		return (1);
+	}
+	fflush(stdout);
+
+	if (!tail && cap->spillpath != NULL &&
+	    (fd = open(cap->spillpath, O_RDONLY | O_CLOEXEC)) != -1) {
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			sio_writen(STDOUT_FILENO, buf, n);
+		close(fd);
+		return (0);
+	}
+
+	// Find the start of the held output, or of its last lines.
+	start = cap->total > cap->size ? cap->total - cap->size : 0;
+	if (tail) {
+		for (i = cap->total; i > start; i--) {
+			if (cap->ring[(i - 1) % cap->size] == '\n' &&
+			    i != cap->total && lines-- <= 1)
+				break;
+		}
+		start = i;
+	} else if (start > 0) {
+		printf("[%zu bytes of earlier output dropped]\n", start);
+		fflush(stdout);
+	}
+	for (i = start; i < cap->total; i += n) {
+		n = cap->size - i % cap->size;
+		if ((size_t)n > cap->total - i)
+			n = cap->total - i;
+		sio_writen(STDOUT_FILENO, &cap->ring[i % cap->size], n);
+	}
+	return (0);
+}
+
+/* 
+ * do_schedule - Execute the built-in at and every commands.
+ *
+ * Requires:
+ *   cmd, a command from parseline() whose first word is "at" or "every"
+ *
+ * Effects:
+ *   Implements "at time command [arg ...]", which runs the command once as
+ *   a background job at "time", either "+duration" from now or the next
+ *   "hh:mm[:ss]" by the clock, and "every [-o] duration command [arg ...]",
+ *   which runs it as a background job every "duration", starting one
+ *   duration from now.  A duration is a number with the unit ms, s (the
+ *   default), m, h, or d.  A run of a recurring command is skipped if the
+ *   previous run is still in the jobs list, unless -o is given.  The
+ *   command keeps its assignments, its files, and its here-document, which
+ *   each run reads from the start.  "at -d @id" and "every -d @id" remove
+ *   a scheduled command.  The commands wait on the timer wheel, which is
+ *   run by firetimers() from the event loop, without a process of their
+ *   own.  Returns 0, or 1 on a usage error or if there is no such timer.
+ */
+static int
+do_schedule(struct Cmd *cmd)
+{
+	struct Timer *timer;
+	struct Buf line = { NULL, 0, 0 };
+	char **argv = cmd->argv;
+	bool every = strcmp(argv[0], "every") == 0, overlap = false;
+	long long ticks;
+	double secs;
+	int i;
+
+	if (argv[1] != NULL && strcmp(argv[1], "-d") == 0 && argv[2] != NULL &&
+	    argv[3] == NULL) {
+		if (!deltimer(atoi(&argv[2][argv[2][0] == '@']))) {
+			printf("%s: No such timer\n", argv[2]);
+			return (1);
+		}
+		return (0);
+	}
+	if (every && argv[1] != NULL && strcmp(argv[1], "-o") == 0) {
+		overlap = true;
+		argv++;
+	}
+	if (argv[1] == NULL || argv[2] == NULL ||
+	    !parsewhen(argv[1], !every, &secs) ||
+	    (every && secs * 1000 < WHEELTICK)) {
+		if (every)
+			printf("every: usage: every [-o] duration command "
+			    "[arg ...] | -d @id\n");
+		else
+			printf("at: usage: at +duration | hh:mm[:ss] command "
+			    "[arg ...] | -d @id\n");
+		return (1);
+	}
+
+	if (wheelfd == -1) {
+		if ((wheelfd = timerfd_create(CLOCK_MONOTONIC,
+		    TFD_CLOEXEC | TFD_NONBLOCK)) == -1)
+			unix_error("timerfd_create error in do_schedule");
+		wheelbase = monotime();
+		addwatch(wheelfd, POLLIN, firetimers, NULL);
+	}
+	if ((timer = calloc(1, sizeof(*timer))) == NULL)
+		unix_error("calloc error in do_schedule");
+	timer->id = nexttimer++;
+	timer->overlap = overlap;
+	timer->spec = strdup(argv[1]);
+	timer->cmd.infd = timer->cmd.outfd = timer->cmd.errfd = -1;
+	for (i = 2; argv[i] != NULL; i++) {
+		pushword(&timer->cmd.argv, &timer->cmd.argc,
+		    &timer->cmd.argmax, strdup(argv[i]));
+		bufputn(&line, argv[i], strlen(argv[i]));
+		bufputc(&line, argv[i + 1] != NULL ? ' ' : '\n');
+	}
+	timer->cmdline = line.s;
+	for (i = 0; i < cmd->nsubs; i++) {
+		// Each run starts the substitutions anew.
+		if (cmd->subs[i].argi < argv + 2 - cmd->argv)
+			continue;
+		timer->cmd.subs[timer->cmd.nsubs] = cmd->subs[i];
+		timer->cmd.subs[timer->cmd.nsubs].text =
+		    strdup(cmd->subs[i].text);
+		timer->cmd.subs[timer->cmd.nsubs].argi -= argv + 2 -
+		    cmd->argv;
+		timer->cmd.nsubs++;
+	}
+	for (i = 0; i < cmd->nassigns; i++)
+		pushword(&timer->cmd.assigns, &timer->cmd.nassigns,
+		    &timer->cmd.assignmax, strdup(cmd->assigns[i]));
+	if ((cmd->infd != -1 && (timer->cmd.infd = fcntl(cmd->infd,
+	    F_DUPFD_CLOEXEC, 0)) == -1) ||
+	    (cmd->outfd != -1 && (timer->cmd.outfd = fcntl(cmd->outfd,
+	    F_DUPFD_CLOEXEC, 0)) == -1) ||
+	    (cmd->errfd != -1 && (timer->cmd.errfd = fcntl(cmd->errfd,
+	    F_DUPFD_CLOEXEC, 0)) == -1))
+		unix_error("fcntl error in do_schedule");
+
+	ticks = (long long)((secs * 1000 + WHEELTICK - 1) / WHEELTICK);
+	if (ticks < 1)
+		ticks = 1;
+	if (every)
+		timer->period = ticks;
+	timer->due = nowtick() + ticks;
+	addtimer(timer);
+	armwheel();
+	printf("[@%d] %s", timer->id, timer->cmdline);
+	return (0);
+}
+
+/* 
+ * do_tee - Execute the built-in tee command.
+ *
+ * Requires:
+ *   cmd, a command from parseline() whose first word is "tee"
+ *
+ * Effects:
+ *   Implements "tee [-a] [-n] [-r input] [file ...]", which copies its
+ *   stdin (a here-document, the input file, or else the shell's own input
+ *   up to end of file) to stdout, unless -n is given, and to each file,
+ *   which is truncated first, or appended to with -a.  fanout() does the
+ *   copying, without a tee process, and, when the input and the outputs
+ *   are pipes, such as those of process substitutions, without copying
+ *   the data through the shell.  So "tee -n -r <(producer) >(a) >(b)"
+ *   sends one producer's output to several consumers.  An output whose
+ *   reader goes away is dropped.  Returns 0, 1 if a file could not be
+ *   opened or written, 2 on a usage error, or 128 + SIGINT if
+ *   interrupted.
+ */
+static int
+do_tee(struct Cmd *cmd)
+{
+	char **argv = cmd->argv;
+	int *outs, i, in, r, nouts = 0, status = 0;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	bool tostdout = true;
+
+	in = cmd->infd != -1 ? cmd->infd : STDIN_FILENO;
+	for (argv++; *argv != NULL && (*argv)[0] == '-' && (*argv)[1] != '\0';
+	    argv++) {
+		if (strcmp(*argv, "-a") == 0)
+			flags = (flags & ~O_TRUNC) | O_APPEND;
+		else if (strcmp(*argv, "-n") == 0)
+			tostdout = false;
+		else if (strcmp(*argv, "-r") == 0 && argv[1] != NULL) {
+			if (in != cmd->infd && in != STDIN_FILENO)
+				close(in);
+			if ((in = open(*++argv, O_RDONLY | O_CLOEXEC)) == -1) {
+				printf("%s: %s\n", *argv, strerror(errno));
+				return (1);
+			}
+		} else {
+			printf("tee: usage: tee [-a] [-n] [-r input] "
+			    "[file ...]\n");
+			if (in != cmd->infd && in != STDIN_FILENO)
+				close(in);
+			return (2);
+		}
+	}
+
+	if ((outs = malloc((cmd->argc + 1) * sizeof(*outs))) == NULL)
+		unix_error("malloc error in do_tee");
+	for (; *argv != NULL; argv++) {
+		if ((outs[nouts] = open(*argv, flags, 0666)) == -1) {
+			printf("%s: %s\n", *argv, strerror(errno));
+			status = 1;
+		} else
+			nouts++;
+	}
+	if (tostdout) {
+		fflush(stdout);
+		outs[nouts++] = STDOUT_FILENO;
+	}
+	interrupted = 0;
+	if ((r = fanout("tee", in, outs, nouts)) != 0)
+		status = r == -1 ? 128 + SIGINT : 1;
+	for (i = 0; i < nouts; i++)
+		if (outs[i] != STDOUT_FILENO)
+			close(outs[i]);
+	free(outs);
+	if (in != cmd->infd && in != STDIN_FILENO)
+		close(in);
+	return (status);
+}
+
+/* 
+ * do_trap - Execute the built-in trap command.
+ *
+ * Requires:
+ *   argv, an array of string representing the commandline in tokens 
+ *
+ * Effects:
+ *   Implements "trap action CHLD", which has runhooks() run "action" from
+ *   the main loop whenever a background job finishes, "trap - CHLD" or
+ *   "trap '' CHLD", which removes it, and "trap", which prints it.  CHLD,
+ *   which may also be given as SIGCHLD, is the only condition.  Returns 0,
+ *   or 1 on a usage error.
+ */
+static int
+do_trap(char **argv)
+{
+	const char *name;
+
+	if (argv[1] == NULL) {
+		if (chldtrap != NULL)
+			printf("trap -- '%s' CHLD\n", chldtrap);
+		return (0);
+	}
+	if (argv[2] == NULL || argv[3] != NULL) {
+		printf("trap: usage: trap [action CHLD]\n");
+		return (1);
+	}
+	name = strncmp(argv[2], "SIG", 3) == 0 ? argv[2] + 3 : argv[2];
+	if (strcmp(name, "CHLD") != 0) {
+		printf("trap: %s: only CHLD can be trapped\n", argv[2]);
+		return (1);
+	}
+	free(chldtrap);
+	chldtrap = NULL;
+	if (strcmp(argv[1], "-") != 0 && argv[1][0] != '\0' &&
+	    (chldtrap = strdup(argv[1])) == NULL)
+		unix_error("strdup error in do_trap");
+	return (0);
+}
+
+/* 
+ * do_unset - Execute the built-in unset command.
+ *
+ * Requires:
+ *   argv, an array of string representing the commandline in tokens 
+ *
+ * Effects:
+ *   Implements "unset NAME ...", removing each named shell variable (and
+ *   so also removing it from the environment of commands).  Returns 0.
+ */
+static int
+do_unset(char **argv)
+{
+
+	for (argv++; *argv != NULL; argv++)
+		unsetvar(*argv);
+	return (0);
+}
+
+/* 
+ * do_wait - Execute the built-in wait command.
+ *
+ * Requires:
+ *   argv, an array of string representing the commandline in tokens 
+ *
+ * Effects:
+ *   Implements "wait", "wait [%jobid | pid] ..." and "wait -n [%jobid | pid]
+ *   ...".  With no arguments, blocks until there are no background jobs
+ *   running.  Otherwise, blocks until each named job terminates, or with -n,
+ *   until any one of them (or of all jobs, if none are named) terminates.
+ *   Rather than polling, it sleeps in eventloop() and is woken by
+ *   sigchld_handler(), which records each completion in donejobs.  Returns
+ *   the exit status of the last job waited for, 127 if a job does not exist,
+ *   or 128 + SIGINT if the wait was interrupted by ctrl-c.
+ */
+static int
+do_wait(char **argv)
+{
+	static bool mark[MAXJOBS];
+	static pid_t pids[MAXJOBS + MAXDONE];
+	volatile struct Done *done = NULL;
+	JobP job;
+	sigset_t mask, prev;
+	unsigned int k;
+	pid_t pid;
+	int i, j, n, npids = 0, status = 0;
+	bool any = false, running;
+
+	if (argv[1] != NULL && strcmp(argv[1], "-n") == 0) {
+		any = true;
+		argv++;
+	}
+
+	// Block SIGCHLD so that no completion is missed between checks.
+	if (sigemptyset(&mask) == -1)
+		unix_error("sigemptyset error in do_wait");
+	if (sigaddset(&mask, SIGCHLD) == -1)
+		unix_error("sigaddset error in do_wait");
+	if (sigprocmask(SIG_BLOCK, &mask, &prev) == -1)
+		unix_error("sigprocmask error in do_wait");
+	interrupted = 0;
+
+	/*
+	 * Resolve every argument to PIDs, reporting any that do not exist.  A
+	 * job or PID that has already terminated is found in donejobs.
+	 */
+	memset(mark, 0, sizeof(mark));
+	for (i = 1; argv[i] != NULL; i++) {
+		status = 127;
+		pid = 0;
+		if ((n = selectjobs(jobs, argv[i], mark)) == -1) {
+			printf("%s: argument must be a PID or %%jobid\n",
+			    argv[0]);
+		} else if (n == 0 && argv[i][0] == '%') {
+			if ((done = getdone(0, atoi(&argv[i][1]))) != NULL &&
+			    isdigit((unsigned char)argv[i][1]))
+				pid = done->pid;
+			else
+				printf("%s: No such job\n", argv[i]);
+		} else if (n == 0) {
+			if ((done = getdone(atoi(argv[i]), 0)) != NULL)
+				pid = done->pid;
+			else
+				printf("(%s) No such process\n", argv[i]);
+		}
+		/*
+		 * Each PID is kept once, so "pids" holds at most one per
+		 * entry of donejobs and one per job, however many arguments
+		 * repeat them.
+		 */
+		for (j = 0; pid != 0 && j < npids && pids[j] != pid; j++)
+			;
+		if (pid != 0 && j == npids && npids < MAXJOBS + MAXDONE)
+			pids[npids++] = pid;
+	}
+	for (i = 0; i < MAXJOBS; i++) {
+		if (!mark[i])
+			continue;
+		for (j = 0; j < npids && pids[j] != jobs[i].pid; j++)
+			;
+		if (j == npids && npids < MAXJOBS + MAXDONE)
+			pids[npids++] = jobs[i].pid;
+	}
+	if (argv[1] != NULL && npids == 0) {
+		sigprocmask(SIG_SETMASK, &prev, NULL);
+		return (127);
+	}
+
+	if (any) {
+		// Return the first completion of any requested job.
+		for (;;) {
+			status = 127;
+			for (k = ndone > MAXDONE ? ndone - MAXDONE : 0;
+			    k < ndone; k++) {
+				done = &donejobs[k % MAXDONE];
+				if (done->waited)
+					continue;
+				for (i = 0; i < npids; i++)
+					if (done->pid == pids[i])
+						break;
+				if (npids == 0 || i < npids)
+					break;
+			}
+			if (k < ndone) {
+				done->waited = true;
+				status = exitstatus(done->status);
+				break;
+			}
+			running = false;
+			for (i = 0; i < MAXJOBS; i++) {
+				if (jobs[i].state != BG)
+					continue;
+				for (k = 0; k < (unsigned int)npids; k++)
+					if (jobs[i].pid == pids[k])
+						break;
+				if (npids == 0 || k < (unsigned int)npids)
+					running = true;
+			}
+			if (!running || interrupted)
+				break;
+			eventloop(&prev, -1);
+		}
+	} else if (argv[1] == NULL) {
+		// Wait for every background job.
+		while (!interrupted) {
+			for (i = 0; i < MAXJOBS; i++)
+				if (jobs[i].state == BG)
+					break;
+			if (i == MAXJOBS)
+				break;
+			eventloop(&prev, -1);
+		}
+		for (k = 0; k < MAXDONE; k++)
+			donejobs[k].waited = true;
+		status = 0;
+	} else {
+		// Wait for each requested job in turn.
+		for (i = 0; i < npids && !interrupted; i++) {
+			while ((job = getjobpid(jobs, pids[i])) != NULL &&
+			    job->state != ST && !interrupted)
+				eventloop(&prev, -1);
+			if (job != NULL)
+				status = 128 + SIGTSTP;
+			else if ((done = getdone(pids[i], 0)) != NULL) {
+				done->waited = true;
+				status = exitstatus(done->status);
+			}
+		}
+	}
+	if (interrupted)
+		status = 128 + SIGINT;
+
+	if (sigprocmask(SIG_SETMASK, &prev, NULL) == -1)
+		unix_error("sigprocmask error in do_wait");
+	return (status);
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process.
+ *
+ * Requires:
+ *   A pid, which represents the process id of the process we want to wait on.
+ *
+ * Effects:
+ *   Uses the child handler to ensure that the job is deleted from the jobs 
+ *   array when the child finishes normally or is terminated/stopped.  Sleeps
+ *   in eventloop() with SIGCHLD unblocked, so it wakes as soon as the
+ *   handler has reaped the job instead of polling, and meanwhile keeps
+ *   draining the output of captured background jobs.  Sets last_status to the
+ *   job's exit status.  If the job's leader exits but leaves descendants
+ *   behind, returns without waiting for them.
+ */
+static void
+waitfg(pid_t pid)
+{
+	volatile struct Done *done;
+	JobP job;
+	sigset_t mask, prev;
+
+	if (sigemptyset(&mask) == -1)
+		unix_error("sigemptyset error in waitfg");
+	if (sigaddset(&mask, SIGCHLD) == -1)
+		unix_error("sigaddset error in waitfg");
+	if (sigprocmask(SIG_BLOCK, &mask, &prev) == -1)
+		unix_error("sigprocmask error in waitfg");
+
+	while (fgpid(jobs) == pid)
+		eventloop(&prev, -1);
+
+	if ((job = getjobpid(jobs, pid)) != NULL && job->orphaned)
+		last_status = exitstatus(job->status);
+	else if (job != NULL)
+		last_status = 128 + SIGTSTP;
+	else if ((done = getdone(pid, 0)) != NULL) {
+		done->waited = true;
+		last_status = exitstatus(done->status);
+	}
+
+	if (sigprocmask(SIG_SETMASK, &prev, NULL) == -1)
+		unix_error("sigprocmask error in waitfg");
+}
+
+/* 
+ * initpath - Perform all necessary initialization of the search path,
+ *  which may be simply saving the path.
+ *
+ * Requires:
+ *   "pathstr" is a valid search path.
+ *
+ * Effects:
+ *   Replaces pathdirs with the directories of "pathstr", in order, where
+ *   an empty one is the current directory, and indexes the executables in
+ *   each absolute one with indexdir().  Does nothing if "pathstr" is the
+ *   search path already in use.
+ */
+static void
+initpath(const char *pathstr)
+{
+	static char *current;
+	const char *p, *end;
+	struct PathDir *dir;
+	int i;
+
+	if (current != NULL && strcmp(current, pathstr) == 0)
+		return;
+	free(current);
+	current = strdup(pathstr);
+	for (i = 0; i < npathdirs; i++) {
+		freeindex(&pathdirs[i]);
+		free(pathdirs[i].path);
+	}
+	free(pathdirs);
+	npathdirs = 1;
+	for (p = pathstr; *p != '\0'; p++)
+		if (*p == ':')
+			npathdirs++;
+	if ((pathdirs = calloc(npathdirs, sizeof(*pathdirs))) == NULL)
+		unix_error("calloc error in initpath");
+
+	for (i = 0, p = pathstr; i < npathdirs; i++, p = end + 1) {
+		if ((end = strchr(p, ':')) == NULL)
+			end = p + strlen(p);
+		dir = &pathdirs[i];
+		dir->path = end == p ? strdup(".") : strndup(p, end - p);
+		dir->indexed = dir->path[0] == '/';
+		if (dir->indexed)
+			indexdir(dir);
+		if (verbose)
+			printf("%s: %s\n", dir->path, !dir->indexed ?
+			    "not indexed" : dir->racy ? "indexed in memory" :
+			    "indexed");
+	}
+}
+
+/*
+ * The signal handlers follow.
+ */
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *  a child job terminates (becomes a zombie), or stops because it
+ *  received a SIGSTOP or SIGTSTP signal.  The handler reaps all
+ *  available zombie children, but doesn't wait for any other
+ *  currently running children to terminate.  
+ *
+ * Requires:
+ *   Signum, although this input isn't used nor necessary
+ *
+ * Effects:
+ *   Uses wait4 to check if a job was terminated or stopped, then reaps
+ *   the child and prints the required message. Records the exit status and
+ *   resource usage in donejobs and deletes the job from the jobs array when
+ *   done, so that waitfg and the wait builtin can stop sleeping, and ends
+ *   the jobs of its process substitutions with killprocsubs().  In
+ *   subreaper mode, a job whose leader exits is kept until the rest of its
+ *   process group has also been reaped. 
+ */
+static void
+sigchld_handler(int signum)
+{
+	struct rusage ru;
+	JobP job;
+	pid_t pid;
+	int i, status, olderrno = errno;
+
+	// Don't know what to do with signum
+	(void)signum;
+
+
+	while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &ru)) > 0) {
+		// Reap Children mwahaha
+		if ((job = getjobpid(jobs, pid)) == NULL) {
+			/*
+			 * An orphaned descendant of some job.  It belongs to
+			 * its process group's job, which is complete once the
+			 * group is empty.
+			 */
+			for (i = 0; i < MAXJOBS; i++) {
+				if (jobs[i].orphaned &&
+				    kill(-jobs[i].pid, 0) == -1 &&
+				    errno == ESRCH) {
+					killprocsubs(&jobs[i], jobs[i].status);
+					adddone(&jobs[i], jobs[i].status);
+					deletejob(jobs, jobs[i].pid);
+				}
+			}
+			continue;
+		}
+		if (WIFSTOPPED(status)) {
+			Sio_puts("Job [");
+			Sio_putl(job->jid);
+			Sio_puts("] (");
+			Sio_putl(pid);
+			Sio_puts(") stopped by signal SIG");
+			Sio_puts(signame[WSTOPSIG(status)]);
+			Sio_puts("\n");
+			job->state = ST;
+		} else {
+			job->utime = ru.ru_utime.tv_sec +
+			    ru.ru_utime.tv_usec / 1e6;
+			job->stime = ru.ru_stime.tv_sec +
+			    ru.ru_stime.tv_usec / 1e6;
+			job->maxrss = ru.ru_maxrss;
+			// A substitution's SIGPIPE is how it normally ends.
+			if (WIFSIGNALED(status) &&
+			    !(job->sub && WTERMSIG(status) == SIGPIPE)) {
+				Sio_puts("Job [");
+				Sio_putl(job->jid);
+				Sio_puts("] (");
+				Sio_putl(pid);
+				Sio_puts(") terminated by signal SIG");
+				Sio_puts(signame[WTERMSIG(status)]);
+				Sio_puts("\n");
+			}
+			if (subreaper && kill(-pid, 0) == 0) {
+				/*
+				 * The leader's descendants are still running,
+				 * so keep the job until they are reaped, but
+				 * give the terminal back to the shell.
+				 */
+				job->orphaned = true;
+				job->status = status;
+				if (job->state == FG)
+					job->state = BG;
+			} else {
+				killprocsubs(job, status);
+				adddone(job, status);
+				deletejob(jobs, pid);
+			}
+		}
+	}
+
+	// Wake the job server, which reports on the jobs it started.
+	if (chldpipe[1] != -1)
+		write(chldpipe[1], "", 1);
+	errno = olderrno;
+}
+
+/* 
+ * sigint_handler - The kernel sends a SIGINT to the shell whenever the
+ *  user types ctrl-c at the keyboard.  Catch it and send it along
+ *  to the foreground job.  
+ *
+ * Requires:
+ *   signum, the signal (should be sigint) to pass along.
+ *
+ * Effects:
+ *   Forwards sigint to all foreground processes.  Also sets "interrupted",
+ *   so that a blocked wait builtin returns and a running loop stops. 
+ */
+static void
+sigint_handler(int signum)
+{
+
+	interrupted = 1;	// Interrupts the wait builtin and loops.
+	if (fgpid(jobs) != 0) {
+		if (getpgid(fgpid(jobs)) != -1) {
+			if (kill(getpgid(fgpid(jobs)) * -1, signum) == 1) {
+				Sio_error("Error sending sigint in handler");
+			}
+		}
+	}
+	
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *  the user types ctrl-z at the keyboard.  Catch it and suspend the
+ *  foreground job by sending it a SIGTSTP.  
+ *
+ * Requires:
+ *   signum, the signal (should be sigtstp) to pass along.
+ *
+ * Effects:
+ *   Forwards sigtstp to all forground processes.
+ */
+static void
+sigtstp_handler(int signum)
+{
+
+	// Prevent an "unused parameter" warning.
+	if (fgpid(jobs) != 0) {
+		if (getpgid(fgpid(jobs)) != -1) {
+			if (kill(getpgid(fgpid(jobs)) * -1, signum) == 1) {
+				Sio_error("Error sending sigtstp in handler");
+			}
+		}
+	}
+	
+	
+}
+
+/*
+ * sigquit_handler - The driver program can gracefully terminate the
+ *  child shell by sending it a SIGQUIT signal.
+ *
+ * Requires:
+ *   "signum" is SIGQUIT.
+ *
+ * Effects:
+ *   Terminates the program.
+ */
+static void
+sigquit_handler(int signum)
+{
+
+	// Prevent an "unused parameter" warning.
+	(void)signum;
+	Sio_puts("Terminating after receipt of SIGQUIT signal\n");
+	_exit(1);
+}
+
+/*
+ * This comment marks the end of the signal handlers.
+ */
+
+/*
+ * The following helper routines manipulate the jobs list.
+ */
+
+/*
+ * Requires:
+ *   "job" points to a job structure.
+ *
+ * Effects:
+ *   Clears the fields in the referenced job structure, returning any
+ *   jobserver token that the job holds to the pool.
+ */
+static void
+clearjob(JobP job)
+{
+
+	job->pid = 0;
+	job->jid = 0;
+	job->state = UNDEF;
+	job->orphaned = false;
+	job->status = 0;
+	if (job->token)
+		write(poolfds[1], "+", 1);
+	job->token = false;
+	if (job->gatefd > 0)
+		close(job->gatefd);
+	job->gatefd = -1;
+	job->hold = 0;
+	job->policy = SCHED_OTHER;
+	job->ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+	job->utime = job->stime = 0;
+	job->maxrss = 0;
+	job->sub = false;
+	job->nsubs = 0;
+	job->cmdline[0] = '\0';
+}
+
+/*
+ * Requires:
+ *   "jobs" points to an array of MAXJOBS job structures.
+ *
+ * Effects:
+ *   Initializes the jobs list to an empty state.
+ */
+static void
+initjobs(JobP jobs)
+{
+	int i;
+
+	for (i = 0; i < MAXJOBS; i++)
+		clearjob(&jobs[i]);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to an array of MAXJOBS job structures.
+ *
+ * Effects:
+ *   Returns the largest allocated job ID.
+ */
+static int
+maxjid(JobP jobs) 
+{
+	int i, max = 0;
+
+	for (i = 0; i < MAXJOBS; i++)
+		if (jobs[i].jid > max)
+			max = jobs[i].jid;
+	return (max);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to an array of MAXJOBS job structures, and "cmdline" is
+ *   a properly terminated string.
+ *
+ * Effects: 
+ *   Adds a job to the jobs list. 
+ */
+static int
+addjob(JobP jobs, pid_t pid, int state, const char *cmdline)
+{
+	int i;
+    
+	if (pid < 1)
+		return (0);
+	for (i = 0; i < MAXJOBS; i++) {
+		if (jobs[i].pid == 0) {
+			jobs[i].pid = pid;
+			jobs[i].state = state;
+			jobs[i].jid = nextjid++;
+			if (nextjid > MAXJOBS)
+				nextjid = 1;
+			jobs[i].start = monotime();
+			// Remove the "volatile" qualifier using a cast.
+			if ((size_t)snprintf((char *)jobs[i].cmdline, MAXLINE,
+			    "%s", cmdline) >= MAXLINE)
+				jobs[i].cmdline[MAXLINE - 2] = '\n';
+			if (verbose) {
+				printf("Added job [%d] %d %s\n", jobs[i].jid,
+				    (int)jobs[i].pid, jobs[i].cmdline);
+			}
+			return (1);
+		}
+	}
+	printf("Tried to create too many jobs\n");
+	return (0);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to an array of MAXJOBS job structures.
+ *
+ * Effects:
+ *   Deletes a job from the jobs list whose PID equals "pid".
+ */
+static int
+deletejob(JobP jobs, pid_t pid) 
+{
+	int i;
+
+	if (pid < 1)
+		return (0);
+	for (i = 0; i < MAXJOBS; i++) {
+		if (jobs[i].pid == pid) {
+			clearjob(&jobs[i]);
+			nextjid = maxjid(jobs) + 1;
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to an array of MAXJOBS job structures.
+ *
+ * Effects:
+ *   Returns the PID of the current foreground job or 0 if no foreground
+ *   job exists.
+ */
+static pid_t
+fgpid(JobP jobs)
+{
+	int i;
+
+	for (i = 0; i < MAXJOBS; i++)
+		if (jobs[i].state == FG)
+			return (jobs[i].pid);
+	return (0);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to an array of MAXJOBS job structures.
+ *
+ * Effects:
+ *   Returns a pointer to the job structure with process ID "pid" or NULL if
+ *   no such job exists.
+ */
+static JobP
+getjobpid(JobP jobs, pid_t pid)
+{
+	int i;
+
+	if (pid < 1)
+		return (NULL);
+	for (i = 0; i < MAXJOBS; i++)
+		if (jobs[i].pid == pid)
+			return (&jobs[i]);
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to an array of MAXJOBS job structures.
+ *
+ * Effects:
+ *   Returns a pointer to the job structure with job ID "jid" or NULL if no
+ *   such job exists.
+ */
+static JobP
+getjobjid(JobP jobs, int jid) 
+{
+	int i;
+
+	if (jid < 1)
+		return (NULL);
+	for (i = 0; i < MAXJOBS; i++)
+		if (jobs[i].jid == jid)
+			return (&jobs[i]);
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the job ID for the job with process ID "pid" or 0 if no such
+ *   job exists.
+ */
+static int
+pid2jid(pid_t pid) 
+{
+	int i;
+
+	if (pid < 1)
+		return (0);
+	for (i = 0; i < MAXJOBS; i++)
+		if (jobs[i].pid == pid)
+			return (jobs[i].jid);
+	return (0);
+}
+
+/*
+ * Requires:
+ *   "job" points to a job that has just terminated with "status".  Must only
+ *   be called by sigchld_handler() or with SIGCHLD blocked.
+ *
+ * Effects:
+ *   Records the job's completion in donejobs, overwriting the oldest record
+ *   if it is full.  This function can be safely called by a signal handler.
+ */
+static void
+adddone(JobP job, int status)
+{
+	volatile struct Done *done = &donejobs[ndone % MAXDONE];
+
+	done->pid = job->pid;
+	done->jid = job->jid;
+	done->status = status;
+	done->elapsed = monotime() - job->start;
+	done->utime = job->utime;
+	done->stime = job->stime;
+	done->maxrss = job->maxrss;
+	done->bg = job->state != FG;
+	done->waited = false;
+	ndone++;
+}
+
+/*
+ * Requires:
+ *   Either "pid" or "jid" is positive.  SIGCHLD is blocked.
+ *
+ * Effects:
+ *   Returns the most recent completion record for the job with process ID
+ *   "pid", or if "pid" is 0, with job ID "jid".  Returns NULL if no such
+ *   record exists.
+ */
+static volatile struct Done *
+getdone(pid_t pid, int jid)
+{
+	volatile struct Done *done;
+	unsigned int k;
+
+	for (k = ndone; k > 0 && ndone - k < MAXDONE; k--) {
+		done = &donejobs[(k - 1) % MAXDONE];
+		if (pid > 0 ? done->pid == pid : done->jid == jid)
+			return (done);
+	}
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   "status" is a status as returned by waitpid().
+ *
+ * Effects:
+ *   Returns the shell exit status for "status": the exit code of a process
+ *   that exited, or 128 plus the number of the signal that terminated or
+ *   stopped it.
+ */
+static int
+exitstatus(int status)
+{
+
+	if (WIFEXITED(status))
+		return (WEXITSTATUS(status));
+	if (WIFSIGNALED(status))
+		return (128 + WTERMSIG(status));
+	if (WIFSTOPPED(status))
+		return (128 + WSTOPSIG(status));
+	return (status);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to an array of MAXJOBS job structures, and "mark", if
+ *   not NULL, to an array of MAXJOBS flags.
+ *
+ * Effects:
+ *   Prints the jobs list, or, if "mark" is not NULL, the marked jobs.  In
+ *   subreaper mode, also prints the number of live descendants of each
+ *   job.
+ */
+static void
+listjobs(JobP jobs, const bool *mark) 
+{
+	struct Proc *procs = NULL;
+	int i, nprocs = 0;
+
+	if (subreaper)
+		nprocs = readprocs(&procs);
+	for (i = 0; i < MAXJOBS; i++) {
+		if (jobs[i].pid != 0 && (mark == NULL || mark[i])) {
+			printf("[%d] (%d) ", jobs[i].jid, (int)jobs[i].pid);
+			switch (jobs[i].state) {
+			case BG: 
+				if (jobs[i].hold != 0)
+					printf("Waiting (%s) ",
+					    holdname[jobs[i].hold]);
+				else
+					printf("Running ");
+				break;
+			case FG: 
+				printf("Foreground ");
+				break;
+			case ST: 
+				printf("Stopped ");
+				break;
+			default:
+				printf("listjobs: Internal error: "
+				    "job[%d].state=%d ", i, jobs[i].state);
+			}
+			if (subreaper) {
+				printf("(%d descendants) ", countdescendants(
+				    procs, nprocs, jobs[i].pid));
+			}
+			printf("%s", jobs[i].cmdline);
+		}
+	}
+	free(procs);
+}
+
+/*
+ * Requires:
+ *   "jobs" points to an array of MAXJOBS job structures, "mark" to an
+ *   array of MAXJOBS flags, and "sel" is a properly terminated string.
+ *
+ * Effects:
+ *   Sets the flags in "mark" of the jobs that "sel" selects, which is one
+ *   of:
+ *     pid          the job with that PID
+ *     %n           the job with job ID n
+ *     %n-m, %n-%m  the jobs with job IDs from n to m
+ *     %all         every job
+ *     %running     the jobs running in the background
+ *     %stopped     the stopped jobs
+ *     %waiting     the jobs held before exec
+ *     %/regex/     the jobs whose command lines match the extended
+ *                  regular expression
+ *     %prefix      the jobs whose command lines begin with "prefix"
+ *   The jobs are matched in a single pass over the jobs list.  Returns
+ *   the number of jobs selected, or -1 if "sel" is not a selector.
+ */
+static int
+selectjobs(JobP jobs, const char *sel, bool *mark)
+{
+	enum { PID, RANGE, ALL, RUNNING, STOPPED, WAITING, REGEX, PREFIX } kind;
+	regex_t re;
+	char *end, *pat;
+	long lo = 0, hi = 0;
+	size_t len = 0;
+	bool match;
+	int i, n = 0;
+
+	if (sel[0] != '%') {
+		kind = PID;
+		lo = strtol(sel, &end, 10);
+		if (end == sel || *end != '\0' || lo <= 0)
+			return (-1);
+	} else if (isdigit((unsigned char)sel[1])) {
+		kind = RANGE;
+		lo = hi = strtol(sel + 1, &end, 10);
+		if (*end == '-') {
+			end += end[1] == '%' ? 2 : 1;
+			if (!isdigit((unsigned char)*end))
+				return (-1);
+			hi = strtol(end, &end, 10);
+		}
+		if (*end != '\0')
+			return (-1);
+	} else if (strcmp(sel, "%all") == 0)
+		kind = ALL;
+	else if (strcmp(sel, "%running") == 0)
+		kind = RUNNING;
+	else if (strcmp(sel, "%stopped") == 0)
+		kind = STOPPED;
+	else if (strcmp(sel, "%waiting") == 0)
+		kind = WAITING;
+	else if (sel[1] == '/') {
+		kind = REGEX;
+		if ((len = strlen(sel)) < 4 || sel[len - 1] != '/')
+			return (-1);
+		if ((pat = strndup(sel + 2, len - 3)) == NULL)
+			unix_error("strndup error in selectjobs");
+		i = regcomp(&re, pat, REG_EXTENDED | REG_NOSUB);
+		free(pat);
+		if (i != 0)
+			return (-1);
+	} else {
+		kind = PREFIX;
+		if ((len = strlen(++sel)) == 0)
+			return (-1);
+	}
+
+	for (i = 0; i < MAXJOBS; i++) {
+		if (jobs[i].pid == 0)
+			continue;
+		switch (kind) {
+		case PID:
+			match = jobs[i].pid == lo;
+			break;
+		case RANGE:
+			match = jobs[i].jid >= lo && jobs[i].jid <= hi;
+			break;
+		case ALL:
+			match = true;
+			break;
+		case RUNNING:
+			match = jobs[i].state == BG && jobs[i].hold == 0;
+			break;
+		case STOPPED:
+			match = jobs[i].state == ST;
+			break;
+		case WAITING:
+			match = jobs[i].hold != 0;
+			break;
+		case REGEX:
+			match = regexec(&re, (const char *)jobs[i].cmdline, 0,
+			    NULL, 0) == 0;
+			break;
+		default:
+			match = strncmp((const char *)jobs[i].cmdline, sel,
+			    len) == 0;
+			break;
+		}
+		if (match) {
+			mark[i] = true;
+			n++;
+		}
+	}
+	if (kind == REGEX)
+		regfree(&re);
+	return (n);
+}
+
+/*
+ * This comment marks the end of the jobs list helper routines.
+ */
+
+/*
+ * The following helper routines manage the shell variables and the cached
+ * environment.
+ */
+
+/*
+ * Requires:
+ *   "s" points to at least "len" characters.
+ *
+ * Effects:
+ *   Returns true if the first "len" characters of "s" form a valid
+ *   variable name: a letter or underscore followed by letters, digits, and
+ *   underscores.
+ */
+static bool
+isname(const char *s, size_t len)
+{
+	size_t i;
+
+	if (len == 0 || isdigit((unsigned char)s[0]))
+		return (false);
+	for (i = 0; i < len; i++)
+		if (!isalnum((unsigned char)s[i]) && s[i] != '_')
+			return (false);
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "name" points to at least "len" characters.
+ *
+ * Effects:
+ *   Returns the bucket index in vartab of the variable named by the first
+ *   "len" characters of "name", computed with the FNV-1a hash.
+ */
+static size_t
+varhash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return (h & (nvarbuckets - 1));
+}
+
+/*
+ * Requires:
+ *   "name" points to at least "namelen" characters.
+ *
+ * Effects:
+ *   Returns the shell variable named by the first "namelen" characters of
+ *   "name", or NULL if it is not set.
+ */
+static struct Var *
+lookupvar(const char *name, size_t namelen)
+{
+	struct Var *var;
+
+	if (nvarbuckets == 0)
+		return (NULL);
+	for (var = vartab[varhash(name, namelen)]; var != NULL;
+	    var = var->next) {
+		if (var->namelen == namelen &&
+		    strncmp(var->str, name, namelen) == 0)
+			return (var);
+	}
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   "name" is a properly terminated string.
+ *
+ * Effects:
+ *   Returns the value of the shell variable "name", or NULL if it is not
+ *   set.
+ */
+static const char *
+getvar(const char *name)
+{
+	struct Var *var;
+
+	if ((var = lookupvar(name, strlen(name))) == NULL)
+		return (NULL);
+	return (var->str + var->namelen + 1);
+}
+
+/*
+ * Requires:
+ *   "name" is a properly terminated string.
+ *
+ * Effects:
+ *   Returns the value that the variable "name" has for the command: that
+ *   of its last assignment to "name", if any, or else that of the shell
+ *   variable, or NULL if it is not set.
+ */
+static const char *
+cmdvar(const struct Cmd *cmd, const char *name)
+{
+	size_t len = strlen(name);
+	int i;
+
+	for (i = cmd->nassigns - 1; i >= 0; i--) {
+		if (strncmp(cmd->assigns[i], name, len) == 0 &&
+		    cmd->assigns[i][len] == '=')
+			return (cmd->assigns[i] + len + 1);
+	}
+	return (getvar(name));
+}
+
+/*
+ * Requires:
+ *   "str" is a properly terminated string of the form "NAME=value".
+ *
+ * Effects:
+ *   Sets the shell variable NAME to "value", creating it if necessary, and
+ *   marks it for export if "export" is true.  Changing the value of an
+ *   exported variable updates its envp slot in place; only a change to the
+ *   set of exported variables requires envp to be rebuilt.  Setting PATH
+ *   also reinitializes the search path.
+ */
+static void
+setvar(const char *str, bool export)
+{
+	struct Var *var, **oldtab, *next;
+	size_t i, namelen = strcspn(str, "="), oldbuckets;
+
+	if ((var = lookupvar(str, namelen)) == NULL) {
+		// Keep the load factor at most 1 by doubling the table.
+		if (nvars >= nvarbuckets) {
+			oldtab = vartab;
+			oldbuckets = nvarbuckets;
+			nvarbuckets = nvarbuckets == 0 ? 64 : nvarbuckets * 2;
+			if ((vartab = calloc(nvarbuckets, sizeof(*vartab))) ==
+			    NULL)
+				unix_error("calloc error in setvar");
+			for (i = 0; i < oldbuckets; i++) {
+				for (var = oldtab[i]; var != NULL; var = next) {
+					next = var->next;
+					var->next = vartab[varhash(var->str,
+					    var->namelen)];
+					vartab[varhash(var->str, var->namelen)] =
+					    var;
+				}
+			}
+			free(oldtab);
+		}
+		if ((var = calloc(1, sizeof(*var))) == NULL)
+			unix_error("calloc error in setvar");
+		var->namelen = namelen;
+		var->next = vartab[varhash(str, namelen)];
+		vartab[varhash(str, namelen)] = var;
+		nvars++;
+	}
+	free(var->str);
+	if ((var->str = strdup(str)) == NULL)
+		unix_error("strdup error in setvar");
+	if (export && !var->exported) {
+		var->exported = true;
+		envdirty = true;
+	} else if (var->exported && !envdirty)
+		envp[var->envidx] = var->str;
+
+	// Until main() has set up the search path, TSH_EXEC_DIR may be unset.
+	if (namelen == 4 && strncmp(str, "PATH", 4) == 0 && pathdirs != NULL)
+		initpath(str + 5);
+}
+
+/*
+ * Requires:
+ *   "name" is a properly terminated string.
+ *
+ * Effects:
+ *   Removes the shell variable "name", if it is set.  Unsetting PATH
+ *   empties the search path, as setting it to "" does.
+ */
+static void
+unsetvar(const char *name)
+{
+	struct Var *var, **prevp;
+	size_t namelen = strlen(name);
+
+	if (nvarbuckets == 0)
+		return;
+	for (prevp = &vartab[varhash(name, namelen)]; (var = *prevp) != NULL;
+	    prevp = &var->next) {
+		if (var->namelen == namelen &&
+		    strncmp(var->str, name, namelen) == 0) {
+			*prevp = var->next;
+			if (var->exported)
+				envdirty = true;
+			free(var->str);
+			free(var);
+			nvars--;
+			// With no PATH, only the current directory is searched.
+			if (namelen == 4 && strcmp(name, "PATH") == 0)
+				initpath("");
+			return;
+		}
+	}
+}
+
+/*
+ * Requires:
+ *   "env" is a NULL-terminated array of "NAME=value" strings.
+ *
+ * Effects:
+ *   Creates an exported shell variable for every string in "env".
+ */
+static void
+initvars(char **env)
+{
+
+	for (; *env != NULL; env++)
+		if (strchr(*env, '=') != NULL)
+			setvar(*env, true);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the environment for a new command: a NULL-terminated array of
+ *   the "NAME=value" strings of all exported variables.  The array is
+ *   cached, and only rebuilt when the set of exported variables has
+ *   changed.  It has ENVSPARE free slots after the terminating NULL for
+ *   applyoverrides().
+ */
+static char **
+getenvp(void)
+{
+	struct Var *var;
+	size_t i;
+
+	if (!envdirty)
+		return (envp);
+	envc = 0;
+	for (i = 0; i < nvarbuckets; i++)
+		for (var = vartab[i]; var != NULL; var = var->next)
+			envc += var->exported;
+	if ((envp = realloc(envp, (envc + 1 + ENVSPARE) * sizeof(*envp))) ==
+	    NULL)
+		unix_error("realloc error in getenvp");
+	envc = 0;
+	for (i = 0; i < nvarbuckets; i++) {
+		for (var = vartab[i]; var != NULL; var = var->next) {
+			if (var->exported) {
+				var->envidx = envc;
+				envp[envc++] = var->str;
+			}
+		}
+	}
+	envp[envc] = NULL;
+	envdirty = false;
+	return (envp);
+}
+
+/*
+ * Requires:
+ *   "*envpp" is the array returned by getenvp(), and this is a child
+ *   process that is about to exec, so that the array may be modified
+ *   without affecting the shell.
+ *
+ * Effects:
+ *   Applies the command's "NAME=value" assignments to the environment.  A
+ *   variable that is already exported has its slot overwritten, and any
+ *   other is appended, so the cost depends only on the number of
+ *   assignments and not on the size of the environment.
+ */
+static void
+applyoverrides(char ***envpp, const struct Cmd *cmd)
+{
+	struct Var *var;
+	int i, n = envc;
+
+	if (cmd->nassigns > ENVSPARE &&
+	    (*envpp = realloc(*envpp, (envc + 1 + cmd->nassigns) *
+	    sizeof(**envpp))) == NULL)
+		unix_error("realloc error in applyoverrides");
+	for (i = 0; i < cmd->nassigns; i++) {
+		var = lookupvar(cmd->assigns[i],
+		    strcspn(cmd->assigns[i], "="));
+		if (var != NULL && var->exported)
+			(*envpp)[var->envidx] = cmd->assigns[i];
+		else
+			(*envpp)[n++] = cmd->assigns[i];
+	}
+	(*envpp)[n] = NULL;
+}
+
+/*
+ * This comment marks the end of the shell variable helper routines.
+ */
+
+/*
+ * The following helper routines expand glob patterns.
+ */
+
+/*
+ * Requires:
+ *   "pat" is a properly terminated glob pattern, in which '\\' escapes the
+ *   next character.
+ *
+ * Effects:
+ *   Appends the paths matching "pat" to the arguments in "cmd", in sorted
+ *   order.  '*' matches any string, '?' any character, and "[...]" any
+ *   character in the set (negated by a leading '!' or '^').  A path
+ *   component of "**" matches any number of directories.  A leading '.' in
+ *   a name must be matched explicitly.  Returns the number of paths added,
+ *   or -1 if they would not fit within ARG_MAX, in which case none are
+ *   added.
+ */
+static int
+globword(const char *pat, struct Cmd *cmd)
+{
+	struct Buf path = { NULL, 0, 0 };
+	char *copy, *comps[MAXARGS];
+	size_t size = argsize(cmd->argv);
+	int i, ncomps = 0, start = cmd->argc, n;
+
+	// Split the pattern into its path components.
+	if ((copy = strdup(pat)) == NULL)
+		unix_error("strdup error in globword");
+	bufputn(&path, "", 0);
+	if (copy[0] == '/')
+		bufputc(&path, '/');
+	for (i = 0; copy[i] != '\0' && ncomps < MAXARGS; ) {
+		while (copy[i] == '/')
+			i++;
+		comps[ncomps++] = &copy[i];
+		while (copy[i] != '/' && copy[i] != '\0')
+			i++;
+		if (copy[i] == '/')
+			copy[i++] = '\0';
+	}
+	if (i > 0 && pat[i - 1] == '/' && ncomps < MAXARGS)
+		comps[ncomps++] = &copy[i];	// Only match directories.
+
+	n = globdir(&path, comps, ncomps, cmd, &size);
+	if (n == -1) {
+		for (i = start; i < cmd->argc; i++)
+			free(cmd->argv[i]);
+		cmd->argc = start;
+		cmd->argv[start] = NULL;
+	} else {
+		qsort(&cmd->argv[start], n, sizeof(*cmd->argv), cmpstr);
+	}
+	free(copy);
+	free(path.s);
+	return (n);
+}
+
+/*
+ * Requires:
+ *   "path" holds a directory path, empty for the current directory, and
+ *   "comps" holds the "ncomps" remaining pattern components below it.
+ *
+ * Effects:
+ *   Appends to "cmd" every path that matches "comps" below "path", and
+ *   adds their argument size to "*sizep".  Returns the number of paths
+ *   added, or -1 if "*sizep" exceeds ARG_MAX.  "path" is restored before
+ *   returning.
+ */
+static int
+globdir(struct Buf *path, char **comps, int ncomps, struct Cmd *cmd,
+    size_t *sizep)
+{
+	struct Listing *dir;
+	struct stat st;
+	size_t len = path->len, dirlen;
+	int i, n, count = 0;
+	bool recurse, isdir;
+	char *p;
+
+	if (ncomps == 0 || (ncomps == 1 && comps[0][0] == '\0')) {
+		if (path->len == 0)
+			return (0);
+		// A trailing '/' only matches directories.
+		if (ncomps == 1 && path->s[path->len - 1] != '/')
+			bufputc(path, '/');
+		*sizep += path->len + 1 + sizeof(char *);
+		if (*sizep > argmax())
+			return (-1);
+		pushword(&cmd->argv, &cmd->argc, &cmd->argmax,
+		    strdup(path->s));
+		path->len = len;
+		path->s[len] = '\0';
+		return (1);
+	}
+	if ((recurse = strcmp(comps[0], "**") == 0)) {
+		// Match no directories, then recurse into each one below.
+		if ((count = globdir(path, comps + 1, ncomps - 1, cmd,
+		    sizep)) == -1)
+			return (-1);
+	}
+	if (len > 0 && path->s[len - 1] != '/')
+		bufputc(path, '/');
+
+	if (!hasmeta(comps[0])) {
+		// Remove the escapes from a literal component.
+		for (p = comps[0]; *p != '\0'; p++) {
+			if (*p == '\\' && p[1] != '\0')
+				p++;
+			bufputc(path, *p);
+		}
+		count = 0;
+		if (ncomps > 1 || lstat(path->s, &st) == 0)
+			count = globdir(path, comps + 1, ncomps - 1, cmd, sizep);
+	} else if ((dir = getlisting(len > 0 ? path->s : ".")) != NULL) {
+		dirlen = path->len;
+		dir->pinned++;
+		for (i = 0; i < dir->n && count != -1; i++) {
+			if (dir->name[i][0] == '.' && comps[0][0] != '.' &&
+			    strncmp(comps[0], "\\.", 2) != 0)
+				continue;
+			if (!recurse && !matchpat(comps[0], dir->name[i]))
+				continue;
+			path->len = dirlen;
+			bufputn(path, dir->name[i], strlen(dir->name[i]));
+
+			/*
+			 * Only directories can match inner components, and
+			 * "**" does not follow symbolic links.  A final "**"
+			 * also matches the files in each directory.
+			 */
+			isdir = dir->types[i] == DT_DIR;
+			if ((ncomps > 1 || recurse) && !isdir &&
+			    (dir->types[i] == DT_UNKNOWN ||
+			    (dir->types[i] == DT_LNK && !recurse)))
+				isdir = (recurse ? lstat(path->s, &st) :
+				    stat(path->s, &st)) == 0 &&
+				    S_ISDIR(st.st_mode);
+			if (recurse && isdir)
+				n = globdir(path, comps, ncomps, cmd, sizep);
+			else if (recurse && ncomps == 1)
+				n = globdir(path, NULL, 0, cmd, sizep);
+			else if (ncomps == 1 || isdir)
+				n = globdir(path, comps + 1, ncomps - 1, cmd,
+				    sizep);
+			else
+				continue;
+			count = n == -1 ? -1 : count + n;
+		}
+		dir->pinned--;
+	}
+	path->len = len;
+	path->s[len] = '\0';
+	return (count);
+}
+
+/*
+ * Requires:
+ *   "path" is a properly terminated string.
+ *
+ * Effects:
+ *   Returns the listing of directory "path", or NULL if it cannot be read.
+ *   Listings are cached, so a directory is only read again, with large
+ *   getdents64() calls, if it has changed since it was last read.  When the
+ *   cache is full, the least recently used listing that is not pinned is
+ *   evicted.
+ */
+static struct Listing *
+getlisting(const char *path)
+{
+	static char *dentbuf;
+	struct Listing *dir, *lru;
+	struct Dirent64 *ent;
+	struct Buf names = { NULL, 0, 0 };
+	struct timespec now;
+	struct stat st;
+	unsigned char *types = NULL;
+	long nread, off;
+	int fd, i, n = 0, max = 0;
+	char *p;
+
+	if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+		return (NULL);
+	globclock++;
+	for (i = 0, lru = NULL; i < GLOBCACHE; i++) {
+		dir = &listings[i];
+		if (dir->path != NULL && strcmp(dir->path, path) == 0) {
+			// A pinned listing is in use, so it cannot be replaced.
+			if (dir->pinned > 0 || (!dir->racy &&
+			    dir->dev == st.st_dev && dir->ino == st.st_ino &&
+			    dir->mtime.tv_sec == st.st_mtim.tv_sec &&
+			    dir->mtime.tv_nsec == st.st_mtim.tv_nsec)) {
+				dir->lastuse = globclock;
+				return (dir);
+			}
+			lru = dir;
+			break;
+		}
+		if (dir->pinned == 0 &&
+		    (lru == NULL || dir->lastuse < lru->lastuse))
+			lru = dir;
+	}
+	if (lru == NULL)
+		return (NULL);	// Every listing is in use.
+
+	// Read the directory afresh.
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return (NULL);
+	if (dentbuf == NULL && (dentbuf = malloc(DENTBUF)) == NULL)
+		unix_error("malloc error in getlisting");
+	while ((nread = syscall(SYS_getdents64, fd, dentbuf, DENTBUF)) > 0) {
+		for (off = 0; off < nread; off += ent->d_reclen) {
+			ent = (struct Dirent64 *)(dentbuf + off);
+			if (strcmp(ent->d_name, ".") == 0 ||
+			    strcmp(ent->d_name, "..") == 0)
+				continue;
+			if (n == max) {
+				max = max == 0 ? 64 : max * 2;
+				if ((types = realloc(types, max)) == NULL)
+					unix_error("realloc error in getlisting");
+			}
+			types[n++] = ent->d_type;
+			bufputn(&names, ent->d_name, strlen(ent->d_name) + 1);
+		}
+	}
+	close(fd);
+	if (nread == -1) {
+		free(names.s);
+		free(types);
+		return (NULL);
+	}
+
+	dir = lru;
+	free(dir->path);
+	free(dir->names);
+	free(dir->types);
+	free(dir->name);
+	dir->path = strdup(path);
+	dir->dev = st.st_dev;
+	dir->ino = st.st_ino;
+	dir->mtime = st.st_mtim;
+	clock_gettime(CLOCK_REALTIME, &now);
+	dir->racy = now.tv_sec - st.st_mtim.tv_sec < 2;
+	dir->names = names.s;
+	dir->types = types;
+	dir->n = n;
+	if ((dir->name = malloc((n + 1) * sizeof(*dir->name))) == NULL)
+		unix_error("malloc error in getlisting");
+	for (i = 0, p = names.s; i < n; i++, p += strlen(p) + 1)
+		dir->name[i] = p;
+	dir->lastuse = globclock;
+	return (dir);
+}
+
+/*
+ * Requires:
+ *   "pat" is a properly terminated glob pattern.
+ *
+ * Effects:
+ *   Returns true if "pat" contains an unescaped '*', '?', or '['.
+ */
+static bool
+hasmeta(const char *pat)
+{
+
+	for (; *pat != '\0'; pat++) {
+		if (*pat == '\\' && pat[1] != '\0')
+			pat++;
+		else if (*pat == '*' || *pat == '?' || *pat == '[')
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * Requires:
+ *   "pat" is a properly terminated glob pattern, and "name" is a properly
+ *   terminated string.
+ *
+ * Effects:
+ *   Returns true if "pat" matches the whole of "name".  On a mismatch after
+ *   a '*', only that last '*' needs to be retried at a later position, so
+ *   the match takes time proportional to the product of their lengths at
+ *   worst.
+ */
+static bool
+matchpat(const char *pat, const char *name)
+{
+	const char *starpat = NULL, *starname = NULL;
+
+	for (;;) {
+		if (*pat == '*') {
+			while (*pat == '*')
+				pat++;
+			if (*pat == '\0')
+				return (true);
+			starpat = pat;
+			starname = name;
+			continue;
+		}
+		if (*name == '\0')
+			return (*pat == '\0');
+		if (*pat != '\0' && matchone(&pat, *name)) {
+			name++;
+			continue;
+		}
+		if (starpat == NULL)
+			return (false);
+		pat = starpat;
+		name = ++starname;
+	}
+}
+
+/*
+ * Requires:
+ *   "*patp" points to a non-empty glob pattern that does not start with
+ *   '*'.
+ *
+ * Effects:
+ *   Returns true, and advances "*patp" past the pattern's first element, if
+ *   that element matches the character "c".  The element is '?', a "[...]"
+ *   set, or a possibly escaped literal character.  A '[' without a closing
+ *   ']' is a literal.
+ */
+static bool
+matchone(const char **patp, char c)
+{
+	const char *p = *patp;
+	bool negate, match = false;
+	char lo, hi;
+
+	if (*p == '?') {
+		*patp = p + 1;
+		return (true);
+	}
+	if (*p == '[') {
+		p++;
+		if ((negate = (*p == '!' || *p == '^')))
+			p++;
+		// A ']' first in the set is a member of it.
+		do {
+			if (*p == '\\' && p[1] != '\0')
+				p++;
+			if (*p == '\0')
+				break;
+			lo = hi = *p++;
+			if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+				p++;
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+				hi = *p++;
+			}
+			if ((unsigned char)lo <= (unsigned char)c &&
+			    (unsigned char)c <= (unsigned char)hi)
+				match = true;
+		} while (*p != ']');
+		if (*p == ']') {
+			*patp = p + 1;
+			return (match != negate);
+		}
+		p = *patp;	// No closing ']', so '[' is a literal.
+	}
+	if (*p == '\\' && p[1] != '\0')
+		p++;
+	if (*p != c)
+		return (false);
+	*patp = p + 1;
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "pids" holds the "*npids" PIDs of running background batches.  SIGCHLD
+ *   is blocked, and "mask" is the signal mask to wait with, in which it is
+ *   not.
+ *
+ * Effects:
+ *   Waits in eventloop() until one of the batches has terminated or
+ *   stopped, or the shell is interrupted, and removes it from "pids".
+ *   A stopped batch is left to the user.  Returns the batch's exit status,
+ *   or 0 if interrupted.
+ */
+static int
+waitbatch(pid_t *pids, int *npids, const sigset_t *mask)
+{
+	volatile struct Done *done;
+	JobP job;
+	int i, status;
+
+	for (;;) {
+		for (i = 0; i < *npids; i++) {
+			job = getjobpid(jobs, pids[i]);
+			if (job == NULL || job->state != BG)
+				break;
+		}
+		if (i < *npids)
+			break;
+		if (interrupted)
+			return (0);
+		eventloop(mask, -1);
+	}
+	if (job != NULL)
+		status = 128 + SIGTSTP;
+	else if ((done = getdone(pids[i], 0)) != NULL) {
+		done->waited = true;
+		status = exitstatus(done->status);
+	} else
+		status = 0;
+	pids[i] = pids[--*npids];
+	return (status);
+}
+
+/*
+ * Requires:
+ *   "argv" is a NULL-terminated array of strings.
+ *
+ * Effects:
+ *   Returns the number of bytes that "argv" occupies when passed to
+ *   execve(): its strings, their NULs, and the array of pointers.
+ */
+static size_t
+argsize(char **argv)
+{
+	size_t size = sizeof(char *);
+
+	for (; *argv != NULL; argv++)
+		size += strlen(*argv) + 1 + sizeof(char *);
+	return (size);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the number of bytes available to the arguments of a command:
+ *   the system's ARG_MAX, less the size of the environment and ARGSLACK
+ *   bytes of headroom.
+ */
+static size_t
+argmax(void)
+{
+	static long limit;
+	size_t envsize = argsize(getenvp());
+
+	if (limit == 0 && (limit = sysconf(_SC_ARG_MAX)) == -1)
+		limit = 131072;	// POSIX's minimum is much lower, but Linux's
+				// has never been.
+	if ((size_t)limit < envsize + ARGSLACK)
+		return (0);
+	return (limit - envsize - ARGSLACK);
+}
+
+/*
+ * This comment marks the end of the glob helper routines.
+ */
+
+/*
+ * The following helper routines parse and run control flow: if, while,
+ * until, and for, and shell functions.
+ */
+
+/*
+ * Requires:
+ *   "src" is a properly terminated string.
+ *
+ * Effects:
+ *   Parses "src" into a command list, and returns 1 and a reference to the
+ *   parsed source in "*astp", which the caller must release with
+ *   releaseast().  Returns 0 if "src" ends within a compound command, or
+ *   -1 (after printing a message) if it has a syntax error.  Parsed sources
+ *   are cached by their text, so that running a loop or function the same
+ *   way again, from the input or another function, needs no parsing.
+ */
+static int
+getast(const char *src, struct Ast **astp)
+{
+	struct Ast *ast;
+	struct Tok *toks, *tok;
+	struct Node *root;
+	uint32_t hash = 2166136261u;
+	const char *p;
+	int i, lru, r;
+
+	for (p = src; *p != '\0'; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 16777619u;
+	}
+	astclock++;
+	for (i = 0, lru = 0; i < ASTCACHE; i++) {
+		ast = asts[i];
+		if (ast != NULL && ast->hash == hash &&
+		    strcmp(ast->src, src) == 0) {
+			ast->lastuse = astclock;
+			ast->refs++;
+			*astp = ast;
+			return (1);
+		}
+		if (asts[lru] != NULL &&
+		    (ast == NULL || ast->lastuse < asts[lru]->lastuse))
+			lru = i;
+	}
+
+	if (tokenize(src, &toks) == -1)
+		return (-1);
+	tok = toks;
+	if ((r = parselist(&tok, &root, false)) == 1 && tok->type != TEND) {
+		printf("Syntax error: unexpected '%s'\n",
+		    keywords[tok->type - TIF]);
+		r = -1;
+	}
+	for (tok = toks; tok->type != TEND; tok++) {
+		free(tok->text);
+		free(tok->name);
+	}
+	free(toks);
+	if (r != 1) {
+		if (r == 0)
+			freenode(root);
+		return (r);
+	}
+
+	// Replace the least recently used source.
+	if ((ast = malloc(sizeof(*ast))) == NULL ||
+	    (ast->src = strdup(src)) == NULL)
+		unix_error("malloc error in getast");
+	ast->hash = hash;
+	ast->root = root;
+	ast->refs = 2;
+	ast->lastuse = astclock;
+	if (asts[lru] != NULL)
+		releaseast(asts[lru]);
+	asts[lru] = ast;
+	*astp = ast;
+	return (1);
+}
+
+/*
+ * Requires:
+ *   "ast" was returned by getast() and has not been released by this
+ *   holder.
+ *
+ * Effects:
+ *   Drops a reference to "ast", freeing it when none are left.
+ */
+static void
+releaseast(struct Ast *ast)
+{
+
+	if (--ast->refs > 0)
+		return;
+	freenode(ast->root);
+	free(ast->src);
+	free(ast);
+}
+
+/*
+ * Requires:
+ *   "src" is a properly terminated string.
+ *
+ * Effects:
+ *   Splits "src" into tokens, ended by a TEND token, and returns them in a
+ *   new array in "*toksp".  Commands are separated by newlines, ';', and
+ *   '&', and a reserved word or function definition may start a command.
+ *   Returns 0, or -1 (after printing a message) on a syntax error.
+ */
+static int
+tokenize(const char *src, struct Tok **toksp)
+{
+	struct Tok *toks = NULL, *tok;
+	struct Buf text = { NULL, 0, 0 };
+	const char *p = src, *q;
+	size_t len;
+	int k, ntoks = 0, maxtoks = 0;
+
+	for (;;) {
+		if (ntoks == maxtoks) {
+			maxtoks = maxtoks == 0 ? 16 : maxtoks * 2;
+			if ((toks = realloc(toks, maxtoks * sizeof(*toks))) ==
+			    NULL)
+				unix_error("realloc error in tokenize");
+		}
+		tok = &toks[ntoks];
+		tok->text = tok->name = NULL;
+		tok->heredoc = false;
+		p += strspn(p, " \t\n;");
+		if (*p == '\0') {
+			tok->type = TEND;
+			break;
+		}
+		ntoks++;
+
+		// Is the first word a reserved word?
+		len = strcspn(p, " \t\n;&");
+		for (k = 0; k < (int)(sizeof(keywords) / sizeof(keywords[0]));
+		    k++)
+			if (strlen(keywords[k]) == len &&
+			    strncmp(p, keywords[k], len) == 0)
+				break;
+		if (k < (int)(sizeof(keywords) / sizeof(keywords[0]))) {
+			tok->type = TIF + k;
+			p += len;
+			continue;
+		}
+
+		if (len == 3 && strncmp(p, "for", 3) == 0) {
+			// The variable, then the words up to the command's end.
+			tok->type = TFOR;
+			p += 3 + strspn(p + 3, " \t");
+			len = strcspn(p, " \t\n;&");
+			if (!isname(p, len)) {
+				printf("Syntax error: bad for variable\n");
+				goto error;
+			}
+			tok->name = strndup(p, len);
+			p += len + strspn(p + len, " \t");
+			if (strncmp(p, "in", 2) != 0 ||
+			    strcspn(p, " \t\n;&") != 2)
+				continue;	// Iterate over the arguments.
+			q = cmdend(p, &tok->heredoc);
+			text.len = 0;
+			bufputn(&text, p, q - p);
+			bufputc(&text, '\n');
+			tok->text = strdup(text.s);
+			p = q;
+			continue;
+		}
+
+		// Is it a function definition, "NAME()" or "NAME ()"?
+		for (len = 0; isalnum((unsigned char)p[len]) || p[len] == '_';
+		    len++)
+			continue;
+		q = p + len + strspn(p + len, " \t");
+		if (isname(p, len) && *q == '(' &&
+		    q[1 + strspn(q + 1, " \t")] == ')') {
+			tok->type = TFUNC;
+			tok->name = strndup(p, len);
+			p = q + 1 + strspn(q + 1, " \t") + 1;
+			continue;
+		}
+
+		// Otherwise, a simple command, as parseline() expects it.
+		tok->type = TCMD;
+		q = cmdend(p, &tok->heredoc);
+		text.len = 0;
+		bufputn(&text, p, q - p);
+		bufputc(&text, '\n');
+		tok->text = strdup(text.s);
+		p = q;
+	}
+	free(text.s);
+	*toksp = toks;
+	return (0);
+
+error:
+	for (k = 0; k < ntoks; k++) {
+		free(toks[k].text);
+		free(toks[k].name);
+	}
+	free(toks);
+	free(text.s);
+	return (-1);
+}
+
+/*
+ * Requires:
+ *   "p" points into a properly terminated string.
+ *
+ * Effects:
+ *   Returns a pointer to the end of the command starting at "p": its first
+ *   unquoted newline or ';', the character after its first unquoted '&', or
+ *   the end of the string, skipping over process substitutions.  Sets
+ *   "*heredocp" to whether the command has a here-document, whose body
+ *   would follow it in the input.
+ */
+static const char *
+cmdend(const char *p, bool *heredocp)
+{
+	const char *q;
+
+	*heredocp = false;
+	while (*p != '\0' && *p != '\n' && *p != ';') {
+		switch (*p) {
+		case '\'':
+			if ((q = strchr(p + 1, '\'')) == NULL)
+				return (p + strlen(p));
+			p = q + 1;
+			break;
+		case '"':
+			for (p++; *p != '\0' && *p != '"'; p++)
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+			if (*p == '"')
+				p++;
+			break;
+		case '\\':
+			p += p[1] != '\0' ? 2 : 1;
+			break;
+		case '&':
+			return (p + 1);
+		case '<':
+		case '>':
+			if (p[1] == '(') {
+				if ((q = subend(p + 2)) == NULL)
+					return (p + strlen(p));
+				p = q + 1;
+			} else if (strncmp(p, "<<<", 3) == 0)
+				p += 3;
+			else if (strncmp(p, "<<", 2) == 0) {
+				*heredocp = true;
+				p += 2;
+			} else
+				p++;
+			break;
+		default:
+			p++;
+		}
+	}
+	return (p);
+}
+
+/*
+ * Requires:
+ *   "p" points just past the '(' of a process substitution in a properly
+ *   terminated string.
+ *
+ * Effects:
+ *   Returns a pointer to the ')' that ends the process substitution,
+ *   skipping over quoted text and nested parentheses, or NULL if the
+ *   string ends first.
+ */
+static const char *
+subend(const char *p)
+{
+	const char *q;
+	int depth = 1;
+
+	for (; *p != '\0'; p++) {
+		switch (*p) {
+		case '\'':
+			if ((q = strchr(p + 1, '\'')) == NULL)
+				return (NULL);
+			p = q;
+			break;
+		case '"':
+			for (p++; *p != '\0' && *p != '"'; p++)
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+			if (*p == '\0')
+				return (NULL);
+			break;
+		case '\\':
+			if (p[1] != '\0')
+				p++;
+			break;
+		case '(':
+			depth++;
+			break;
+		case ')':
+			if (--depth == 0)
+				return (p);
+			break;
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   "*tokp" points into an array of tokens ended by TEND.
+ *
+ * Effects:
+ *   Parses commands from "*tokp" into a new list in "*listp", up to the
+ *   first token that cannot start a command, and advances "*tokp" to that
+ *   token.  If "nested" is true, the list is part of a compound command,
+ *   and so cannot have a here-document.  Returns 1, 0 if the tokens end
+ *   within a compound command, or -1 (after printing a message) on a syntax
+ *   error.  Unless -1 is returned, "*listp" holds what was parsed.
+ */
+static int
+parselist(struct Tok **tokp, struct Node **listp, bool nested)
+{
+	struct Node *node, **tailp = listp;
+	struct Tok *tok;
+	int r;
+
+	*listp = NULL;
+	for (;;) {
+		tok = *tokp;
+		if (tok->type == TCMD || tok->type == TFOR) {
+			if (tok->heredoc && (nested || tok->type == TFOR)) {
+				printf("Syntax error: here-document in a "
+				    "compound command\n");
+				goto error;
+			}
+		} else if (tok->type != TFUNC && tok->type != TIF &&
+		    tok->type != TWHILE && tok->type != TUNTIL)
+			return (1);
+		if ((node = calloc(1, sizeof(*node))) == NULL)
+			unix_error("calloc error in parselist");
+		*tailp = node;
+		tailp = &node->next;
+		node->type = tok->type;
+
+		switch (tok->type) {
+		case TCMD:
+			node->text = tok->text;
+			tok->text = NULL;
+			(*tokp)++;
+			continue;
+		case TIF:
+			r = parseif(tokp, node);
+			break;
+		case TWHILE:
+		case TUNTIL:
+			(*tokp)++;
+			if ((r = parselist(tokp, &node->cond, true)) == 1 &&
+			    (r = expect(tokp, TDO)) == 1 &&
+			    (r = parselist(tokp, &node->body, true)) == 1)
+				r = expect(tokp, TDONE);
+			break;
+		case TFOR:
+			node->name = tok->name;
+			node->text = tok->text;
+			tok->name = tok->text = NULL;
+			(*tokp)++;
+			if ((r = expect(tokp, TDO)) == 1 &&
+			    (r = parselist(tokp, &node->body, true)) == 1)
+				r = expect(tokp, TDONE);
+			break;
+		default:	// TFUNC
+			node->name = tok->name;
+			tok->name = NULL;
+			(*tokp)++;
+			if ((r = expect(tokp, TLBRACE)) == 1 &&
+			    (r = parselist(tokp, &node->body, true)) == 1)
+				r = expect(tokp, TRBRACE);
+			break;
+		}
+		if (r == 1 && node->type != TFOR && node->type != TIF &&
+		    (node->body == NULL || (node->type != TFUNC &&
+		    node->cond == NULL))) {
+			printf("Syntax error: empty command list\n");
+			r = -1;
+		}
+		if (r != 1) {
+			if (r == -1)
+				goto error;
+			return (0);
+		}
+	}
+
+error:
+	freenode(*listp);
+	*listp = NULL;
+	return (-1);
+}
+
+/*
+ * Requires:
+ *   "*tokp" points to a TIF or TELIF token, and "node" to a new node.
+ *
+ * Effects:
+ *   Parses an if command, or the rest of one from an elif, into "node", up
+ *   to and including its fi.  Returns as parselist() does, having advanced
+ *   "*tokp" past what was parsed.
+ */
+static int
+parseif(struct Tok **tokp, struct Node *node)
+{
+	int r;
+
+	node->type = TIF;
+	(*tokp)++;
+	if ((r = parselist(tokp, &node->cond, true)) != 1 ||
+	    (r = expect(tokp, TTHEN)) != 1 ||
+	    (r = parselist(tokp, &node->body, true)) != 1)
+		return (r);
+	if ((*tokp)->type == TEND)
+		return (0);
+	if (node->cond == NULL || node->body == NULL) {
+		printf("Syntax error: empty command list\n");
+		return (-1);
+	}
+	switch ((*tokp)->type) {
+	case TELIF:
+		if ((node->alt = calloc(1, sizeof(*node->alt))) == NULL)
+			unix_error("calloc error in parseif");
+		return (parseif(tokp, node->alt));
+	case TELSE:
+		(*tokp)++;
+		if ((r = parselist(tokp, &node->alt, true)) != 1)
+			return (r);
+		if ((*tokp)->type != TEND && node->alt == NULL) {
+			printf("Syntax error: empty command list\n");
+			return (-1);
+		}
+		/* FALLTHROUGH */
+	default:
+		return (expect(tokp, TFI));
+	}
+}
+
+/*
+ * Requires:
+ *   "*tokp" points into an array of tokens ended by TEND.
+ *
+ * Effects:
+ *   Advances "*tokp" past a token of "type" and returns 1.  Returns 0 at
+ *   the end of the tokens, or -1 (after printing a message) if the token is
+ *   something else.
+ */
+static int
+expect(struct Tok **tokp, int type)
+{
+
+	if ((*tokp)->type == type) {
+		(*tokp)++;
+		return (1);
+	}
+	if ((*tokp)->type == TEND)
+		return (0);
+	printf("Syntax error: unexpected '%s' (wanted '%s')\n",
+	    keywords[(*tokp)->type - TIF], keywords[type - TIF]);
+	return (-1);
+}
+
+/*
+ * Requires:
+ *   "node" is a command list from parselist(), or NULL.
+ *
+ * Effects:
+ *   Frees the list and everything within it.
+ */
+static void
+freenode(struct Node *node)
+{
+	struct Node *next;
+
+	for (; node != NULL; node = next) {
+		next = node->next;
+		free(node->text);
+		free(node->name);
+		freenode(node->cond);
+		freenode(node->body);
+		freenode(node->alt);
+		free(node);
+	}
+}
+
+/*
+ * Requires:
+ *   "node" is a command list within "ast", which the caller holds.
+ *
+ * Effects:
+ *   Runs the commands of the list in turn, in the shell itself: simple
+ *   commands through eval(), so that builtins and function calls create no
+ *   process, and compound commands directly.  Stops early at a ctrl-c or
+ *   on break, continue, or return.  Sets last_status to the status of the
+ *   last command run.
+ */
+static void
+runlist(struct Ast *ast, struct Node *node)
+{
+	struct Func *func;
+
+	for (; node != NULL && !interrupted && loopctl == 0;
+	    node = node->next) {
+		switch (node->type) {
+		case TCMD:
+			eval(node->text);
+			break;
+		case TIF:
+			runlist(ast, node->cond);
+			if (interrupted || loopctl != 0)
+				break;
+			if (last_status == 0)
+				runlist(ast, node->body);
+			else if (node->alt != NULL)
+				runlist(ast, node->alt);
+			else
+				last_status = 0;
+			break;
+		case TFUNC:
+			if ((func = getfunc(node->name)) == NULL) {
+				if ((func = malloc(sizeof(*func))) == NULL)
+					unix_error("malloc error in runlist");
+				func->name = strdup(node->name);
+				func->next = funcs;
+				funcs = func;
+			} else
+				releaseast(func->ast);
+			func->ast = ast;
+			func->body = node->body;
+			ast->refs++;
+			last_status = 0;
+			break;
+		default:
+			runloop(ast, node);
+			break;
+		}
+	}
+}
+
+/*
+ * Requires:
+ *   "node" is a TWHILE, TUNTIL, or TFOR node within "ast", which the caller
+ *   holds.
+ *
+ * Effects:
+ *   Runs the loop, honoring break and continue within it.  For a for loop,
+ *   the words are expanded by parseline() and assigned to the variable in
+ *   turn, or if there are none, the function's arguments are.  Sets
+ *   last_status to the status of the last command of the body, or 0 if the
+ *   body never ran.
+ */
+static void
+runloop(struct Ast *ast, struct Node *node)
+{
+	struct Cmd words;
+	struct Buf var = { NULL, 0, 0 };
+	char **argv = NULL;
+	int i, status = 0;
+
+	if (node->type == TFOR) {
+		if (node->text == NULL) {
+			argv = nposargs > 0 ? posargs + 1 : NULL;
+			words.argc = 0;
+		} else if (parseline(node->text, &words) == -1) {
+			last_status = 2;
+			return;
+		} else
+			argv = words.argv + 1;
+	}
+	loopdepth++;
+	for (i = 0; !interrupted; i++) {
+		if (node->type != TFOR) {
+			runlist(ast, node->cond);
+			if (loopctl == 0 &&
+			    (last_status == 0) != (node->type == TWHILE))
+				break;
+		} else {
+			if (argv == NULL || argv[i] == NULL)
+				break;
+			var.len = 0;
+			bufputn(&var, node->name, strlen(node->name));
+			bufputc(&var, '=');
+			bufputn(&var, argv[i], strlen(argv[i]));
+			setvar(var.s, false);
+		}
+		if (loopctl == 0) {
+			runlist(ast, node->body);
+			status = last_status;
+		}
+
+		// A break or continue of n loops ends n - 1 loops first.
+		if (loopctl == LOOPBREAK || loopctl == LOOPCONT) {
+			if (--loopcount > 0)
+				break;
+			if (loopctl == LOOPBREAK) {
+				loopctl = 0;
+				break;
+			}
+			loopctl = 0;
+		} else if (loopctl == FUNCRET)
+			break;
+	}
+	loopdepth--;
+	if (node->type == TFOR && node->text != NULL)
+		freecmd(&words);
+	free(var.s);
+	if (interrupted)
+		last_status = 128 + SIGINT;
+	else if (loopctl != FUNCRET)
+		last_status = status;
+}
+
+/*
+ * Requires:
+ *   "name" is a properly terminated string.
+ *
+ * Effects:
+ *   Returns the function named "name", or NULL if there is none.
+ */
+static struct Func *
+getfunc(const char *name)
+{
+	struct Func *func;
+
+	for (func = funcs; func != NULL; func = func->next)
+		if (strcmp(func->name, name) == 0)
+			return (func);
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   "cmd" is a command from parseline() that calls "func".
+ *
+ * Effects:
+ *   Runs the function's body in the shell, with "$1" and onward expanding
+ *   to the command's arguments, and sets last_status to the status of its
+ *   last command, or that given to return.  The command's assignments are
+ *   made to the shell variables.
+ */
+static void
+callfunc(struct Func *func, struct Cmd *cmd)
+{
+	struct Ast *ast = func->ast;
+	char **saveargs = posargs;
+	int i, saveloops = loopdepth, savenargs = nposargs;
+
+	if (cmd->bg) {
+		printf("%s: functions cannot run in the background\n",
+		    cmd->argv[0]);
+		last_status = 1;
+		return;
+	}
+	if (funcdepth == MAXFUNCDEPTH) {
+		printf("%s: maximum function nesting exceeded\n",
+		    cmd->argv[0]);
+		last_status = 1;
+		return;
+	}
+	for (i = 0; i < cmd->nassigns; i++)
+		setvar(cmd->assigns[i], false);
+
+	// The function may be redefined while it runs.
+	ast->refs++;
+	posargs = cmd->argv;
+	nposargs = cmd->argc;
+	loopdepth = 0;
+	funcdepth++;
+	last_status = 0;
+	runlist(ast, func->body);
+	funcdepth--;
+	loopdepth = saveloops;
+	posargs = saveargs;
+	nposargs = savenargs;
+	if (loopctl == FUNCRET)
+		loopctl = 0;
+	releaseast(ast);
+}
+
+/*
+ * This comment marks the end of the control flow helper routines.
+ */
+
+/*
+ * The following helper routines implement the event loop.
+ */
+
+/*
+ * Requires:
+ *   SIGCHLD is blocked, and "mask" is the signal mask to wait with, in which
+ *   it is not.
+ *
+ * Effects:
+ *   Waits, with the signal mask set to "mask", until a signal is caught or
+ *   one of the watched file descriptors or "infd" (unless it is -1) is
+ *   ready, and then calls the handlers of the watched file descriptors
+ *   that are ready.  Because ppoll() sets the mask atomically, a SIGCHLD
+ *   that arrives before the wait begins still ends it.  Returns true if
+ *   "infd" is ready for reading.
+ */
+static bool
+eventloop(const sigset_t *mask, int infd)
+{
+	static struct pollfd *fds;
+	static int maxfds;
+	int i, j, nfds = 0;
+	bool ready = false;
+
+	if (nwatches + 1 > maxfds) {
+		maxfds = nwatches + 16;
+		if ((fds = realloc(fds, maxfds * sizeof(*fds))) == NULL)
+			unix_error("realloc error in eventloop");
+	}
+	for (i = 0; i < nwatches; i++) {
+		fds[nfds].fd = watches[i].fd;
+		fds[nfds].events = watches[i].events;
+		nfds++;
+	}
+	if (infd != -1) {
+		fds[nfds].fd = infd;
+		fds[nfds].events = POLLIN;
+		nfds++;
+	}
+
+	if (ppoll(fds, nfds, NULL, mask) == -1) {
+		if (errno != EINTR)
+			unix_error("ppoll error");
+		return (false);
+	}
+
+	/*
+	 * Call the handlers, which may remove watches (by setting their fd to
+	 * -1) or add them, to be polled next time.
+	 */
+	for (i = 0; i < nfds - (infd != -1); i++) {
+		if (fds[i].revents != 0 && watches[i].fd == fds[i].fd)
+			watches[i].handler(watches[i].fd, watches[i].arg);
+	}
+	if (infd != -1 && fds[nfds - 1].revents != 0)
+		ready = true;
+
+	// Compact the watches that were removed.
+	for (i = j = 0; i < nwatches; i++)
+		if (watches[i].fd != -1)
+			watches[j++] = watches[i];
+	nwatches = j;
+	return (ready);
+}
+
+/*
+ * Requires:
+ *   "fd" is an open file descriptor that is not already watched.
+ *
+ * Effects:
+ *   Makes the event loop call "handler(fd, arg)" whenever "fd" has any of
+ *   the poll() "events".
+ */
+static void
+addwatch(int fd, short events, void (*handler)(int, void *), void *arg)
+{
+
+	if (nwatches == maxwatches) {
+		maxwatches = maxwatches == 0 ? 16 : maxwatches * 2;
+		if ((watches = realloc(watches, maxwatches *
+		    sizeof(*watches))) == NULL)
+			unix_error("realloc error in addwatch");
+	}
+	watches[nwatches].fd = fd;
+	watches[nwatches].events = events;
+	watches[nwatches].handler = handler;
+	watches[nwatches].arg = arg;
+	nwatches++;
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Stops the event loop from watching "fd".  This is safe to call from a
+ *   watch handler.
+ */
+static void
+delwatch(int fd)
+{
+	int i;
+
+	for (i = 0; i < nwatches; i++)
+		if (watches[i].fd == fd)
+			watches[i].fd = -1;
+}
+
+/*
+ * This comment marks the end of the event loop helper routines.
+ */
+
+/*
+ * The following helper routines capture the output of background jobs.
+ */
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns true if the output of background jobs is to be captured, which
+ *   is the case when the shell variable TSH_CAPTURE is set to something
+ *   other than "" or "0".
+ */
+static bool
+capturing(void)
+{
+	const char *value = getvar("TSH_CAPTURE");
+
+	return (value != NULL && value[0] != '\0' && strcmp(value, "0") != 0);
+}
+
+/*
+ * Requires:
+ *   "job" is a background job, and "fd" is the read end of the pipe that is
+ *   the job's stdout and stderr.
+ *
+ * Effects:
+ *   Starts capturing the job's output in a ring buffer of TSH_CAPTURE_MAX
+ *   bytes (CAPTUREMAX by default).  Any earlier capture for the same job
+ *   ID is discarded.
+ */
+static void
+newcapture(JobP job, int fd)
+{
+	struct Capture *cap, **capp;
+	const char *value;
+
+	for (capp = &captures; (cap = *capp) != NULL; ) {
+		if (cap->jid == job->jid) {
+			*capp = cap->next;
+			if (cap->fd != -1) {
+				delwatch(cap->fd);
+				close(cap->fd);
+			}
+			if (cap->spillfd != -1)
+				close(cap->spillfd);
+			free(cap->spillpath);
+			free(cap->ring);
+			free(cap);
+		} else
+			capp = &cap->next;
+	}
+
+	if ((cap = calloc(1, sizeof(*cap))) == NULL)
+		unix_error("calloc error in newcapture");
+	cap->jid = job->jid;
+	cap->pid = job->pid;
+	cap->fd = fd;
+	cap->spillfd = -1;
+	value = getvar("TSH_CAPTURE_MAX");
+	cap->size = value != NULL && atol(value) > 0 ? (size_t)atol(value) :
+	    CAPTUREMAX;
+	if ((cap->ring = malloc(cap->size)) == NULL)
+		unix_error("malloc error in newcapture");
+	cap->next = captures;
+	captures = cap;
+
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+		unix_error("fcntl error in newcapture");
+	addwatch(fd, POLLIN, draincapture, cap);
+}
+
+/*
+ * Requires:
+ *   "arg" is the Capture whose pipe is "fd".
+ *
+ * Effects:
+ *   Reads everything available from the pipe into the capture's ring
+ *   buffer.  When the output first outgrows the ring buffer, and the shell
+ *   variable TSH_CAPTURE_SPILL names a directory, the output so far is
+ *   written to a spill file there, and so is all later output.  If the
+ *   spill file cannot be opened, that is reported once, and the capture
+ *   keeps only its ring buffer.  A job in the foreground also has its
+ *   output copied to the shell's stdout.  At end of file, the pipe is
+ *   closed.
+ */
+static void
+draincapture(int fd, void *arg)
+{
+	struct Capture *cap = arg;
+	struct Buf path = { NULL, 0, 0 };
+	const char *dir;
+	char buf[READCHUNK], num[64];
+	size_t i, start;
+	ssize_t n;
+	JobP job;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		if (cap->spillfd == -1 && cap->spillpath == NULL &&
+		    !cap->spillfailed && cap->total + n > cap->size &&
+		    (dir = getvar("TSH_CAPTURE_SPILL")) != NULL &&
+		    dir[0] != '\0') {
+			bufputn(&path, dir, strlen(dir));
+			snprintf(num, sizeof(num), "/tsh-%d-%d.out",
+			    (int)getpid(), (int)cap->pid);
+			bufputn(&path, num, strlen(num));
+			cap->spillpath = path.s;
+			if ((cap->spillfd = open(path.s, O_WRONLY | O_CREAT |
+			    O_TRUNC | O_APPEND | O_CLOEXEC, 0600)) == -1) {
+				printf("%s: %s\n", path.s, strerror(errno));
+				free(cap->spillpath);
+				cap->spillpath = NULL;
+				cap->spillfailed = true;
+			} else {
+				// The ring buffer still holds all the output.
+				sio_writen(cap->spillfd, cap->ring, cap->total);
+			}
+		}
+		if (cap->spillfd != -1)
+			sio_writen(cap->spillfd, buf, n);
+		if ((job = getjobpid(jobs, cap->pid)) != NULL &&
+		    job->state == FG)
+			sio_writen(STDOUT_FILENO, buf, n);
+
+		// Only the last "size" bytes fit in the ring buffer.
+		start = (size_t)n > cap->size ? n - cap->size : 0;
+		for (i = start; i < (size_t)n; i++)
+			cap->ring[(cap->total + i) % cap->size] = buf[i];
+		cap->total += n;
+	}
+	if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+		delwatch(fd);
+		close(fd);
+		cap->fd = -1;
+		if (cap->spillfd != -1) {
+			close(cap->spillfd);
+			cap->spillfd = -1;
+		}
+	}
+}
+
+/*
+ * Requires:
+ *   "id" is a properly terminated string.
+ *
+ * Effects:
+ *   Returns the capture of the job named by "id", a "%jobid" or PID, or
+ *   NULL if there is none.
+ */
+static struct Capture *
+getcapture(const char *id)
+{
+	struct Capture *cap;
+
+	for (cap = captures; cap != NULL; cap = cap->next) {
+		if (id[0] == '%' ? cap->jid == atoi(&id[1]) :
+		    cap->pid == atoi(id))
+			return (cap);
+	}
+	return (NULL);
+}
+
+/*
+ * This comment marks the end of the output capture helper routines.
+ */
+
+/*
+ * The following helper routines inspect the process tree through /proc.
+ */
+
+/*
+ * Requires:
+ *   "procsp" points to a pointer that can be set.
+ *
+ * Effects:
+ *   Reads the PID, parent PID, and process group of every live process
+ *   from /proc into a newly allocated array, stores the array in
+ *   "*procsp", and returns the number of processes read.  The caller must
+ *   free the array.  Zombies are skipped.
+ */
+static int
+readprocs(struct Proc **procsp)
+{
+	struct Proc *procs = NULL;
+	struct dirent *ent;
+	DIR *dir;
+	FILE *fp;
+	char path[64], buf[512], *p, state;
+	int n = 0, max = 0, ppid, pgrp;
+
+	if ((dir = opendir("/proc")) == NULL)
+		unix_error("opendir error in readprocs");
+	while ((ent = readdir(dir)) != NULL) {
+		if (!isdigit((unsigned char)ent->d_name[0]))
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/stat",
+		    atoi(ent->d_name));
+		if ((fp = fopen(path, "r")) == NULL)
+			continue;	// The process has already exited.
+		p = fgets(buf, sizeof(buf), fp);
+		fclose(fp);
+		// The command name may contain spaces, so skip past its ')'.
+		if (p == NULL || (p = strrchr(buf, ')')) == NULL ||
+		    sscanf(p + 1, " %c %d %d", &state, &ppid, &pgrp) != 3 ||
+		    state == 'Z')
+			continue;
+		if (n == max) {
+			max = max == 0 ? 256 : max * 2;
+			if ((procs = realloc(procs, max * sizeof(*procs))) ==
+			    NULL)
+				unix_error("realloc error in readprocs");
+		}
+		procs[n].pid = atoi(ent->d_name);
+		procs[n].ppid = ppid;
+		procs[n].pgrp = pgrp;
+		n++;
+	}
+	closedir(dir);
+	*procsp = procs;
+	return (n);
+}
+
+/*
+ * Requires:
+ *   "procs" is an array of "nprocs" processes as read by readprocs().
+ *
+ * Effects:
+ *   Returns the number of live processes in process group "pgid", not
+ *   counting its leader.
+ */
+static int
+countdescendants(const struct Proc *procs, int nprocs, pid_t pgid)
+{
+	int i, count = 0;
+
+	for (i = 0; i < nprocs; i++)
+		if (procs[i].pgrp == pgid && procs[i].pid != pgid)
+			count++;
+	return (count);
+}
+
+/*
+ * Requires:
+ *   "pgids" holds the process group IDs of "npgids" jobs.
+ *
+ * Effects:
+ *   Sends signal "signum" to every process in each of the process groups.
+ *   In subreaper mode, also sends it to every descendant of the groups
+ *   that has since moved to a process group of its own, so that the jobs'
+ *   whole process trees are signalled.  The trees of all the groups are
+ *   found in one pass over /proc.
+ */
+static void
+killtrees(const pid_t *pgids, int npgids, int signum)
+{
+	struct Proc *procs;
+	bool *intree, changed;
+	int i, j, nprocs;
+
+	for (i = 0; i < npgids; i++)
+		kill(-pgids[i], signum);
+	if (!subreaper || npgids == 0)
+		return;
+
+	nprocs = readprocs(&procs);
+	if ((intree = calloc(nprocs + 1, sizeof(*intree))) == NULL)
+		unix_error("calloc error in killtrees");
+	for (i = 0; i < nprocs; i++) {
+		for (j = 0; j < npgids; j++)
+			if (procs[i].pgrp == pgids[j])
+				intree[i] = true;
+	}
+	do {
+		changed = false;
+		for (i = 0; i < nprocs; i++) {
+			if (intree[i])
+				continue;
+			for (j = 0; j < nprocs; j++) {
+				if (intree[j] && procs[i].ppid == procs[j].pid)
+					break;
+			}
+			if (j < nprocs) {
+				intree[i] = changed = true;
+				kill(procs[i].pid, signum);
+			}
+		}
+	} while (changed);
+	free(intree);
+	free(procs);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Looks up the scheduling class that the command is to have while in
+ *   the background.  Its CPU policy is given by TSH_BG_SCHED, which is
+ *   "batch" (SCHED_BATCH, the default), "idle" (SCHED_IDLE), or "normal"
+ *   (SCHED_OTHER), and its I/O priority by TSH_BG_IOPRIO, which is "idle"
+ *   (the idle class, the default), "low" (the lowest best-effort level),
+ *   or "normal".  Either may be set by an assignment on the command.
+ */
+static void
+bgclass(const struct Cmd *cmd, int *policyp, int *iopriop)
+{
+	const char *value;
+
+	value = cmdvar(cmd, "TSH_BG_SCHED");
+	if (value != NULL && strcmp(value, "normal") == 0)
+		*policyp = SCHED_OTHER;
+	else if (value != NULL && strcmp(value, "idle") == 0)
+		*policyp = SCHED_IDLE;
+	else
+		*policyp = SCHED_BATCH;
+
+	value = cmdvar(cmd, "TSH_BG_IOPRIO");
+	if (value != NULL && strcmp(value, "normal") == 0)
+		*iopriop = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+	else if (value != NULL && strcmp(value, "low") == 0)
+		*iopriop = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7);
+	else
+		*iopriop = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+}
+
+/*
+ * Requires:
+ *   "policy" is SCHED_OTHER, SCHED_BATCH, or SCHED_IDLE.
+ *
+ * Effects:
+ *   Gives the process "pid" or, if "group" is true, every thread of every
+ *   process in the process group "pid", the CPU scheduling policy "policy"
+ *   and the I/O priority "ioprio".  Errors are ignored: a process may have
+ *   exited, and without privilege a process cannot always leave
+ *   SCHED_IDLE.
+ */
+static void
+setclass(pid_t pid, bool group, int policy, int ioprio)
+{
+	struct sched_param param = { 0 };
+	struct Proc *procs;
+	struct dirent *ent;
+	DIR *dir;
+	char path[64];
+	int i, nprocs;
+
+	if (!group) {
+		sched_setscheduler(pid, policy, &param);
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, ioprio);
+		return;
+	}
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PGRP, pid, ioprio);
+	nprocs = readprocs(&procs);
+	for (i = 0; i < nprocs; i++) {
+		if (procs[i].pgrp != pid)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/task", procs[i].pid);
+		if ((dir = opendir(path)) == NULL)
+			continue;	// The process has already exited.
+		while ((ent = readdir(dir)) != NULL) {
+			if (isdigit((unsigned char)ent->d_name[0]))
+				sched_setscheduler(atoi(ent->d_name), policy,
+				    &param);
+		}
+		closedir(dir);
+	}
+	free(procs);
+}
+
+/*
+ * Requires:
+ *   "pid" is positive.
+ *
+ * Effects:
+ *   Returns the sample entry for the process "pid", opening and caching
+ *   its /proc files if it is not already sampled, so that each refresh
+ *   costs one pread() per file rather than an open() and a close().
+ *   Returns NULL if the process does not exist.
+ */
+static struct Sample *
+getsample(pid_t pid)
+{
+	struct Sample *sample;
+	char path[64];
+	int lo = 0, hi = nsamples, mid, fd;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (samples[mid].pid == pid)
+			return (&samples[mid]);
+		if (samples[mid].pid < pid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return (NULL);
+	if (nsamples == maxsamples) {
+		maxsamples = maxsamples == 0 ? 64 : maxsamples * 2;
+		if ((samples = realloc(samples, maxsamples *
+		    sizeof(*samples))) == NULL)
+			unix_error("realloc error in getsample");
+	}
+	sample = &samples[lo];
+	memmove(sample + 1, sample, (nsamples - lo) * sizeof(*sample));
+	nsamples++;
+	memset(sample, 0, sizeof(*sample));
+	sample->pid = pid;
+	sample->statfd = fd;
+	snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+	sample->iofd = open(path, O_RDONLY | O_CLOEXEC);
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)pid,
+	    (int)pid);
+	sample->kidsfd = open(path, O_RDONLY | O_CLOEXEC);
+	sample->when = -1;
+	return (sample);
+}
+
+/*
+ * Requires:
+ *   "sample" was returned by getsample(), and "now" is the CLOCK_BOOTTIME
+ *   time in seconds.
+ *
+ * Effects:
+ *   Rereads the process's stat and io files and stores in "*usage" its
+ *   usage since its last sample, or, the first time, since it started.
+ *   If the last sample is too recent to measure against, as when the
+ *   table is redrawn at once, the usage measured then is reused.
+ *   Returns its process group ID, or -1 if it has exited (or been
+ *   replaced by another process with the same PID) or is a zombie.
+ */
+static pid_t
+readsample(struct Sample *sample, double now, struct Usage *usage)
+{
+	static long hz, pagesize;
+	unsigned long long utime, stime, start, rbytes = 0, wbytes = 0;
+	long long rss;
+	char buf[512], state, *p;
+	ssize_t n;
+	double dt;
+	int ppid, pgrp;
+
+	if (hz == 0) {
+		hz = sysconf(_SC_CLK_TCK);
+		pagesize = sysconf(_SC_PAGESIZE);
+	}
+	if ((n = pread(sample->statfd, buf, sizeof(buf) - 1, 0)) <= 0)
+		return (-1);
+	buf[n] = '\0';
+	// The command name may contain spaces, so skip past its ')'.
+	if ((p = strrchr(buf, ')')) == NULL || sscanf(p + 1,
+	    " %c %d %d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu "
+	    "%*d %*d %*d %*d %*d %*d %llu %*u %lld", &state, &ppid, &pgrp,
+	    &utime, &stime, &start, &rss) != 7 || state == 'Z')
+		return (-1);
+	if (sample->iofd != -1 &&
+	    (n = pread(sample->iofd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[n] = '\0';
+		sscanf(buf, "rchar: %llu wchar: %llu", &rbytes, &wbytes);
+	}
+
+	if (sample->when < 0)
+		sample->when = (double)start / hz;
+	if ((dt = now - sample->when) < 0.1 && sample->ticks != 0) {
+		*usage = sample->last;
+		usage->rss = (double)rss * pagesize;
+		return (pgrp);
+	}
+	memset(usage, 0, sizeof(*usage));
+	if (dt > 0) {
+		usage->cpu = (double)(utime + stime - sample->ticks) / hz / dt;
+		usage->rrate = (rbytes - sample->rbytes) / dt;
+		usage->wrate = (wbytes - sample->wbytes) / dt;
+	}
+	usage->rss = (double)rss * pagesize;
+	usage->nprocs = 1;
+	sample->last = *usage;
+	sample->ticks = utime + stime;
+	sample->rbytes = rbytes;
+	sample->wbytes = wbytes;
+	sample->when = now;
+	return (pgrp);
+}
+
+/*
+ * Requires:
+ *   "now" is the CLOCK_BOOTTIME time in seconds.
+ *
+ * Effects:
+ *   Adds to "*usage" the usage of the process "pid", if it is in the
+ *   process group "pgid", and of its descendants in that group, found
+ *   through the children files of their main threads.
+ */
+static void
+sampletree(pid_t pid, pid_t pgid, double now, struct Usage *usage)
+{
+	struct Sample *sample;
+	struct Usage one;
+	struct Buf kids = { NULL, 0, 0 };
+	char buf[READCHUNK], *p, *end;
+	ssize_t n;
+	pid_t pgrp;
+	int fd;
+
+	if ((sample = getsample(pid)) == NULL)
+		return;
+	if ((pgrp = readsample(sample, now, &one)) == -1 &&
+	    sample->when >= 0) {
+		// The PID may have been reused, so look at it afresh.
+		dropsample(sample);
+		if ((sample = getsample(pid)) == NULL)
+			return;
+		pgrp = readsample(sample, now, &one);
+	}
+	sample->seen = true;
+	if (pgrp != pgid)
+		return;
+	usage->cpu += one.cpu;
+	usage->rss += one.rss;
+	usage->rrate += one.rrate;
+	usage->wrate += one.wrate;
+	usage->nprocs++;
+
+	if ((fd = sample->kidsfd) == -1)
+		return;
+	while ((n = pread(fd, buf, sizeof(buf), kids.len)) > 0)
+		bufputn(&kids, buf, n);
+	for (p = kids.s; p != NULL && *p != '\0'; p = end) {
+		pid = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		sampletree(pid, pgid, now, usage);
+	}
+	free(kids.s);
+}
+
+/*
+ * Requires:
+ *   "sample" was returned by getsample().
+ *
+ * Effects:
+ *   Closes the process's files and forgets it.
+ */
+static void
+dropsample(struct Sample *sample)
+{
+
+	close(sample->statfd);
+	if (sample->iofd != -1)
+		close(sample->iofd);
+	if (sample->kidsfd != -1)
+		close(sample->kidsfd);
+	nsamples--;
+	memmove(sample, sample + 1, (&samples[nsamples] - sample) *
+	    sizeof(*sample));
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Forgets the processes that the last refresh did not find.
+ */
+static void
+prunesamples(void)
+{
+	int i;
+
+	for (i = nsamples - 1; i >= 0; i--) {
+		if (samples[i].seen)
+			samples[i].seen = false;
+		else
+			dropsample(&samples[i]);
+	}
+}
+
+/*
+ * Requires:
+ *   "jobs" points to an array of MAXJOBS job structures, and "mark", if
+ *   not NULL, to an array of MAXJOBS flags.
+ *
+ * Effects:
+ *   Prints a table of each job's (or, if "mark" is not NULL, each marked
+ *   job's) CPU use, resident memory, and rates of
+ *   reading and writing (through system calls, so including pipes and the
+ *   page cache), summed over the processes of its process group.  Rates
+ *   are over the time since the last refresh, or since each process
+ *   started.  Memory shared between processes is counted once for each.
+ *   A job whose leader has exited has its group found by readprocs().
+ */
+static void
+listusage(JobP jobs, const bool *mark)
+{
+	struct Proc *procs = NULL;
+	struct Usage usage;
+	struct timespec ts;
+	char id[32], rss[16], rrate[16], wrate[16];
+	double now;
+	int i, j, nprocs = 0;
+
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	now = ts.tv_sec + ts.tv_nsec / 1e9;
+	printf("%-16s %-10s %6s %7s %8s %8s %5s  %s\n", "JOB", "STATE", "CPU%",
+	    "RSS", "READ/s", "WRITE/s", "PROCS", "COMMAND");
+	for (i = 0; i < MAXJOBS; i++) {
+		if (jobs[i].pid == 0 || (mark != NULL && !mark[i]))
+			continue;
+		memset(&usage, 0, sizeof(usage));
+		if (jobs[i].orphaned) {
+			if (procs == NULL)
+				nprocs = readprocs(&procs);
+			for (j = 0; j < nprocs; j++)
+				if (procs[j].pgrp == jobs[i].pid)
+					sampletree(procs[j].pid, jobs[i].pid,
+					    now, &usage);
+		} else
+			sampletree(jobs[i].pid, jobs[i].pid, now, &usage);
+		snprintf(id, sizeof(id), "[%d] (%d)", jobs[i].jid,
+		    (int)jobs[i].pid);
+		printf("%-16s %-10s %6.1f %7s %8s %8s %5d  %s", id,
+		    jobs[i].hold != 0 ? "Waiting" : jobs[i].state == ST ?
+		    "Stopped" : jobs[i].state == FG ? "Foreground" : "Running",
+		    usage.cpu * 100, fmtsize(usage.rss, rss, sizeof(rss)),
+		    fmtsize(usage.rrate, rrate, sizeof(rrate)),
+		    fmtsize(usage.wrate, wrate, sizeof(wrate)), usage.nprocs,
+		    jobs[i].cmdline);
+	}
+	free(procs);
+}
+
+/*
+ * Requires:
+ *   "buf" has room for "size" characters.
+ *
+ * Effects:
+ *   Formats the byte count "n" in "buf" with a K, M, or G suffix as
+ *   needed, and returns "buf".
+ */
+static const char *
+fmtsize(double n, char *buf, size_t size)
+{
+	const char *suffix = "KMG";
+	int i = -1;
+
+	while (n >= 1024 && i < 2) {
+		n /= 1024;
+		i++;
+	}
+	if (i < 0)
+		snprintf(buf, size, "%.0f", n);
+	else
+		snprintf(buf, size, "%.1f%c", n, suffix[i]);
+	return (buf);
+}
+
+/*
+ * This comment marks the end of the /proc helper routines.
+ */
+
+/*
+ * The following helper routines implement the job server, which runs
+ * commands submitted over a Unix domain socket as background jobs.
+ *
+ * Every message is a frame: a 4-byte payload length and then a 1-byte type,
+ * both in network byte order, followed by the payload.  A client sends:
+ *   'R'  run the command line in the payload.  Up to three file descriptors
+ *        sent with the frame (SCM_RIGHTS) become the job's stdin, stdout,
+ *        and stderr; otherwise the job has no stdin and shares the shell's
+ *        output.
+ *   'K'  send the signal in the payload's second 4-byte word to the job
+ *        whose ID is in its first.
+ * Each client's jobs are numbered 1, 2, ... in the order submitted, and the
+ * server replies with frames whose payload is a 4-byte job ID and a 4-byte
+ * value, plus a message for 'E':
+ *   'S'  the job started with the PID in the value.
+ *   'X'  the job finished with the exit status in the value (-1 if unknown).
+ *   'E'  the frame for the job was rejected.
+ * Jobs wait in a queue while the jobs list is full.
+ */
+
+/*
+ * Requires:
+ *   "path" is a properly terminated string.
+ *
+ * Effects:
+ *   Starts the job server listening on a socket at "path", replacing a
+ *   stale socket there, but not any other file or a socket that a server
+ *   still accepts connections on.  The socket is accessible only to its
+ *   owner, and acceptclient() also turns away other users.
+ */
+static void
+listenjobs(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask;
+	int fd, probe;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		app_error("socket path too long");
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0)) == -1)
+		unix_error("socket error");
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			app_error("job server path exists and is not a socket");
+		if ((probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC,
+		    0)) == -1)
+			unix_error("socket error");
+		if (connect(probe, (struct sockaddr *)&addr,
+		    sizeof(addr)) == 0)
+			app_error("another job server is using the socket");
+		close(probe);
+		if (unlink(path) == -1)
+			unix_error("unlink error");
+	}
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		unix_error("bind error");
+	umask(mask);
+	if (listen(fd, SOMAXCONN) == -1)
+		unix_error("listen error");
+	addwatch(fd, POLLIN, acceptclient, NULL);
+
+	// sigchld_handler() wakes the event loop to report finished jobs.
+	if (pipe2(chldpipe, O_NONBLOCK | O_CLOEXEC) == -1)
+		unix_error("pipe error");
+	addwatch(chldpipe[0], POLLIN, reapsubs, NULL);
+}
+
+/*
+ * Requires:
+ *   "fd" is the listening socket.
+ *
+ * Effects:
+ *   Accepts every pending connection, but closes at once one from a
+ *   process of another user, since a client runs commands as the shell's
+ *   owner.
+ */
+static void
+acceptclient(int fd, void *arg)
+{
+	struct Client *client;
+	struct ucred cred;
+	socklen_t len;
+	int cfd;
+
+	(void)arg;
+	while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK |
+	    SOCK_CLOEXEC)) != -1) {
+		len = sizeof(cred);
+		if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred,
+		    &len) == -1 || cred.uid != geteuid()) {
+			close(cfd);
+			continue;
+		}
+		if ((client = calloc(1, sizeof(*client))) == NULL)
+			unix_error("calloc error in acceptclient");
+		client->fd = cfd;
+		client->nfds = 0;
+		client->next = clients;
+		clients = client;
+		addwatch(cfd, POLLIN, serveclient, client);
+	}
+}
+
+/*
+ * Requires:
+ *   "arg" is the Client connected by "fd".
+ *
+ * Effects:
+ *   Sends what it can of the client's pending replies, then receives and
+ *   handles the client's frames.  Each read stops at the end of a frame,
+ *   because file descriptors arrive with the first read that reaches the
+ *   data they were sent with, and a frame's data must not be read together
+ *   with the next one's.  Closes the connection at end of file or on an
+ *   error.
+ */
+static void
+serveclient(int fd, void *arg)
+{
+	struct Client *client = arg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	uint32_t len;
+	size_t want;
+	ssize_t n;
+	int i, nfds, *fds;
+
+	if (!flushclient(client))
+		return;
+	for (;;) {
+		want = 5 - client->in.len;
+		if (client->in.len >= 5) {
+			memcpy(&len, client->in.s, 4);
+			len = ntohl(len);
+			if (len > MAXFRAME) {
+				closeclient(client);
+				return;
+			}
+			want = 5 + len - client->in.len;
+		}
+		if (want == 0) {
+			clientframe(client, client->in.s[4], client->in.s + 5,
+			    len);
+			client->in.len = 0;
+			continue;
+		}
+
+		if (client->in.len + want + 1 > client->in.max) {
+			client->in.max = client->in.len + want + 1;
+			if ((client->in.s = realloc(client->in.s,
+			    client->in.max)) == NULL)
+				unix_error("realloc error in serveclient");
+		}
+		iov.iov_base = client->in.s + client->in.len;
+		iov.iov_len = want;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+		}
+		if (n <= 0) {
+			closeclient(client);
+			return;
+		}
+		client->in.len += n;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET ||
+			    cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			fds = (int *)CMSG_DATA(cmsg);
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (i = 0; i < nfds; i++) {
+				if (client->nfds < 3)
+					client->fds[client->nfds++] = fds[i];
+				else
+					close(fds[i]);
+			}
+		}
+	}
+	flushclient(client);
+}
+
+/*
+ * Requires:
+ *   "client" sent a frame of "type" with the "len" bytes at "payload".
+ *
+ * Effects:
+ *   Handles the frame.  A run request is parsed now, so its words are
+ *   expanded with the shell's variables as they are when it arrives, and is
+ *   queued to start as soon as the jobs list has room.
+ */
+static void
+clientframe(struct Client *client, char type, const char *payload,
+    uint32_t len)
+{
+	struct Sub *sub, **subp;
+	uint32_t id, sig;
+	bool heredoc;
+	char *cmdline;
+	int i;
+
+	if (type == 'K' && len == 8) {
+		memcpy(&id, payload, 4);
+		memcpy(&sig, payload + 4, 4);
+		id = ntohl(id);
+		sig = ntohl(sig);
+		for (sub = running; sub != NULL; sub = sub->next)
+			if (sub->client == client && sub->id == id)
+				break;
+		if (sub != NULL) {
+			if (kill(-sub->pid, sig) == -1)
+				sendframe(client, 'E', id, 0, strerror(errno));
+			return;
+		}
+		for (subp = &queue; (sub = *subp) != NULL; subp = &sub->next)
+			if (sub->client == client && sub->id == id)
+				break;
+		if (sub == NULL) {
+			sendframe(client, 'E', id, 0, "No such job");
+			return;
+		}
+		// A job killed before it starts never runs.
+		*subp = sub->next;
+		if (queuetail == &sub->next)
+			queuetail = subp;
+		sendframe(client, 'X', id, 128 + sig, NULL);
+		freesub(sub);
+		return;
+	}
+
+	id = ++client->nextid;
+	if (type != 'R') {
+		sendframe(client, 'E', id, 0, "Bad frame");
+		return;
+	}
+	if ((sub = calloc(1, sizeof(*sub))) == NULL ||
+	    (cmdline = malloc(len + 2)) == NULL)
+		unix_error("malloc error in clientframe");
+	memcpy(cmdline, payload, len);
+	cmdline[len] = '\n';
+	cmdline[len + 1] = '\0';
+	sub->client = client;
+	sub->id = id;
+	sub->cmdline = cmdline;
+
+	// Only a simple command can be run, since it has no input to read.
+	if (memchr(payload, '\0', len) != NULL ||
+	    cmdend(cmdline, &heredoc) < cmdline + len || heredoc ||
+	    parseline(cmdline, &sub->cmd) == -1 || sub->cmd.argc == 0) {
+		sendframe(client, 'E', id, 0, "Bad command");
+		if (sub->cmd.argv != NULL)
+			freecmd(&sub->cmd);
+		free(cmdline);
+		free(sub);
+		for (i = 0; i < client->nfds; i++)
+			close(client->fds[i]);
+		client->nfds = 0;
+		return;
+	}
+	sub->cmd.bg = false;	// Not captured.
+	if (client->nfds > 0 && sub->cmd.infd == -1) {
+		sub->cmd.infd = client->fds[0];
+		client->fds[0] = -1;
+	}
+	if (client->nfds > 1)
+		sub->cmd.outfd = client->fds[1];
+	if (client->nfds > 2)
+		sub->cmd.errfd = client->fds[2];
+	if (client->nfds > 0 && client->fds[0] != -1)
+		close(client->fds[0]);
+	client->nfds = 0;
+	if (sub->cmd.infd == -1 &&
+	    (sub->cmd.infd = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1)
+		unix_error("open error in clientframe");
+
+	*queuetail = sub;
+	queuetail = &sub->next;
+	startsubs();
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Replies to the clients of the submitted jobs that have finished, then
+ *   starts queued jobs, in the order submitted, while the jobs list has
+ *   room for them.  Since every finished job is reported before more are
+ *   started, no more than MAXJOBS completions can be recorded in donejobs
+ *   before they are reported.
+ */
+static void
+startsubs(void)
+{
+	volatile struct Done *done;
+	struct Sub *sub, **subp;
+	sigset_t mask, prev;
+	pid_t pid;
+	int i, jid, status, nfree = 0;
+
+	if (sigemptyset(&mask) == -1)
+		unix_error("sigemptyset error in startsubs");
+	if (sigaddset(&mask, SIGCHLD) == -1)
+		unix_error("sigaddset error in startsubs");
+	if (sigprocmask(SIG_BLOCK, &mask, &prev) == -1)
+		unix_error("sigprocmask error in startsubs");
+	for (subp = &running; (sub = *subp) != NULL; ) {
+		if (getjobpid(jobs, sub->pid) != NULL) {
+			subp = &sub->next;
+			continue;
+		}
+		status = -1;
+		if ((done = getdone(sub->pid, 0)) != NULL) {
+			done->waited = true;
+			status = exitstatus(done->status);
+		}
+		sendframe(sub->client, 'X', sub->id, status, NULL);
+		*subp = sub->next;
+		freesub(sub);
+	}
+	if (sigprocmask(SIG_SETMASK, &prev, NULL) == -1)
+		unix_error("sigprocmask error in startsubs");
+
+	for (i = 0; i < MAXJOBS; i++)
+		if (jobs[i].state == UNDEF)
+			nfree++;
+	while ((sub = queue) != NULL && nfree > 0) {
+		if ((queue = sub->next) == NULL)
+			queuetail = &queue;
+		pid = launch(&sub->cmd, sub->cmdline, BG, &jid);
+		freecmd(&sub->cmd);
+		if (pid == 0) {
+			sendframe(sub->client, 'E', sub->id, 0, "Cannot start");
+			freesub(sub);
+			continue;
+		}
+		nfree--;
+		sub->pid = pid;
+		sub->next = running;
+		running = sub;
+		sendframe(sub->client, 'S', sub->id, pid, NULL);
+	}
+}
+
+/*
+ * Requires:
+ *   "fd" is the read end of chldpipe.
+ *
+ * Effects:
+ *   Once jobs have changed state, reports the submitted jobs that have
+ *   finished, starts queued jobs in their place, and sends the replies.
+ */
+static void
+reapsubs(int fd, void *arg)
+{
+	struct Client *client, *next;
+	char buf[64];
+
+	(void)arg;
+	while (read(fd, buf, sizeof(buf)) > 0)
+		continue;
+	startsubs();
+	for (client = clients; client != NULL; client = next) {
+		next = client->next;
+		flushclient(client);
+	}
+}
+
+/*
+ * Requires:
+ *   "client" is a connected client, or NULL.
+ *
+ * Effects:
+ *   Queues a reply frame of "type" for job "id" with "value" and, for 'E',
+ *   the message "text".  Replies to a client that has gone are dropped.
+ */
+static void
+sendframe(struct Client *client, char type, uint32_t id, int32_t value,
+    const char *text)
+{
+	uint32_t word;
+	size_t len = text != NULL ? strlen(text) : 0;
+
+	if (client == NULL)
+		return;
+	word = htonl(8 + len);
+	bufputn(&client->out, (char *)&word, 4);
+	bufputc(&client->out, type);
+	word = htonl(id);
+	bufputn(&client->out, (char *)&word, 4);
+	word = htonl((uint32_t)value);
+	bufputn(&client->out, (char *)&word, 4);
+	bufputn(&client->out, text != NULL ? text : "", len);
+}
+
+/*
+ * Requires:
+ *   "client" is a connected client.
+ *
+ * Effects:
+ *   Sends as much of the client's queued replies as the socket accepts,
+ *   and watches for the socket to accept more if any are left.  Returns
+ *   true, or false if the connection failed and was closed.
+ */
+static bool
+flushclient(struct Client *client)
+{
+	ssize_t n;
+	short events;
+
+	while (client->outpos < client->out.len) {
+		n = send(client->fd, client->out.s + client->outpos,
+		    client->out.len - client->outpos, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			closeclient(client);
+			return (false);
+		}
+		client->outpos += n;
+	}
+	if (client->outpos == client->out.len)
+		client->outpos = client->out.len = 0;
+	events = client->out.len > 0 ? POLLIN | POLLOUT : POLLIN;
+	if (events != client->events) {
+		delwatch(client->fd);
+		addwatch(client->fd, events, serveclient, client);
+		client->events = events;
+	}
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "client" is a connected client.
+ *
+ * Effects:
+ *   Closes the connection and frees the client.  Its queued jobs are
+ *   dropped, and its running jobs run on unreported.
+ */
+static void
+closeclient(struct Client *client)
+{
+	struct Client **clientp;
+	struct Sub *sub, **subp;
+	int i;
+
+	delwatch(client->fd);
+	close(client->fd);
+	for (i = 0; i < client->nfds; i++)
+		if (client->fds[i] != -1)
+			close(client->fds[i]);
+	for (sub = running; sub != NULL; sub = sub->next)
+		if (sub->client == client)
+			sub->client = NULL;
+	for (subp = &queue; (sub = *subp) != NULL; ) {
+		if (sub->client == client) {
+			*subp = sub->next;
+			freesub(sub);
+		} else
+			subp = &sub->next;
+	}
+	for (queuetail = &queue; *queuetail != NULL;
+	    queuetail = &(*queuetail)->next)
+		continue;
+	for (clientp = &clients; *clientp != client;
+	    clientp = &(*clientp)->next)
+		continue;
+	*clientp = client->next;
+	free(client->in.s);
+	free(client->out.s);
+	free(client);
+}
+
+/*
+ * Requires:
+ *   "sub" is not in the queue or running lists.
+ *
+ * Effects:
+ *   Frees the submission, closing any file descriptors it still holds.
+ */
+static void
+freesub(struct Sub *sub)
+{
+
+	if (sub->cmd.argv != NULL)
+		freecmd(&sub->cmd);
+	free(sub->cmdline);
+	free(sub);
+}
+
+/*
+ * Requires:
+ *   The job server is listening.
+ *
+ * Effects:
+ *   Serves the job socket, and the jobs it starts, until the shell is
+ *   killed.
+ */
+static void
+runserver(void)
+{
+	sigset_t mask, prev;
+
+	if (sigemptyset(&mask) == -1)
+		unix_error("sigemptyset error in runserver");
+	if (sigaddset(&mask, SIGCHLD) == -1)
+		unix_error("sigaddset error in runserver");
+	if (sigprocmask(SIG_BLOCK, &mask, &prev) == -1)
+		unix_error("sigprocmask error in runserver");
+	for (;;)
+		eventloop(&prev, -1);
+}
+
+/*
+ * This comment marks the end of the job server helper routines.
+ */
+
+/*
+ * The following helper routines hold background jobs back before exec:
+ * until the jobserver, a pool of job tokens shared with GNU make, has a
+ * token free, so that background jobs and the makes that they run are
+ * together limited to TSH_JOBS jobs; and while Linux reports pressure
+ * stalls above the TSH_PSI_* thresholds.
+ */
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Brings the jobserver up to date with the shell variable TSH_JOBS,
+ *   creating its token pipe the first time that TSH_JOBS is set to a
+ *   positive number and exporting MAKEFLAGS so that make uses it.  The
+ *   pipe is reopened through /proc for the shell, so that the shell's end
+ *   can be nonblocking while the commands' ends are not.  When TSH_JOBS
+ *   grows, tokens are added; when it shrinks, tokens are removed as they
+ *   come back.  Returns true if background jobs are to take tokens, or
+ *   otherwise releases any jobs still waiting for one and returns false.
+ */
+static bool
+jobserver(void)
+{
+	static char *makeflags;     // MAKEFLAGS before the jobserver's
+	const char *value = getvar("TSH_JOBS");
+	struct Buf buf = { NULL, 0, 0 };
+	char path[64];
+	int i, n = value != NULL ? atoi(value) : 0;
+
+	if (n <= 0) {
+		for (i = 0; i < MAXJOBS; i++)
+			if (jobs[i].hold == HOLDTOKEN)
+				releasejob(&jobs[i]);
+		return (false);
+	}
+	if (n == poolsize)
+		return (true);
+	if (poolfd == -1) {
+		if (pipe(poolfds) == -1)
+			unix_error("pipe error in jobserver");
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", poolfds[0]);
+		if ((poolfd = open(path, O_RDONLY | O_NONBLOCK |
+		    O_CLOEXEC)) == -1)
+			unix_error("open error in jobserver");
+		value = getvar("MAKEFLAGS");
+		makeflags = strdup(value != NULL ? value : "");
+	}
+	for (; n > poolsize && poolexcess > 0; poolsize++)
+		poolexcess--;
+	for (; n > poolsize; poolsize++)
+		write(poolfds[1], "+", 1);
+	poolexcess += poolsize - n;
+	poolsize = n;
+	watchheld();
+
+	bufputn(&buf, "MAKEFLAGS=", 10);
+	bufputn(&buf, makeflags, strlen(makeflags));
+	snprintf(path, sizeof(path), " -j%d --jobserver-auth=%d,%d", n,
+	    poolfds[0], poolfds[1]);
+	bufputn(&buf, path, strlen(path));
+	setvar(buf.s, true);
+	free(buf.s);
+	return (true);
+}
+
+/*
+ * Requires:
+ *   The jobserver is on.
+ *
+ * Effects:
+ *   Takes a token from the pool, if one is free, without waiting.
+ *   Returns true if it took one.
+ */
+static bool
+taketoken(void)
+{
+	char c;
+
+	return (read(poolfd, &c, 1) == 1);
+}
+
+/*
+ * Requires:
+ *   "fd" is poolfd, and SIGCHLD is blocked.
+ *
+ * Effects:
+ *   The event loop handler for the token pipe.  Removes the tokens that a
+ *   smaller TSH_JOBS has made surplus, and then starts what held jobs it
+ *   can.
+ */
+static void
+granttokens(int fd, void *arg)
+{
+
+	(void)fd;
+	(void)arg;
+	while (poolexcess > 0 && taketoken())
+		poolexcess--;
+	startheld();
+}
+
+/*
+ * Requires:
+ *   "fd" is psitimer, and SIGCHLD is blocked.
+ *
+ * Effects:
+ *   The event loop handler for the pressure timer, which fires every
+ *   PSIPOLL seconds while jobs are held for pressure.  Starts what held
+ *   jobs it can.
+ */
+static void
+recheckpressure(int fd, void *arg)
+{
+	uint64_t ticks;
+
+	(void)arg;
+	read(fd, &ticks, sizeof(ticks));
+	startheld();
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Reads the "some" line of /proc/pressure/{cpu,memory,io}, whose avg10
+ *   is the percentage of the last ten seconds in which some task stalled
+ *   on that resource, and compares it with the threshold in TSH_PSI_CPU,
+ *   TSH_PSI_MEMORY, or TSH_PSI_IO, which is ignored if unset or 0.
+ *   Returns the hold reason for the first resource at or above its
+ *   threshold, or 0 if there is none (or the kernel lacks PSI).
+ */
+static int
+pressure(void)
+{
+	static const char *const names[] = { "CPU", "MEMORY", "IO" };
+	static const char *const files[] = {
+		"/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io"
+	};
+	const char *value;
+	char name[16], buf[256], *p;
+	ssize_t n;
+	double limit;
+	int fd, i;
+
+	for (i = 0; i < 3; i++) {
+		snprintf(name, sizeof(name), "TSH_PSI_%s", names[i]);
+		if ((value = getvar(name)) == NULL ||
+		    (limit = strtod(value, NULL)) <= 0)
+			continue;
+		if ((fd = open(files[i], O_RDONLY | O_CLOEXEC)) == -1)
+			continue;
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (n <= 0)
+			continue;
+		buf[n] = '\0';
+		if (strncmp(buf, "some ", 5) == 0 &&
+		    (p = strstr(buf, "avg10=")) != NULL &&
+		    strtod(p + 6, NULL) >= limit)
+			return (HOLDCPU + i);
+	}
+	return (0);
+}
+
+/*
+ * Requires:
+ *   SIGCHLD is blocked.
+ *
+ * Effects:
+ *   Starts the held jobs, lowest job ID first, for as long as pressure()
+ *   is low and, if the jobserver is on, tokens are free, giving each its
+ *   token.  The first job that cannot start is left holding the reason
+ *   why.
+ */
+static void
+startheld(void)
+{
+	JobP job;
+	int i, hold;
+
+	for (;;) {
+		job = NULL;
+		for (i = 0; i < MAXJOBS; i++) {
+			if (jobs[i].hold != 0 &&
+			    (job == NULL || jobs[i].jid < job->jid))
+				job = &jobs[i];
+		}
+		if (job == NULL)
+			break;
+		hold = pressure();
+		if (hold == 0 && jobserver()) {
+			if (taketoken())
+				job->token = true;
+			else
+				hold = HOLDTOKEN;
+		}
+		if (hold != 0) {
+			job->hold = hold;
+			break;
+		}
+		releasejob(job);
+	}
+	watchheld();
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Makes the event loop watch the token pipe while any job is waiting
+ *   for a token or there are surplus tokens to remove, and the pressure
+ *   timer while any job is waiting for pressure to drop, and only then.
+ */
+static void
+watchheld(void)
+{
+	struct itimerspec its = { { PSIPOLL, 0 }, { PSIPOLL, 0 } };
+	bool wantpool = poolexcess > 0, wantpsi = false;
+	int i;
+
+	for (i = 0; i < MAXJOBS; i++) {
+		if (jobs[i].hold == HOLDTOKEN)
+			wantpool = true;
+		else if (jobs[i].hold != 0)
+			wantpsi = true;
+	}
+	if (wantpool && !poolwatched)
+		addwatch(poolfd, POLLIN, granttokens, NULL);
+	else if (!wantpool && poolwatched)
+		delwatch(poolfd);
+	poolwatched = wantpool;
+
+	if (wantpsi != psiwatched) {
+		if (psitimer == -1 && (psitimer = timerfd_create(
+		    CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+			unix_error("timerfd_create error");
+		if (!wantpsi)
+			memset(&its, 0, sizeof(its));
+		if (timerfd_settime(psitimer, 0, &its, NULL) == -1)
+			unix_error("timerfd_settime error");
+		if (wantpsi)
+			addwatch(psitimer, POLLIN, recheckpressure, NULL);
+		else
+			delwatch(psitimer);
+		psiwatched = wantpsi;
+	}
+}
+
+/*
+ * Requires:
+ *   "job" points to a job structure.
+ *
+ * Effects:
+ *   Lets the job run, if it is waiting before exec, by writing a byte to
+ *   its gate.  (Closing the gate would not do, as other waiting jobs share
+ *   its write end.)
+ */
+static void
+releasejob(JobP job)
+{
+	sigset_t mask, prev;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	if (job->gatefd != -1) {
+		write(job->gatefd, "", 1);
+		close(job->gatefd);
+		job->gatefd = -1;
+		job->hold = 0;
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * This comment marks the end of the jobserver helper routines.
+ */
+
+/*
+ * The following helper routines implement the memo builtin's result store.
+ * Each result is a file named by the hash of its key, holding a header, the
+ * key itself, then the stdout and stderr.  A result's modification time is
+ * when it was last used, and the least recently used results are removed
+ * when the store outgrows TSH_MEMO_MAX bytes (MEMOMAX by default).
+ */
+
+/*
+ * Requires:
+ *   "dir" is a valid Buf.
+ *
+ * Effects:
+ *   Stores the path of the result store in "dir", creating the directory if
+ *   necessary, and returns true.  Returns false (after printing a message)
+ *   if there is no usable directory.
+ */
+static bool
+memodir(struct Buf *dir)
+{
+	const char *value;
+
+	dir->len = 0;
+	if ((value = getvar("TSH_MEMO_DIR")) != NULL && value[0] != '\0')
+		bufputn(dir, value, strlen(value));
+	else {
+		if ((value = getvar("XDG_CACHE_HOME")) != NULL &&
+		    value[0] != '\0')
+			bufputn(dir, value, strlen(value));
+		else if ((value = getvar("HOME")) != NULL) {
+			bufputn(dir, value, strlen(value));
+			bufputn(dir, "/.cache", 7);
+		} else {
+			printf("memo: set TSH_MEMO_DIR or HOME\n");
+			return (false);
+		}
+		mkdir(dir->s, 0700);
+		bufputn(dir, "/tsh-memo", 9);
+	}
+	if (mkdir(dir->s, 0700) == -1 && errno != EEXIST) {
+		printf("memo: %s: %s\n", dir->s, strerror(errno));
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "fd" is open for reading.
+ *
+ * Effects:
+ *   Returns the 64-bit FNV-1a hash of everything read from "fd".
+ */
+static uint64_t
+hashfd(int fd)
+{
+	unsigned char buf[65536];
+	uint64_t hash = 14695981039346656037u;
+	ssize_t i, n;
+
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			hash ^= buf[i];
+			hash *= 1099511628211u;
+		}
+	}
+	return (hash);
+}
+
+/*
+ * Requires:
+ *   "path" is the path of a result, and "desc" its key.
+ *
+ * Effects:
+ *   If the result exists and its key is "desc", copies its stdout and
+ *   stderr to the shell's, marks it as just used, and returns its exit
+ *   status.  Otherwise returns -1.
+ */
+static int
+replaymemo(const char *path, const struct Buf *desc)
+{
+	char head[128], *key;
+	long long outlen, errlen;
+	size_t desclen;
+	int fd, n, status, len;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return (-1);
+	status = -1;
+	if ((n = read(fd, head, sizeof(head) - 1)) <= 0)
+		goto out;
+	head[n] = '\0';
+	if (sscanf(head, "tshmemo1 %d %lld %lld %zu\n%n", &status, &outlen,
+	    &errlen, &desclen, &len) != 4 || desclen != desc->len) {
+		status = -1;
+		goto out;
+	}
+	if ((key = malloc(desclen)) == NULL)
+		unix_error("malloc error in replaymemo");
+	if (pread(fd, key, desclen, len) != (ssize_t)desclen ||
+	    memcmp(key, desc->s, desclen) != 0) {
+		free(key);
+		status = -1;
+		goto out;
+	}
+	free(key);
+	lseek(fd, len + desclen, SEEK_SET);
+	copyfd(fd, STDOUT_FILENO, outlen);
+	copyfd(fd, STDERR_FILENO, errlen);
+	futimens(fd, NULL);
+out:
+	close(fd);
+	return (status);
+}
+
+/*
+ * Requires:
+ *   "path" is the path for a result with key "desc", and "outfd" and
+ *   "errfd" hold the stdout and stderr of a command that exited with
+ *   "status".
+ *
+ * Effects:
+ *   Writes the result to the store, replacing any earlier one, and then
+ *   removes the least recently used results while the store is too large.
+ *   A result that cannot be written is silently not stored.
+ */
+static void
+storememo(const char *path, const struct Buf *desc, int status, int outfd,
+    int errfd)
+{
+	struct Buf tmp = { NULL, 0, 0 };
+	char head[128];
+	off_t outlen = lseek(outfd, 0, SEEK_END);
+	off_t errlen = lseek(errfd, 0, SEEK_END);
+	const char *value;
+	int fd, n;
+
+	bufputn(&tmp, path, strlen(path));
+	n = snprintf(head, sizeof(head), ".%d", (int)getpid());
+	bufputn(&tmp, head, n);
+	if ((fd = open(tmp.s, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0600)) == -1) {
+		free(tmp.s);
+		return;
+	}
+	n = snprintf(head, sizeof(head), "tshmemo1 %d %lld %lld %zu\n",
+	    status, (long long)outlen, (long long)errlen, desc->len);
+	lseek(outfd, 0, SEEK_SET);
+	lseek(errfd, 0, SEEK_SET);
+	if (sio_writen(fd, head, n) != n ||
+	    sio_writen(fd, desc->s, desc->len) != (ssize_t)desc->len ||
+	    copyfd(outfd, fd, outlen) != outlen ||
+	    copyfd(errfd, fd, errlen) != errlen ||
+	    close(fd) == -1 || rename(tmp.s, path) == -1)
+		unlink(tmp.s);
+	free(tmp.s);
+
+	value = getvar("TSH_MEMO_MAX");
+	trimmemo(path, value != NULL && atoll(value) > 0 ? atoll(value) :
+	    MEMOMAX);
+}
+
+/*
+ * Requires:
+ *   "path" is the path of a result in the store.
+ *
+ * Effects:
+ *   Removes the least recently used results from the store until its
+ *   results total at most "max" bytes.
+ */
+static void
+trimmemo(const char *path, long long max)
+{
+	struct Buf dir = { NULL, 0, 0 };
+	struct Memo { struct timespec mtime; off_t size; char name[17]; }
+	    *memos = NULL;
+	struct dirent *ent;
+	struct stat st;
+	long long total = 0;
+	int i, n = 0, maxmemos = 0;
+	DIR *dp;
+
+	bufputn(&dir, path, strrchr(path, '/') - path);
+	if ((dp = opendir(dir.s)) == NULL) {
+		free(dir.s);
+		return;
+	}
+	while ((ent = readdir(dp)) != NULL) {
+		if (strlen(ent->d_name) != 16 ||
+		    strspn(ent->d_name, "0123456789abcdef") != 16 ||
+		    fstatat(dirfd(dp), ent->d_name, &st, 0) == -1)
+			continue;
+		if (n == maxmemos) {
+			maxmemos = maxmemos == 0 ? 64 : maxmemos * 2;
+			if ((memos = realloc(memos, maxmemos *
+			    sizeof(*memos))) == NULL)
+				unix_error("realloc error in trimmemo");
+		}
+		memos[n].mtime = st.st_mtim;
+		memos[n].size = st.st_size;
+		strcpy(memos[n].name, ent->d_name);
+		total += st.st_size;
+		n++;
+	}
+	if (total > max) {
+		qsort(memos, n, sizeof(*memos), cmpmtime);
+		for (i = 0; i < n && total > max; i++)
+			if (unlinkat(dirfd(dp), memos[i].name, 0) == 0)
+				total -= memos[i].size;
+	}
+	closedir(dp);
+	free(memos);
+	free(dir.s);
+}
+
+/*
+ * Requires:
+ *   "a" and "b" point to structures that begin with a struct timespec.
+ *
+ * Effects:
+ *   Compares the times for qsort(), earliest first.
+ */
+static int
+cmpmtime(const void *a, const void *b)
+{
+	const struct timespec *ta = a, *tb = b;
+
+	if (ta->tv_sec != tb->tv_sec)
+		return (ta->tv_sec < tb->tv_sec ? -1 : 1);
+	if (ta->tv_nsec != tb->tv_nsec)
+		return (ta->tv_nsec < tb->tv_nsec ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Requires:
+ *   "dir" is a directory path.
+ *
+ * Effects:
+ *   Returns a new unnamed temporary file in "dir", or if the file system
+ *   cannot provide one, in memory.  Returns -1 on error.
+ */
+static int
+memotmp(const char *dir)
+{
+	int fd;
+
+	if ((fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) != -1)
+		return (fd);
+	return (memfd_create("tsh-memo", MFD_CLOEXEC));
+}
+
+/*
+ * Requires:
+ *   "from" is open for reading and "to" for writing.
+ *
+ * Effects:
+ *   Copies "len" bytes, or if "len" is -1, everything, from "from" to "to",
+ *   and returns the number of bytes copied.
+ */
+static off_t
+copyfd(int from, int to, off_t len)
+{
+	char buf[65536];
+	off_t done = 0;
+	ssize_t n;
+
+	while (len == -1 || done < len) {
+		n = read(from, buf, len == -1 || len - done > (off_t)sizeof(buf) ?
+		    (off_t)sizeof(buf) : len - done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0 || sio_writen(to, buf, n) != n)
+			break;
+		done += n;
+	}
+	return (done);
+}
+
+/*
+ * This comment marks the end of the result store helper routines.
+ */
+
+/*
+ * The following helper routines implement the command history.
+ *
+ * The history file is an append-only log with one line per command line
+ * run: its start time in seconds since the Epoch, its duration in
+ * milliseconds, and its exit status, separated by spaces, then a tab and
+ * the command line, in which each backslash and newline is escaped as a
+ * backslash followed by a backslash or an 'n'.
+ * Each entry is appended with a single write() to a file opened with
+ * O_APPEND, so that several shells can share the file without locking.
+ */
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Opens the history file for appending and for mapping, if it is not
+ *   already open.  The file is TSH_HISTFILE, or, if that is unset and
+ *   stdin is a terminal, ~/.tsh_history; history is off if TSH_HISTFILE
+ *   is "".  Returns true if the history file is open.
+ */
+static bool
+histopen(void)
+{
+	struct Buf path = { NULL, 0, 0 };
+	const char *value;
+
+	if (histfd != -1)
+		return (true);
+	if ((value = getvar("TSH_HISTFILE")) != NULL)
+		bufputn(&path, value, strlen(value));
+	else if (isatty(STDIN_FILENO) && (value = getvar("HOME")) != NULL) {
+		bufputn(&path, value, strlen(value));
+		bufputn(&path, "/.tsh_history", 13);
+	}
+	if (path.len == 0) {
+		free(path.s);
+		return (false);
+	}
+	if ((histfd = open(path.s, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+	    0600)) == -1) {
+		printf("history: %s: %s\n", path.s, strerror(errno));
+		free(path.s);
+		return (false);
+	}
+	if ((hist = calloc(1, sizeof(*hist))) == NULL)
+		unix_error("calloc error in histopen");
+	if ((hist->fd = open(path.s, O_RDONLY | O_CLOEXEC)) == -1)
+		unix_error("open error in histopen");
+	free(path.s);
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "line" is the command line just run, which started at "when" and at
+ *   CLOCK_MONOTONIC time "start".
+ *
+ * Effects:
+ *   Adds the command line to the history with last_status as its exit
+ *   status, or, if it left a background job running, defers it until
+ *   histflush() finds that the job has terminated, so that its exit status
+ *   and duration are those that sigchld_handler() recorded for the job.
+ */
+static void
+histrecord(const char *line, time_t when, double start)
+{
+	struct HistPend *pend;
+
+	if (!histopen())
+		return;
+	if (lastbg == 0) {
+		histappend(line, when, last_status, monotime() - start);
+		return;
+	}
+	if ((pend = malloc(sizeof(*pend))) == NULL ||
+	    (pend->line = strdup(line)) == NULL)
+		unix_error("malloc error in histrecord");
+	pend->pid = lastbg;
+	pend->when = when;
+	pend->next = histpend;
+	histpend = pend;
+}
+
+/*
+ * Requires:
+ *   The history file is open.
+ *
+ * Effects:
+ *   Appends an entry for the command line to the history file.
+ */
+static void
+histappend(const char *line, time_t when, int status, double elapsed)
+{
+	struct Buf buf = { NULL, 0, 0 };
+	char head[64];
+	const char *p;
+
+	snprintf(head, sizeof(head), "%lld %lld %d\t", (long long)when,
+	    (long long)(elapsed * 1000), status);
+	bufputn(&buf, head, strlen(head));
+	for (p = line; *p != '\0'; p++) {
+		if (*p == '\n' && p[1] == '\0')
+			break;
+		if (*p == '\\' || *p == '\n') {
+			bufputc(&buf, '\\');
+			bufputc(&buf, *p == '\n' ? 'n' : '\\');
+		} else
+			bufputc(&buf, *p);
+	}
+	bufputc(&buf, '\n');
+	if (sio_writen(histfd, buf.s, buf.len) != (ssize_t)buf.len)
+		printf("history: write error: %s\n", strerror(errno));
+	free(buf.s);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Adds to the history each deferred command line whose background job
+ *   has terminated, with the status and duration from its donejobs record
+ *   (or a status of -1 if that record has been overwritten).
+ */
+static void
+histflush(void)
+{
+	volatile struct Done *done;
+	struct HistPend *pend, **pendp;
+	sigset_t mask, prev;
+
+	if (histpend == NULL)
+		return;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	for (pendp = &histpend; (pend = *pendp) != NULL; ) {
+		if (getjobpid(jobs, pend->pid) != NULL) {
+			pendp = &pend->next;
+			continue;
+		}
+		if ((done = getdone(pend->pid, 0)) != NULL)
+			histappend(pend->line, pend->when,
+			    exitstatus(done->status), done->elapsed);
+		else
+			histappend(pend->line, pend->when, -1, 0);
+		*pendp = pend->next;
+		free(pend->line);
+		free(pend);
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Maps whatever has been appended to the history file, by this shell or
+ *   any other, since it was last indexed, and indexes the complete entries
+ *   in it: each is added to ents and counted against its distinct command
+ *   line in cmds.  Returns false if there is no history file.
+ */
+static bool
+histload(void)
+{
+	struct HistCmd *cmd;
+	struct stat st;
+	char *p, *q, *nl, *tab, *end;
+	long long ms;
+	int id, status;
+	void *map;
+
+	if (!histopen())
+		return (false);
+	if (fstat(hist->fd, &st) == -1)
+		unix_error("fstat error in histload");
+	if ((size_t)st.st_size <= hist->end)
+		return (true);
+	if (hist->map == NULL)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, hist->fd, 0);
+	else
+		map = mremap(hist->map, hist->maplen, st.st_size,
+		    MREMAP_MAYMOVE);
+	if (map == MAP_FAILED)
+		unix_error("mmap error in histload");
+	hist->map = map;
+	hist->maplen = st.st_size;
+
+	// Index up to the last newline; a concurrent append may be partial.
+	p = hist->map + hist->end;
+	end = hist->map + hist->maplen;
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		/*
+		 * sscanf() would take the length of the rest of the mapping
+		 * on every call, so the numbers are parsed with strtoll().
+		 */
+		strtoll(p, &q, 10);
+		ms = strtoll(q, &q, 10);
+		status = strtol(q, &q, 10);
+		if ((tab = memchr(p, '\t', nl - p)) != NULL && q == tab) {
+			if (hist->nents == hist->maxents) {
+				hist->maxents = hist->maxents == 0 ? 1024 :
+				    hist->maxents * 2;
+				if ((hist->ents = realloc(hist->ents,
+				    hist->maxents * sizeof(*hist->ents))) ==
+				    NULL)
+					unix_error("realloc error in histload");
+			}
+			hist->ents[hist->nents++] = p - hist->map;
+			id = histcmd(tab + 1, nl - tab - 1);
+			cmd = &hist->cmds[id];
+			cmd->count++;
+			if (status != 0)
+				cmd->failures++;
+			cmd->total += ms / 1000.0;
+		}
+		p = nl + 1;
+	}
+	hist->end = p - hist->map;
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "text" points to "len" characters of the mapped history file.
+ *
+ * Effects:
+ *   Returns the index in cmds of the distinct command line "text", adding
+ *   it, and indexing its trigrams, if it is new.  The hash table of cmds
+ *   is kept at most half full.
+ */
+static int
+histcmd(const char *text, size_t len)
+{
+	struct HistCmd *cmd;
+	uint32_t h = 2166136261u;
+	size_t i;
+	int id;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)text[i];
+		h *= 16777619u;
+	}
+	if (hist->tabsize > 0) {
+		for (id = hist->tab[h & (hist->tabsize - 1)]; id != -1;
+		    id = hist->cmds[id].next) {
+			cmd = &hist->cmds[id];
+			if (cmd->len == len &&
+			    memcmp(hist->map + cmd->off, text, len) == 0)
+				return (id);
+		}
+	}
+
+	if (hist->ncmds == hist->maxcmds) {
+		hist->maxcmds = hist->maxcmds == 0 ? 1024 : hist->maxcmds * 2;
+		if ((hist->cmds = realloc(hist->cmds, hist->maxcmds *
+		    sizeof(*hist->cmds))) == NULL)
+			unix_error("realloc error in histcmd");
+	}
+	if (2 * (hist->ncmds + 1) > hist->tabsize) {
+		// Rehash into a table twice the size.
+		hist->tabsize = hist->tabsize == 0 ? 2048 : hist->tabsize * 2;
+		free(hist->tab);
+		if ((hist->tab = malloc(hist->tabsize * sizeof(*hist->tab))) ==
+		    NULL)
+			unix_error("malloc error in histcmd");
+		memset(hist->tab, -1, hist->tabsize * sizeof(*hist->tab));
+		for (id = 0; id < hist->ncmds; id++) {
+			cmd = &hist->cmds[id];
+			h = 2166136261u;
+			for (i = 0; i < cmd->len; i++) {
+				h ^= (unsigned char)hist->map[cmd->off + i];
+				h *= 16777619u;
+			}
+			cmd->next = hist->tab[h & (hist->tabsize - 1)];
+			hist->tab[h & (hist->tabsize - 1)] = id;
+		}
+		h = 2166136261u;
+		for (i = 0; i < len; i++) {
+			h ^= (unsigned char)text[i];
+			h *= 16777619u;
+		}
+	}
+	id = hist->ncmds++;
+	cmd = &hist->cmds[id];
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->off = text - hist->map;
+	cmd->len = len;
+	cmd->next = hist->tab[h & (hist->tabsize - 1)];
+	hist->tab[h & (hist->tabsize - 1)] = id;
+	histgrams(id);
+	return (id);
+}
+
+/*
+ * Requires:
+ *   "id" is the index in cmds of the newest distinct command line.
+ *
+ * Effects:
+ *   Adds the command line to the posting list of each trigram bucket that
+ *   one of its trigrams hashes to, once per bucket.  A substring search
+ *   then need only check the command lines in the shortest posting list
+ *   among its own trigrams' buckets.
+ */
+static void
+histgrams(int id)
+{
+	const struct HistCmd *cmd = &hist->cmds[id];
+	const unsigned char *t = (const unsigned char *)hist->map + cmd->off;
+	size_t i;
+	int g;
+
+	for (i = 0; i + 3 <= cmd->len; i++) {
+		g = ((t[i] << 16 | t[i + 1] << 8 | t[i + 2]) * 2654435761u) >>
+		    16 & (HISTGRAMS - 1);
+		if (hist->grams[g].n > 0 &&
+		    hist->grams[g].ids[hist->grams[g].n - 1] == id)
+			continue;
+		if (hist->grams[g].n == hist->grams[g].max) {
+			hist->grams[g].max = hist->grams[g].max == 0 ? 4 :
+			    hist->grams[g].max * 2;
+			if ((hist->grams[g].ids = realloc(hist->grams[g].ids,
+			    hist->grams[g].max * sizeof(int))) == NULL)
+				unix_error("realloc error in histgrams");
+		}
+		hist->grams[g].ids[hist->grams[g].n++] = id;
+	}
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Brings "sorted", the distinct command lines in order of their text, up
+ *   to date by sorting those added since it was last used and merging
+ *   them in, so that a prefix search is a binary search.
+ */
+static void
+histsort(void)
+{
+	int *merged, i, j, k, n = hist->ncmds - hist->nsorted;
+
+	if (n == 0)
+		return;
+	if ((merged = malloc(hist->ncmds * sizeof(int))) == NULL ||
+	    (hist->sorted = realloc(hist->sorted, hist->ncmds *
+	    sizeof(int))) == NULL)
+		unix_error("malloc error in histsort");
+	for (i = 0; i < n; i++)
+		hist->sorted[hist->nsorted + i] = hist->nsorted + i;
+	qsort(hist->sorted + hist->nsorted, n, sizeof(int), cmphist);
+	for (i = k = 0, j = hist->nsorted; i < hist->nsorted ||
+	    j < hist->ncmds; ) {
+		if (j == hist->ncmds || (i < hist->nsorted &&
+		    cmphist(&hist->sorted[i], &hist->sorted[j]) <= 0))
+			merged[k++] = hist->sorted[i++];
+		else
+			merged[k++] = hist->sorted[j++];
+	}
+	free(hist->sorted);
+	hist->sorted = merged;
+	hist->nsorted = hist->ncmds;
+}
+
+/*
+ * Requires:
+ *   "a" and "b" point to indices in cmds.
+ *
+ * Effects:
+ *   Compares the texts of the two command lines, for qsort().
+ */
+static int
+cmphist(const void *a, const void *b)
+{
+	const struct HistCmd *x = &hist->cmds[*(const int *)a];
+	const struct HistCmd *y = &hist->cmds[*(const int *)b];
+	int r;
+
+	r = memcmp(hist->map + x->off, hist->map + y->off,
+	    x->len < y->len ? x->len : y->len);
+	if (r != 0)
+		return (r);
+	return (x->len < y->len ? -1 : x->len > y->len);
+}
+
+/*
+ * Requires:
+ *   "a" and "b" point to indices in cmds.
+ *
+ * Effects:
+ *   Orders the two command lines by the number of times run, most first,
+ *   for qsort().
+ */
+static int
+cmpcount(const void *a, const void *b)
+{
+	const struct HistCmd *x = &hist->cmds[*(const int *)a];
+	const struct HistCmd *y = &hist->cmds[*(const int *)b];
+
+	return (x->count > y->count ? -1 : x->count < y->count);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the CLOCK_MONOTONIC time in seconds.  This function can be
+ *   safely called by a signal handler.
+ */
+static double
+monotime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * This comment marks the end of the command history helper routines.
+ */
+
+/*
+ * The following helper routines run scheduled commands from a timer wheel.
+ */
+
+/*
+ * Requires:
+ *   "spec" is a properly terminated string.
+ *
+ * Effects:
+ *   Parses "spec" as a duration, a number with the unit ms, s (the
+ *   default), m, h, or d, or, if "clock" is true, as "+duration" or as a
+ *   time of day "hh:mm[:ss]", which is the next time that the clock reads
+ *   it.  Stores the seconds from now in "*secsp" and returns true, or
+ *   returns false if "spec" is not valid.
+ */
+static bool
+parsewhen(const char *spec, bool clock, double *secsp)
+{
+	struct tm tm;
+	time_t now, then;
+	char *end;
+	int hour, min, sec = 0, n = 0;
+
+	if (clock && spec[0] != '+') {
+		if (sscanf(spec, "%d:%d%n:%d%n", &hour, &min, &n, &sec,
+		    &n) < 2 || spec[n] != '\0' || hour < 0 || hour > 23 ||
+		    min < 0 || min > 59 || sec < 0 || sec > 59)
+			return (false);
+		now = time(NULL);
+		localtime_r(&now, &tm);
+		tm.tm_hour = hour;
+		tm.tm_min = min;
+		tm.tm_sec = sec;
+		tm.tm_isdst = -1;
+		if ((then = mktime(&tm)) <= now) {
+			tm.tm_mday++;
+			tm.tm_isdst = -1;
+			then = mktime(&tm);
+		}
+		*secsp = difftime(then, now);
+		return (true);
+	}
+	if (clock)
+		spec++;
+	*secsp = strtod(spec, &end);
+	if (end == spec || !(*secsp >= 0 && *secsp < 1e9))
+		return (false);
+	if (strcmp(end, "ms") == 0)
+		*secsp /= 1000;
+	else if (strcmp(end, "m") == 0)
+		*secsp *= 60;
+	else if (strcmp(end, "h") == 0)
+		*secsp *= 60 * 60;
+	else if (strcmp(end, "d") == 0)
+		*secsp *= 24 * 60 * 60;
+	else if (*end != '\0' && strcmp(end, "s") != 0)
+		return (false);
+	return (true);
+}
+
+/*
+ * Requires:
+ *   The timer wheel has been started by do_schedule().
+ *
+ * Effects:
+ *   Returns the tick of the timer wheel that it is now.  Since timerfd
+ *   expires no earlier than the time it was set to, the tick is rounded up
+ *   by a little so that it is never the one before the timer's.
+ */
+static long long
+nowtick(void)
+{
+
+	return ((long long)((monotime() - wheelbase) * 1000 / WHEELTICK +
+	    1e-6));
+}
+
+/*
+ * Requires:
+ *   "timer" is not on the timer wheel, and its due tick is set.
+ *
+ * Effects:
+ *   Puts "timer" on the timer wheel, in the slot of its due tick.
+ */
+static void
+addtimer(struct Timer *timer)
+{
+	struct Timer **slot = &wheel[timer->due % WHEELSLOTS];
+
+	timer->next = *slot;
+	*slot = timer;
+	ntimers++;
+}
+
+/*
+ * Requires:
+ *   The timer wheel has been started by do_schedule().
+ *
+ * Effects:
+ *   Sets wheelfd to expire at the next tick with a timer due, looking at
+ *   most one revolution of the wheel ahead.  If no timer is due within
+ *   that revolution, wheelfd expires at its end, so that the slots are
+ *   looked at again.  If the wheel is empty, disarms wheelfd.
+ */
+static void
+armwheel(void)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	struct Timer *timer;
+	long long tick, next = wheeltick + WHEELSLOTS;
+	double when;
+
+	if (ntimers > 0) {
+		for (tick = wheeltick + 1; tick < next; tick++) {
+			for (timer = wheel[tick % WHEELSLOTS]; timer != NULL &&
+			    timer->due > tick; timer = timer->next)
+				;
+			if (timer != NULL)
+				break;
+		}
+		when = wheelbase + tick * (WHEELTICK / 1000.0);
+		its.it_value.tv_sec = (time_t)when;
+		its.it_value.tv_nsec = (long)((when - (time_t)when) * 1e9);
+	}
+	if (timerfd_settime(wheelfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+		unix_error("timerfd_settime error in armwheel");
+}
+
+/*
+ * Requires:
+ *   "fd" is wheelfd, and SIGCHLD is blocked.
+ *
+ * Effects:
+ *   Takes the timers that are due off the slots of the ticks since the
+ *   last call, visiting each slot at most once, and runs them.  A
+ *   recurring timer is then put back for its next run.  Runs that were
+ *   missed while the shell was busy are not made up, but the timer keeps
+ *   its phase.  Finally, sets wheelfd for the next due tick.
+ */
+static void
+firetimers(int fd, void *arg)
+{
+	struct Timer *timer, **timerp, *due = NULL;
+	long long tick, last, now = nowtick();
+	uint64_t expirations;
+
+	(void)arg;
+	if (read(fd, &expirations, sizeof(expirations)) == -1 &&
+	    errno != EAGAIN)
+		unix_error("read error in firetimers");
+	last = now - wheeltick > WHEELSLOTS ? wheeltick + WHEELSLOTS : now;
+	for (tick = wheeltick + 1; tick <= last; tick++) {
+		timerp = &wheel[tick % WHEELSLOTS];
+		while ((timer = *timerp) != NULL) {
+			if (timer->due <= now) {
+				*timerp = timer->next;
+				timer->next = due;
+				due = timer;
+				ntimers--;
+			} else
+				timerp = &timer->next;
+		}
+	}
+	wheeltick = now;
+
+	while ((timer = due) != NULL) {
+		due = timer->next;
+		runtimer(timer);
+		if (timer->period == 0) {
+			freetimer(timer);
+			continue;
+		}
+		timer->due += ((now - timer->due) / timer->period + 1) *
+		    timer->period;
+		addtimer(timer);
+	}
+	armwheel();
+}
+
+/*
+ * Requires:
+ *   "timer" is a scheduled command, and SIGCHLD is blocked.
+ *
+ * Effects:
+ *   Starts a run of the command as a background job, with its stdin read
+ *   from the start of its here-document or else from /dev/null, and with
+ *   its own process substitutions.  Unless
+ *   the timer allows overlapping runs, skips the run if the last one is
+ *   still in the jobs list.
+ */
+static void
+runtimer(struct Timer *timer)
+{
+	struct Cmd cmd = timer->cmd;
+	char path[32];
+	pid_t pid;
+	int jid;
+
+	if (!timer->overlap && timer->pid != 0 &&
+	    getjobpid(jobs, timer->pid) != NULL) {
+		timer->skips++;
+		return;
+	}
+	if (timer->cmd.infd != -1) {
+		// A new open file description has its own offset.
+		snprintf(path, sizeof(path), "/proc/self/fd/%d",
+		    timer->cmd.infd);
+		cmd.infd = open(path, O_RDONLY | O_CLOEXEC);
+	} else
+		cmd.infd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (cmd.infd == -1)
+		unix_error("open error in runtimer");
+	if (startprocsubs(&cmd) == -1) {
+		close(cmd.infd);
+		return;
+	}
+	pid = launch(&cmd, timer->cmdline, BG, &jid);
+	endprocsubs(&cmd, pid == 0);
+	if (pid != 0) {
+		timer->pid = pid;
+		timer->runs++;
+	}
+	close(cmd.infd);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Removes the timer with ID "id" from the timer wheel and frees it.
+ *   Returns true, or false if there is no such timer.
+ */
+static bool
+deltimer(int id)
+{
+	struct Timer *timer, **timerp;
+	int i;
+
+	for (i = 0; i < WHEELSLOTS; i++) {
+		for (timerp = &wheel[i]; (timer = *timerp) != NULL;
+		    timerp = &timer->next) {
+			if (timer->id == id) {
+				*timerp = timer->next;
+				ntimers--;
+				freetimer(timer);
+				armwheel();
+				return (true);
+			}
+		}
+	}
+	return (false);
+}
+
+/*
+ * Requires:
+ *   "timer" is not on the timer wheel.
+ *
+ * Effects:
+ *   Frees "timer", closing its files.
+ */
+static void
+freetimer(struct Timer *timer)
+{
+
+	freecmd(&timer->cmd);
+	free(timer->spec);
+	free(timer->cmdline);
+	free(timer);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Prints the scheduled commands in the order of their IDs, each with
+ *   the time of its next run and, if it recurs, the runs started and
+ *   skipped so far.
+ */
+static void
+listtimers(void)
+{
+	struct Timer *timer, **timers;
+	struct timespec ts;
+	struct tm tm;
+	time_t when;
+	double offset;
+	char next[16];
+	int i, j, n = 0;
+
+	if (ntimers == 0)
+		return;
+	if ((timers = malloc(ntimers * sizeof(*timers))) == NULL)
+		unix_error("malloc error in listtimers");
+	// The offset of the wall clock from the monotonic one.
+	clock_gettime(CLOCK_REALTIME, &ts);
+	offset = ts.tv_sec + ts.tv_nsec / 1e9 - monotime();
+	for (i = 0; i < WHEELSLOTS; i++) {
+		for (timer = wheel[i]; timer != NULL; timer = timer->next) {
+			for (j = n++; j > 0 && timers[j - 1]->id > timer->id;
+			    j--)
+				timers[j] = timers[j - 1];
+			timers[j] = timer;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		timer = timers[i];
+		when = (time_t)(offset + wheelbase + timer->due *
+		    (WHEELTICK / 1000.0));
+		localtime_r(&when, &tm);
+		strftime(next, sizeof(next), "%H:%M:%S", &tm);
+		if (timer->period != 0)
+			printf("[@%d] Every %s (next %s, %lu runs, %lu "
+			    "skipped) %s", timer->id, timer->spec, next,
+			    timer->runs, timer->skips, timer->cmdline);
+		else
+			printf("[@%d] At %s (next %s) %s", timer->id,
+			    timer->spec, next, timer->cmdline);
+	}
+	free(timers);
+}
+
+/*
+ * This comment marks the end of the timer wheel helper routines.
+ */
+
+/*
+ * The following helper routines run the completion hooks of jobs.
+ */
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the completion hooks of the jobs that have finished since the
+ *   last call, in the order that they finished: first the job's on-exit
+ *   actions, and then, if it was a background job, the CHLD trap.  The
+ *   records are read from donejobs, which sigchld_handler() writes, so no
+ *   action runs inside a signal handler.  The jobs started by an action
+ *   are hooked on the next call, not this one.  A completion overwritten
+ *   in donejobs before its hooks could run is skipped, and its job's
+ *   on-exit actions are dropped.  $? is left as it was.
+ */
+static void
+runhooks(void)
+{
+	static bool running;
+	struct Hook *hook, **hookp, *fire, **tail;
+	struct Done done;
+	sigset_t mask, prev;
+	unsigned int end;
+	char *trap;
+	int status = last_status;
+
+	if (running)
+		return;
+	running = true;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	if (hooks == NULL && chldtrap == NULL)
+		hookdone = ndone;
+	for (end = ndone; hookdone != end; ) {
+		if (end - hookdone > MAXDONE)
+			hookdone = end - MAXDONE;
+		done.pid = donejobs[hookdone % MAXDONE].pid;
+		done.jid = donejobs[hookdone % MAXDONE].jid;
+		done.status = donejobs[hookdone % MAXDONE].status;
+		done.elapsed = donejobs[hookdone % MAXDONE].elapsed;
+		done.utime = donejobs[hookdone % MAXDONE].utime;
+		done.stime = donejobs[hookdone % MAXDONE].stime;
+		done.maxrss = donejobs[hookdone % MAXDONE].maxrss;
+		done.bg = donejobs[hookdone % MAXDONE].bg;
+		hookdone++;
+
+		// Take the job's own hooks off the list.
+		fire = NULL;
+		tail = &fire;
+		for (hookp = &hooks; (hook = *hookp) != NULL; ) {
+			if (hook->pid == done.pid && hook->jid == done.jid) {
+				*hookp = hook->next;
+				hook->next = NULL;
+				*tail = hook;
+				tail = &hook->next;
+			} else
+				hookp = &hook->next;
+		}
+		if (fire == NULL && (!done.bg || chldtrap == NULL))
+			continue;
+
+		sigprocmask(SIG_SETMASK, &prev, NULL);
+		setjobvars(&done);
+		while ((hook = fire) != NULL) {
+			fire = hook->next;
+			runaction(hook->action);
+			free(hook->action);
+			free(hook);
+		}
+		// The action may replace the trap while it runs.
+		if (done.bg && chldtrap != NULL) {
+			if ((trap = strdup(chldtrap)) == NULL)
+				unix_error("strdup error in runhooks");
+			runaction(trap);
+			free(trap);
+		}
+		sigprocmask(SIG_BLOCK, &mask, NULL);
+	}
+
+	// Drop the hooks of jobs whose completions were overwritten.
+	for (hookp = &hooks; (hook = *hookp) != NULL; ) {
+		if (getjobpid(jobs, hook->pid) == NULL &&
+		    getdone(hook->pid, 0) == NULL) {
+			*hookp = hook->next;
+			free(hook->action);
+			free(hook);
+		} else
+			hookp = &hook->next;
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+	last_status = status;
+	running = false;
+}
+
+/*
+ * Requires:
+ *   "done" is the completion record of a job.
+ *
+ * Effects:
+ *   Sets the exported shell variables that describe the finished job to
+ *   its hooks: TSH_JOB_JID, TSH_JOB_PID, TSH_JOB_STATUS (as for $?),
+ *   TSH_JOB_ELAPSED, TSH_JOB_UTIME, and TSH_JOB_STIME in seconds, and
+ *   TSH_JOB_MAXRSS in KiB.
+ */
+static void
+setjobvars(const struct Done *done)
+{
+	char var[64];
+
+	snprintf(var, sizeof(var), "TSH_JOB_JID=%d", done->jid);
+	setvar(var, true);
+	snprintf(var, sizeof(var), "TSH_JOB_PID=%d", (int)done->pid);
+	setvar(var, true);
+	snprintf(var, sizeof(var), "TSH_JOB_STATUS=%d",
+	    exitstatus(done->status));
+	setvar(var, true);
+	snprintf(var, sizeof(var), "TSH_JOB_ELAPSED=%.3f", done->elapsed);
+	setvar(var, true);
+	snprintf(var, sizeof(var), "TSH_JOB_UTIME=%.3f", done->utime);
+	setvar(var, true);
+	snprintf(var, sizeof(var), "TSH_JOB_STIME=%.3f", done->stime);
+	setvar(var, true);
+	snprintf(var, sizeof(var), "TSH_JOB_MAXRSS=%ld", done->maxrss);
+	setvar(var, true);
+}
+
+/*
+ * Requires:
+ *   "action" is a properly terminated string.
+ *
+ * Effects:
+ *   Parses and runs "action" as a command line of its own.
+ */
+static void
+runaction(const char *action)
+{
+	struct Buf line = { NULL, 0, 0 };
+	struct Ast *ast;
+	int r;
+
+	bufputn(&line, action, strlen(action));
+	bufputc(&line, '\n');
+	if ((r = getast(line.s, &ast)) == 1) {
+		runlist(ast, ast->root);
+		releaseast(ast);
+	} else if (r == 0)
+		printf("Syntax error: unexpected end of hook\n");
+	free(line.s);
+}
+
+/*
+ * This comment marks the end of the completion hook helper routines.
+ */
+
+/*
+ * The following helper routines run process substitutions.
+ */
+
+/*
+ * Requires:
+ *   "cmd" is a command from parseline() whose process substitutions are
+ *   not started.
+ *
+ * Effects:
+ *   Starts a background job for each of the command's process
+ *   substitutions, with a pipe as its stdout for "<(command)" or as its
+ *   stdin for ">(command)", and replaces the substitution's word in argv by
+ *   "/dev/fd/N", where N is the shell's end of the pipe.  Only the command
+ *   itself may inherit those ends, so they are made inheritable once every
+ *   substitution's job has started.  Substitutions nest.  Returns 0, or -1
+ *   (after printing a message) if a substitution's command is invalid or
+ *   its job cannot start, in which case none are left running.  The caller
+ *   must call endprocsubs() once the command has started or finished.
+ */
+static int
+startprocsubs(struct Cmd *cmd)
+{
+	struct Procsub *ps;
+	struct Cmd sub;
+	struct Buf line = { NULL, 0, 0 };
+	char name[32];
+	int i, jid, fds[2];
+
+	for (i = 0; i < cmd->nsubs; i++) {
+		ps = &cmd->subs[i];
+		if (parseline(ps->text, &sub) == -1)
+			goto error;
+		if (sub.argc == 0) {
+			printf("Syntax error: empty process substitution\n");
+			freecmd(&sub);
+			goto error;
+		}
+		if (pipe2(fds, O_CLOEXEC) == -1)
+			unix_error("pipe error in startprocsubs");
+		if (ps->out) {
+			if (sub.infd != -1)
+				close(sub.infd);
+			sub.infd = fds[0];
+			ps->fd = fds[1];
+		} else {
+			if (sub.outfd != -1)
+				close(sub.outfd);
+			sub.outfd = fds[1];
+			ps->fd = fds[0];
+		}
+		sub.sub = true;
+		line.len = 0;
+		bufputn(&line, cmd->argv[ps->argi],
+		    strlen(cmd->argv[ps->argi]));
+		bufputc(&line, '\n');
+		if (startprocsubs(&sub) == -1) {
+			freecmd(&sub);
+			goto error;
+		}
+		ps->pid = launch(&sub, line.s, BG, &jid);
+		endprocsubs(&sub, ps->pid == 0);
+		freecmd(&sub);
+		if (ps->pid == 0)
+			goto error;
+		snprintf(name, sizeof(name), "/dev/fd/%d", ps->fd);
+		free(cmd->argv[ps->argi]);
+		cmd->argv[ps->argi] = strdup(name);
+	}
+	for (i = 0; i < cmd->nsubs; i++)
+		if (fcntl(cmd->subs[i].fd, F_SETFD, 0) == -1)
+			unix_error("fcntl error in startprocsubs");
+	free(line.s);
+	return (0);
+
+error:
+	free(line.s);
+	endprocsubs(cmd, true);
+	return (-1);
+}
+
+/*
+ * Requires:
+ *   "cmd" is a command whose process substitutions startprocsubs() has
+ *   started, or tried to.
+ *
+ * Effects:
+ *   Closes the shell's ends of the substitutions' pipes and puts their
+ *   words back in argv, so that the command can be run again.  If "done"
+ *   is true, the command has already finished, or did not start, so the
+ *   jobs of its "<(command)" substitutions, which no one can read from any
+ *   more, are sent SIGPIPE.  The jobs of ">(command)" substitutions see
+ *   the end of their input instead.  Otherwise the job running the command
+ *   ends them, by killprocsubs().
+ */
+static void
+endprocsubs(struct Cmd *cmd, bool done)
+{
+	struct Procsub *ps;
+	struct Buf word = { NULL, 0, 0 };
+	sigset_t mask, prev;
+	int i;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	for (i = 0; i < cmd->nsubs; i++) {
+		ps = &cmd->subs[i];
+		if (ps->fd != -1)
+			close(ps->fd);
+		ps->fd = -1;
+		if (ps->pid == 0)
+			continue;
+		if (done && !ps->out) {
+			// The job may have been reaped, and its PID reused.
+			sigprocmask(SIG_BLOCK, &mask, &prev);
+			if (getjobpid(jobs, ps->pid) != NULL) {
+				kill(-ps->pid, SIGPIPE);
+				kill(-ps->pid, SIGCONT);
+			}
+			sigprocmask(SIG_SETMASK, &prev, NULL);
+		}
+		word.len = 0;
+		bufputn(&word, ps->out ? ">(" : "<(", 2);
+		bufputn(&word, ps->text, strlen(ps->text));
+		bufputc(&word, ')');
+		free(cmd->argv[ps->argi]);
+		cmd->argv[ps->argi] = strdup(word.s);
+		ps->pid = 0;
+	}
+	free(word.s);
+}
+
+/*
+ * Requires:
+ *   "job" points to a job that has just terminated with "status".  Must only
+ *   be called by sigchld_handler() or with SIGCHLD blocked.
+ *
+ * Effects:
+ *   Ends the jobs of the job's process substitutions that are still in the
+ *   jobs list by sending them SIGPIPE: those of its "<(command)"
+ *   substitutions, whose output no one can read any more, and, if the job
+ *   was killed by a signal, those of its ">(command)" substitutions too.
+ *   Otherwise the latter finish reading what the job wrote.  This function
+ *   can be safely called by a signal handler.
+ */
+static void
+killprocsubs(JobP job, int status)
+{
+	int i;
+
+	for (i = 0; i < job->nsubs; i++) {
+		if ((job->subsout[i] && !WIFSIGNALED(status)) ||
+		    getjobpid(jobs, job->subs[i]) == NULL)
+			continue;
+		kill(-job->subs[i], SIGPIPE);
+		kill(-job->subs[i], SIGCONT);
+	}
+}
+
+/*
+ * This comment marks the end of the process substitution helper routines.
+ */
+
+/*
+ * The following helper routines run coprocesses.
+ */
+
+/*
+ * Requires:
+ *   "name" is a properly terminated string.
+ *
+ * Effects:
+ *   Returns the coprocess named "name", or NULL if there is none.
+ */
+static struct Coproc *
+getcoproc(const char *name)
+{
+	struct Coproc *cp;
+
+	for (cp = coprocs; cp != NULL; cp = cp->next)
+		if (strcmp(cp->name, name) == 0)
+			return (cp);
+	return (NULL);
+}
+
+/*
+ * Requires:
+ *   "cp" is a coprocess without a socket.
+ *
+ * Effects:
+ *   Starts the coprocess's command as a background job with one end of a
+ *   new socket as its stdin and stdout, and keeps the other end, which is
+ *   nonblocking, for coprocio().  Returns the job's ID, or 0 if it could
+ *   not be added.
+ */
+static int
+startcoproc(struct Coproc *cp)
+{
+	struct Cmd cmd = cp->cmd;
+	int jid, sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+		unix_error("socketpair error in startcoproc");
+	cmd.infd = cmd.outfd = sv[1];
+	cp->pid = launch(&cmd, cp->cmdline, BG, &jid);
+	close(sv[1]);
+	if (cp->pid == 0) {
+		close(sv[0]);
+		return (0);
+	}
+	if (fcntl(sv[0], F_SETFL, O_NONBLOCK) == -1)
+		unix_error("fcntl error in startcoproc");
+	cp->fd = sv[0];
+	cp->start = monotime();
+	cp->in.len = cp->inpos = 0;
+	bufputn(&cp->in, "", 0);
+	return (jid);
+}
+
+/*
+ * Requires:
+ *   "cp" is a coprocess.
+ *
+ * Effects:
+ *   Ends the coprocess's job, if it is still running, and starts its
+ *   command again.  Returns the new job's ID, or 0 if it could not be
+ *   added.
+ */
+static int
+restartcoproc(struct Coproc *cp)
+{
+	sigset_t mask, prev;
+	int jid;
+
+	if (cp->fd != -1)
+		close(cp->fd);
+	cp->fd = -1;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	if (cp->pid != 0 && getjobpid(jobs, cp->pid) != NULL) {
+		kill(-cp->pid, SIGTERM);
+		kill(-cp->pid, SIGCONT);
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+	cp->restarts++;
+	if ((jid = startcoproc(cp)) != 0)
+		printf("[%d] (%d) %s", jid, (int)cp->pid, cp->cmdline);
+	return (jid);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Starts the command of each coprocess whose job has died again, unless
+ *   the job died within a second of starting, so that a command that
+ *   always fails is only started again by the ask builtin.
+ */
+static void
+checkcoprocs(void)
+{
+	struct Coproc *cp;
+
+	for (cp = coprocs; cp != NULL; cp = cp->next)
+		if (!coprocalive(cp) && monotime() - cp->start >= 1)
+			restartcoproc(cp);
+}
+
+/*
+ * Requires:
+ *   "cp" is a coprocess.
+ *
+ * Effects:
+ *   Returns true if the coprocess's job is still in the jobs list.
+ */
+static bool
+coprocalive(const struct Coproc *cp)
+{
+	sigset_t mask, prev;
+	bool alive;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	alive = cp->pid != 0 && getjobpid(jobs, cp->pid) != NULL;
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+	return (alive);
+}
+
+/*
+ * Requires:
+ *   "cp" is a coprocess that is not on the list of coprocesses.
+ *
+ * Effects:
+ *   Closes the coprocess's socket, which its command reads as the end of
+ *   its input, sends its job SIGTERM if it is still running, and frees it.
+ */
+static void
+freecoproc(struct Coproc *cp)
+{
+	sigset_t mask, prev;
+
+	if (cp->fd != -1)
+		close(cp->fd);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	if (cp->pid != 0 && getjobpid(jobs, cp->pid) != NULL) {
+		kill(-cp->pid, SIGTERM);
+		kill(-cp->pid, SIGCONT);
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+	freecmd(&cp->cmd);
+	free(cp->name);
+	free(cp->cmdline);
+	free(cp->in.s);
+	free(cp);
+}
+
+/*
+ * Requires:
+ *   "cp" is a coprocess with a socket.
+ *
+ * Effects:
+ *   Sends the "len" bytes at "s" to the coprocess, or, if "len" is 0,
+ *   waits for more of its replies.  Replies are read into cp->in as they
+ *   arrive, even while sending, so that a coprocess that replies before
+ *   it has read the whole request cannot block the shell.  Returns 1, 0
+ *   if the coprocess has closed its end of the socket, or -1 if a SIGINT
+ *   interrupted the wait.
+ */
+static int
+coprocio(struct Coproc *cp, const char *s, size_t len)
+{
+	struct pollfd pfd;
+	char buf[READCHUNK];
+	size_t sent = 0;
+	ssize_t n;
+	bool got = false;
+
+	while (len > 0 ? sent < len : !got) {
+		if (interrupted)
+			return (-1);
+		pfd.fd = cp->fd;
+		pfd.events = sent < len ? POLLIN | POLLOUT : POLLIN;
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			unix_error("poll error in coprocio");
+		}
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			n = read(cp->fd, buf, sizeof(buf));
+			if (n == 0 || (n == -1 && errno != EAGAIN &&
+			    errno != EINTR))
+				return (0);
+			if (n > 0) {
+				// Drop the replies that have been read.
+				cp->in.len -= cp->inpos;
+				memmove(cp->in.s, cp->in.s + cp->inpos,
+				    cp->in.len);
+				cp->inpos = 0;
+				bufputn(&cp->in, buf, n);
+				got = true;
+			}
+		}
+		if (sent < len && (pfd.revents & POLLOUT)) {
+			n = send(cp->fd, s + sent, len - sent, MSG_NOSIGNAL);
+			if (n == -1 && errno != EAGAIN && errno != EINTR)
+				return (0);
+			if (n > 0)
+				sent += n;
+		}
+	}
+	return (1);
+}
+
+/*
+ * Requires:
+ *   "cp" is a coprocess with a socket.
+ *
+ * Effects:
+ *   Reads the coprocess's next reply, a line or, if "framed" is true, the
+ *   number of bytes given by a line, and writes it to stdout.  Returns 1,
+ *   0 if the coprocess closed its end of the socket first, -1 if a SIGINT
+ *   interrupted the wait, or -2 (after printing a message) if the length
+ *   of a framed reply is malformed.
+ */
+static int
+coprocreply(struct Coproc *cp, bool framed)
+{
+	unsigned long long len;
+	char *nl, *end;
+	int r;
+
+	// A reply, or the length before it, ends at a newline.
+	while ((nl = memchr(cp->in.s + cp->inpos, '\n',
+	    cp->in.len - cp->inpos)) == NULL)
+		if ((r = coprocio(cp, NULL, 0)) != 1)
+			return (r);
+	if (!framed) {
+		fwrite(cp->in.s + cp->inpos, 1, nl + 1 - (cp->in.s +
+		    cp->inpos), stdout);
+		cp->inpos = nl + 1 - cp->in.s;
+		return (1);
+	}
+	errno = 0;
+	len = strtoull(cp->in.s + cp->inpos, &end, 10);
+	if (end == cp->in.s + cp->inpos || end != nl || errno != 0 ||
+	    !isdigit((unsigned char)cp->in.s[cp->inpos])) {
+		printf("ask: %s: malformed reply length\n", cp->name);
+		return (-2);
+	}
+	cp->inpos = nl + 1 - cp->in.s;
+	while (cp->in.len - cp->inpos < len)
+		if ((r = coprocio(cp, NULL, 0)) != 1)
+			return (r);
+	fwrite(cp->in.s + cp->inpos, 1, len, stdout);
+	cp->inpos += len;
+	return (1);
+}
+
+/*
+ * This comment marks the end of the coprocess helper routines.
+ */
+
+/*
+ * The following helper routines summarize the times of benchmark runs.
+ */
+
+/*
+ * Requires:
+ *   "v" holds "n" > 0 times, in seconds.
+ *
+ * Effects:
+ *   Prints a row of the statistics of the times under "label": their mean,
+ *   standard deviation, minimum, median, 90th and 99th percentiles, and
+ *   maximum.  Sorts "v".
+ */
+static void
+printstats(const char *label, double *v, int n)
+{
+	static const double ranks[] = { 0, 50, 90, 99, 100 };
+	char t[7][16];
+	int i, k;
+
+	fmttime(mean(v, n), t[0], sizeof(t[0]));
+	fmttime(stddev(v, n), t[1], sizeof(t[1]));
+	qsort(v, n, sizeof(*v), cmpdouble);
+	for (i = 0; i < 5; i++) {
+		// The nearest rank: the smallest time that many percent reach.
+		k = (int)ceil(ranks[i] / 100 * n) - 1;
+		fmttime(v[k < 0 ? 0 : k], t[i + 2], sizeof(t[i + 2]));
+	}
+	printf("  %-5s %10s %10s %10s %10s %10s %10s %10s\n", label, t[0],
+	    t[1], t[2], t[3], t[4], t[5], t[6]);
+}
+
+/*
+ * Requires:
+ *   "v" holds "n" > 0 values.
+ *
+ * Effects:
+ *   Returns the mean of the values.
+ */
+static double
+mean(const double *v, int n)
+{
+	double sum = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		sum += v[i];
+	return (sum / n);
+}
+
+/*
+ * Requires:
+ *   "v" holds "n" > 0 values.
+ *
+ * Effects:
+ *   Returns the sample standard deviation of the values, or 0 for a single
+ *   value.
+ */
+static double
+stddev(const double *v, int n)
+{
+	double m = mean(v, n), sum = 0;
+	int i;
+
+	if (n < 2)
+		return (0);
+	for (i = 0; i < n; i++)
+		sum += (v[i] - m) * (v[i] - m);
+	return (sqrt(sum / (n - 1)));
+}
+
+/*
+ * Requires:
+ *   "a" and "b" point to doubles.
+ *
+ * Effects:
+ *   Compares the two values for qsort(), smallest first.
+ */
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Requires:
+ *   "buf" has room for "size" characters.
+ *
+ * Effects:
+ *   Formats the time "secs" in "buf" in microseconds, milliseconds, or
+ *   seconds, whichever suits it, and returns "buf".
+ */
+static const char *
+fmttime(double secs, char *buf, size_t size)
+{
+
+	if (secs < 1e-3)
+		snprintf(buf, size, "%.1fus", secs * 1e6);
+	else if (secs < 1)
+		snprintf(buf, size, "%.2fms", secs * 1e3);
+	else
+		snprintf(buf, size, "%.3fs", secs);
+	return (buf);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the time "tv" in seconds.
+ */
+static double
+tvsecs(const struct timeval *tv)
+{
+
+	return (tv->tv_sec + tv->tv_usec / 1e6);
+}
+
+/*
+ * This comment marks the end of the benchmark helper routines.
+ */
+
+/*
+ * The following helper routines copy one input to several outputs.
+ */
+
+/*
+ * Requires:
+ *   "outs" holds "nouts" open file descriptors, and "name" is the name of
+ *   the builtin, for messages.
+ *
+ * Effects:
+ *   Copies everything read from "in" to each of "outs", until the end of
+ *   the input or until every output's reader has gone away.  When "in"
+ *   is a pipe, each chunk waiting in it is duplicated into the outputs
+ *   that are pipes by tee(2), and then moved into the last of them by
+ *   splice(2), so the data is never copied through user space.  The chunk
+ *   is limited to the room left in the fullest of those pipes, so the
+ *   slowest reader sets the pace.  An output that takes only part of the
+ *   chunk, or is not a pipe, is sent the rest from a copy read from "in".
+ *   SIGPIPE is blocked meanwhile, so an output whose reader has gone away
+ *   is just dropped.  Returns 0, 1 (after printing a message) if reading
+ *   or writing failed, or -1 if a SIGINT interrupted it.
+ */
+static int
+fanout(const char *name, int in, const int *outs, int nouts)
+{
+	struct pollfd pfd;
+	struct stat st;
+	sigset_t prev;
+	size_t *got, chunk, len, off, from;
+	char *buf;
+	bool inpipe, *ispipe, *dead, copy;
+	int i, k, mover, nlive, room, r = 0;
+	ssize_t n;
+
+	inpipe = fstat(in, &st) == 0 && S_ISFIFO(st.st_mode);
+	if ((got = malloc(nouts * sizeof(*got))) == NULL ||
+	    (ispipe = calloc(nouts, sizeof(*ispipe))) == NULL ||
+	    (dead = calloc(nouts, sizeof(*dead))) == NULL)
+		unix_error("malloc error in fanout");
+	chunk = READCHUNK * 16;
+	if (inpipe) {
+		fcntl(in, F_SETPIPE_SZ, TEEPIPE);
+		if ((k = fcntl(in, F_GETPIPE_SZ)) > 0)
+			chunk = k;
+	}
+	for (i = 0; i < nouts; i++) {
+		ispipe[i] = inpipe && fstat(outs[i], &st) == 0 &&
+		    S_ISFIFO(st.st_mode);
+		if (ispipe[i])
+			fcntl(outs[i], F_SETPIPE_SZ, TEEPIPE);
+	}
+	if ((buf = malloc(chunk)) == NULL)
+		unix_error("malloc error in fanout");
+
+	holdsigpipe(&prev);
+	for (nlive = nouts; nlive > 0 && r == 0; ) {
+		if (interrupted) {
+			r = -1;
+			break;
+		}
+		pfd.fd = in;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno != EINTR)
+				unix_error("poll error in fanout");
+			continue;
+		}
+
+		/*
+		 * Take what waits in the input, but from a pipe no more than
+		 * every output pipe has room for.
+		 */
+		len = chunk;
+		mover = -1;
+		copy = !inpipe;
+		if (inpipe) {
+			if (ioctl(in, FIONREAD, &k) == -1)
+				unix_error("ioctl error in fanout");
+			if (k == 0) {
+				if (pfd.revents & (POLLHUP | POLLERR))
+					break;
+				continue;
+			}
+			if ((size_t)k < len)
+				len = k;
+		}
+		for (i = 0; i < nouts; i++) {
+			got[i] = 0;
+			if (dead[i])
+				continue;
+			if (!ispipe[i]) {
+				copy = true;
+				continue;
+			}
+			mover = i;
+			if ((k = fcntl(outs[i], F_GETPIPE_SZ)) > 0 &&
+			    ioctl(outs[i], FIONREAD, &room) == 0) {
+				room = k - room < (int)PIPE_BUF ? (int)PIPE_BUF :
+				    k - room;
+				if ((size_t)room < len)
+					len = room;
+			}
+		}
+
+		/*
+		 * Duplicate the chunk into the output pipes, except that it
+		 * is moved into the last one if no output needs a copy.
+		 */
+		for (i = 0; i < nouts && inpipe; i++) {
+			if (dead[i] || !ispipe[i] || (i == mover && !copy))
+				continue;
+			n = tee(in, outs[i], len, SPLICE_F_NONBLOCK);
+			if (n == -1 && errno == EPIPE) {
+				dead[i] = true;
+				nlive--;
+			} else if (n == -1 && errno != EAGAIN &&
+			    errno != EINTR)
+				unix_error("tee error in fanout");
+			else if (n > 0)
+				got[i] = n;
+			if (got[i] < len)
+				copy = true;
+		}
+		off = 0;
+		if (mover != -1 && !dead[mover] && !copy) {
+			n = splice(in, NULL, outs[mover], NULL, len,
+			    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n == -1 && errno == EPIPE) {
+				dead[mover] = true;
+				nlive--;
+			} else if (n == -1 && errno != EAGAIN &&
+			    errno != EINTR)
+				unix_error("splice error in fanout");
+			else if (n > 0)
+				got[mover] = off = n;
+		}
+		if (off == len)
+			continue;
+
+		// The rest of the chunk goes through a copy.
+		if ((n = read(in, buf, len - off)) == 0)
+			break;
+		if (n == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			printf("%s: read error: %s\n", name, strerror(errno));
+			r = 1;
+			break;
+		}
+		len = off + n;
+		for (i = 0; i < nouts && r == 0; i++) {
+			from = got[i] > off ? got[i] : off;
+			if (dead[i] || from >= len)
+				continue;
+			if ((r = putall(name, outs[i], buf + (from - off),
+			    len - from, ispipe[i])) == 2) {
+				dead[i] = true;
+				nlive--;
+				r = 0;
+			}
+		}
+	}
+	releasesigpipe(&prev);
+	free(buf);
+	free(got);
+	free(ispipe);
+	free(dead);
+	return (r);
+}
+
+/*
+ * Requires:
+ *   "fd" is open for writing, "pipe" is true if it is a pipe, and "name"
+ *   is the name of the builtin, for messages.  SIGPIPE is held by
+ *   holdsigpipe().
+ *
+ * Effects:
+ *   Writes the "len" bytes at "s" to "fd", waiting for it to be writable,
+ *   and to a pipe at most PIPE_BUF bytes at a time, so that a SIGINT can
+ *   interrupt a wait for a slow reader.  Returns 0, 1 (after printing a
+ *   message) on an error, 2 if the reader has gone away, or -1 if
+ *   interrupted.
+ */
+static int
+putall(const char *name, int fd, const char *s, size_t len, bool pipe)
+{
+	struct pollfd pfd;
+	ssize_t n;
+
+	while (len > 0) {
+		if (interrupted)
+			return (-1);
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno != EINTR)
+				unix_error("poll error in putall");
+			continue;
+		}
+		n = write(fd, s, pipe && len > PIPE_BUF ? PIPE_BUF : len);
+		if (n == -1 && errno == EPIPE)
+			return (2);
+		if (n == -1 && errno != EINTR && errno != EAGAIN) {
+			printf("%s: write error: %s\n", name,
+			    strerror(errno));
+			return (1);
+		}
+		if (n > 0) {
+			s += n;
+			len -= n;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Blocks SIGPIPE, so that a write to a pipe whose reader has gone away
+ *   fails with EPIPE instead of ending the shell, and stores the previous
+ *   signal mask in "*prev".
+ */
+static void
+holdsigpipe(sigset_t *prev)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &mask, prev);
+}
+
+/*
+ * Requires:
+ *   "prev" was stored by holdsigpipe().
+ *
+ * Effects:
+ *   Discards any SIGPIPE raised while it was held, and restores the signal
+ *   mask "*prev".
+ */
+static void
+releasesigpipe(const sigset_t *prev)
+{
+	struct timespec zero = { 0, 0 };
+	sigset_t mask;
+
+	sigpending(&mask);
+	if (sigismember(&mask, SIGPIPE)) {
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGPIPE);
+		while (sigtimedwait(&mask, NULL, &zero) == -1 &&
+		    errno == EINTR)
+			;
+	}
+	sigprocmask(SIG_SETMASK, prev, NULL);
+}
+
+/*
+ * This comment marks the end of the fan-out helper routines.
+ */
+
+/*
+ * The following helper routines implement the filter builtins that read
+ * lines.  The input is read in large chunks, and newlines and the first
+ * and last bytes of grep's pattern are found 16 or 32 bytes at a time
+ * with SSE2 or AVX2 instructions, chosen when the builtin starts.
+ */
+
+/*
+ * Requires:
+ *   "name" is a properly terminated string.
+ *
+ * Effects:
+ *   Returns true if "name" is the name of a filter builtin that
+ *   do_filter() implements.
+ */
+static bool
+isfilter(const char *name)
+{
+
+	return (strcmp(name, "cat") == 0 || strcmp(name, "grep") == 0 ||
+	    strcmp(name, "head") == 0 || strcmp(name, "wc") == 0);
+}
+
+/*
+ * Requires:
+ *   "f" was set up by do_filter() for reading a new file, "fd" is open for
+ *   reading, and SIGPIPE is held by holdsigpipe().
+ *
+ * Effects:
+ *   Runs the filter "f" over everything read from "fd": counts its lines
+ *   into f->lines for wc, copies lines while f->lines is positive for
+ *   head, or passes its lines through grepbuf() for grep, adding a newline
+ *   to a last line that lacks one.  Writes the output after each chunk of
+ *   input.  head starts with a small chunk, so a few lines cost little, and
+ *   grep stops at the first selected line if f->quiet is set.  Returns 0,
+ *   1 (after printing a message) if reading or writing failed, 2 if the
+ *   reader of the output has gone away, or -1 if interrupted.
+ */
+static int
+filterfd(struct Filter *f, int fd)
+{
+	size_t len = 0, used, want = READCHUNK;
+	ssize_t n;
+	char *p;
+	long long k;
+	int r = 0;
+
+	if (f->kind == FHEAD && f->lines == 0)
+		return (0);
+	for (;;) {
+		// A line longer than the buffer makes it grow.
+		if (len == f->insize) {
+			f->insize = f->insize == 0 ? FILTERBUF : f->insize * 2;
+			if ((f->in = realloc(f->in, f->insize)) == NULL)
+				unix_error("realloc error in filterfd");
+		}
+		// head reads more each time, as it may need only a line.
+		if (f->kind != FHEAD || want > f->insize - len)
+			want = f->insize - len;
+		if ((n = readsome(f->name, fd, f->in + len, want)) == 0)
+			break;
+		want *= 2;
+		if (n < 0)
+			return (n == -1 ? -1 : 1);
+		if (f->kind == FWC) {
+			f->lines += countlines(f->in, n);
+			continue;
+		}
+		if (f->kind == FHEAD) {
+			if ((k = countlines(f->in, n)) < f->lines) {
+				filterput(f, f->in, n);
+				f->lines -= k;
+			} else {
+				for (p = f->in; f->lines > 0; f->lines--)
+					p = (char *)memchr(p, '\n',
+					    f->in + n - p) + 1;
+				filterput(f, f->in, p - f->in);
+				lseek(fd, p - (f->in + n), SEEK_CUR);
+				break;
+			}
+		} else {
+			len += n;
+			if ((p = memrchr(f->in, '\n', len)) == NULL)
+				continue;
+			used = p + 1 - f->in;
+			grepbuf(f, f->in, used);
+			memmove(f->in, f->in + used, len - used);
+			len -= used;
+			if (f->quiet && f->lines > 0)
+				return (0);
+		}
+		if (f->out.len > 0) {
+			r = putall(f->name, f->outfd, f->out.s, f->out.len,
+			    f->outpipe);
+			f->out.len = 0;
+			if (r != 0)
+				return (r);
+		}
+	}
+	if (len > 0) {
+		f->in[len++] = '\n';
+		grepbuf(f, f->in, len);
+	}
+	if (f->out.len > 0) {
+		r = putall(f->name, f->outfd, f->out.s, f->out.len,
+		    f->outpipe);
+		f->out.len = 0;
+	}
+	return (r);
+}
+
+/*
+ * Requires:
+ *   "f" is a grep filter, and the "len" bytes at "s" are whole lines, each
+ *   ending with a newline.
+ *
+ * Effects:
+ *   Passes each of the lines that grep selects to filterput(), and adds
+ *   their number to f->lines.  Rather than going line by line, it searches
+ *   the whole chunk for the pattern and then finds the line around each
+ *   match, so the lines between matches cost only the search.
+ */
+static void
+grepbuf(struct Filter *f, const char *s, size_t len)
+{
+	const char *end = s + len, *hit, *bol, *eol;
+
+	while (s < end &&
+	    (hit = findstr(s, end - s, f->pat, f->patlen)) != NULL) {
+		bol = memrchr(s, '\n', hit - s);
+		bol = bol == NULL ? s : bol + 1;
+		eol = (const char *)memchr(hit, '\n', end - hit) + 1;
+		if (f->invert) {
+			f->lines += countlines(s, bol - s);
+			filterput(f, s, bol - s);
+		} else {
+			f->lines++;
+			filterput(f, bol, eol - bol);
+		}
+		s = eol;
+	}
+	if (f->invert && s < end) {
+		f->lines += countlines(s, end - s);
+		filterput(f, s, end - s);
+	}
+}
+
+/*
+ * Requires:
+ *   The "len" bytes at "s" are whole lines.
+ *
+ * Effects:
+ *   Appends the lines to the output of "f", each after f->prefix and a
+ *   colon if it has a prefix, unless it is only counting lines.
+ */
+static void
+filterput(struct Filter *f, const char *s, size_t len)
+{
+	const char *end = s + len, *eol;
+
+	if (f->count)
+		return;
+	if (f->prefix == NULL) {
+		bufputn(&f->out, s, len);
+		return;
+	}
+	for (; s < end; s = eol) {
+		eol = (const char *)memchr(s, '\n', end - s) + 1;
+		bufputn(&f->out, f->prefix, strlen(f->prefix));
+		bufputc(&f->out, ':');
+		bufputn(&f->out, s, eol - s);
+	}
+}
+
+/*
+ * Requires:
+ *   "fd" is open for reading, and "name" is the name of the builtin, for
+ *   messages.
+ *
+ * Effects:
+ *   Waits for "fd" to be readable, so that a SIGINT can interrupt a wait
+ *   for a slow writer, and reads at most "len" bytes from it into "buf".
+ *   Returns the number of bytes read, 0 at the end of the input, -1 if
+ *   interrupted, or -2 (after printing a message) on an error.
+ */
+static ssize_t
+readsome(const char *name, int fd, char *buf, size_t len)
+{
+	struct pollfd pfd;
+	ssize_t n;
+
+	for (;;) {
+		if (interrupted)
+			return (-1);
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno != EINTR)
+				unix_error("poll error in readsome");
+			continue;
+		}
+		if ((n = read(fd, buf, len)) >= 0)
+			return (n);
+		if (errno != EINTR && errno != EAGAIN) {
+			printf("%s: read error: %s\n", name, strerror(errno));
+			return (-2);
+		}
+	}
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns true if "fd" is open on /dev/null.
+ */
+static bool
+isdevnull(int fd)
+{
+	struct stat st, null;
+
+	return (fstat(fd, &st) == 0 && S_ISCHR(st.st_mode) &&
+	    stat("/dev/null", &null) == 0 && st.st_rdev == null.st_rdev);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Sets "simd" to the widest vector instructions that the CPU supports,
+ *   or to the narrower ones that TSH_SIMD names, "sse2" or "scalar", so
+ *   that the levels can be compared.
+ */
+static void
+setsimd(void)
+{
+	const char *level = getvar("TSH_SIMD");
+
+	simd = SIMDSCALAR;
+#if defined(__x86_64__)
+	simd = __builtin_cpu_supports("avx2") ? SIMDAVX2 : SIMDSSE2;
+	if (level != NULL && strcmp(level, "sse2") == 0)
+		simd = SIMDSSE2;
+#endif
+	if (level != NULL && strcmp(level, "scalar") == 0)
+		simd = SIMDSCALAR;
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the number of newlines in the "len" bytes at "s", using the
+ *   vector instructions that "simd" allows.
+ */
+static size_t
+countlines(const char *s, size_t len)
+{
+	size_t i, n = 0;
+
+#if defined(__x86_64__)
+	if (simd == SIMDAVX2)
+		return (countavx2(s, len));
+	if (simd == SIMDSSE2)
+		return (countsse2(s, len));
+#endif
+	for (i = 0; i < len; i++)
+		n += s[i] == '\n';
+	return (n);
+}
+
+/*
+ * Requires:
+ *   "pat" does not contain a newline.
+ *
+ * Effects:
+ *   Returns the first occurrence of the "patlen" bytes at "pat" in the
+ *   "len" bytes at "s", or NULL if there is none, using the vector
+ *   instructions that "simd" allows.
+ */
+static const char *
+findstr(const char *s, size_t len, const char *pat, size_t patlen)
+{
+
+	if (patlen == 0)
+		return (s);
+	if (patlen == 1)
+		return (memchr(s, pat[0], len));
+#if defined(__x86_64__)
+	if (simd == SIMDAVX2)
+		return (findavx2(s, len, pat, patlen));
+	if (simd == SIMDSSE2)
+		return (findsse2(s, len, pat, patlen));
+#endif
+	return (memmem(s, len, pat, patlen));
+}
+
+#if defined(__x86_64__)
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the number of newlines in the "len" bytes at "s", comparing 16
+ *   bytes at a time.  Each byte of "acc" counts the newlines in its column
+ *   for up to 255 blocks before they are summed into "sum".
+ */
+static size_t
+countsse2(const char *s, size_t len)
+{
+	const __m128i nl = _mm_set1_epi8('\n'), zero = _mm_setzero_si128();
+	__m128i acc, sum = zero;
+	size_t i = 0, n;
+	int k;
+
+	while (len - i >= 16) {
+		acc = zero;
+		for (k = 0; k < 255 && len - i >= 16; k++, i += 16)
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(nl,
+			    _mm_loadu_si128((const __m128i *)(s + i))));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(acc, zero));
+	}
+	n = _mm_cvtsi128_si64(sum) +
+	    _mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum));
+	for (; i < len; i++)
+		n += s[i] == '\n';
+	return (n);
+}
+
+/*
  * Requires:
- *   signum, the signal (should be sigint) to pass along.
+ *   The CPU supports AVX2.
  *
  * Effects:
- *   Forwards sigint to all foreground processes. 
+ *   Like countsse2(), but compares 32 bytes at a time.
  */
-static void
-sigint_handler(int signum)
+__attribute__((target("avx2"))) static size_t
+countavx2(const char *s, size_t len)
 {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc, sum = zero;
+	uint64_t lanes[4];
+	size_t i = 0, n;
+	int k;
 
-	if (fgpid(jobs) != 0) {
-		if (getpgid(fgpid(jobs)) != -1) {
-			if (kill(getpgid(fgpid(jobs)) * -1, signum) == 1) {
-				Sio_error("Error sending sigint in handler");
-			}
-		}
+	while (len - i >= 32) {
+		acc = zero;
+		for (k = 0; k < 255 && len - i >= 32; k++, i += 32)
+			acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(nl,
+			    _mm256_loadu_si256((const __m256i *)(s + i))));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(acc, zero));
 	}
-	
+	_mm256_storeu_si256((__m256i *)lanes, sum);
+	n = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	for (; i < len; i++)
+		n += s[i] == '\n';
+	return (n);
 }
 
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *  the user types ctrl-z at the keyboard.  Catch it and suspend the
- *  foreground job by sending it a SIGTSTP.  
- *
  * Requires:
- *   signum, the signal (should be sigtstp) to pass along.
+ *   "patlen" is at least 2.
  *
  * Effects:
- *   Forwards sigtstp to all forground processes.
+ *   Returns the first occurrence of the "patlen" bytes at "pat" in the
+ *   "len" bytes at "s", or NULL if there is none.  Compares 16 positions
+ *   at a time with the first and the last byte of the pattern, and only
+ *   the positions where both match with the rest of it, which skips most
+ *   of the text quickly even when the first byte is common.  memmem()
+ *   searches the last few positions.
  */
-static void
-sigtstp_handler(int signum)
+static const char *
+findsse2(const char *s, size_t len, const char *pat, size_t patlen)
 {
+	const __m128i first = _mm_set1_epi8(pat[0]);
+	const __m128i last = _mm_set1_epi8(pat[patlen - 1]);
+	unsigned int mask;
+	size_t i;
+	int k;
 
-	// Prevent an "unused parameter" warning.
-	if (fgpid(jobs) != 0) {
-		if (getpgid(fgpid(jobs)) != -1) {
-			if (kill(getpgid(fgpid(jobs)) * -1, signum) == 1) {
-				Sio_error("Error sending sigtstp in handler");
-			}
+	for (i = 0; i + patlen - 1 + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(_mm_and_si128(
+		    _mm_cmpeq_epi8(first,
+		    _mm_loadu_si128((const __m128i *)(s + i))),
+		    _mm_cmpeq_epi8(last,
+		    _mm_loadu_si128((const __m128i *)(s + i + patlen - 1)))));
+		for (; mask != 0; mask &= mask - 1) {
+			k = __builtin_ctz(mask);
+			if (memcmp(s + i + k + 1, pat + 1, patlen - 2) == 0)
+				return (s + i + k);
 		}
 	}
-	
-	
+	return (i < len ? memmem(s + i, len - i, pat, patlen) : NULL);
 }
 
 /*
- * sigquit_handler - The driver program can gracefully terminate the
- *  child shell by sending it a SIGQUIT signal.
- *
  * Requires:
- *   "signum" is SIGQUIT.
+ *   "patlen" is at least 2, and the CPU supports AVX2.
  *
  * Effects:
- *   Terminates the program.
+ *   Like findsse2(), but compares 32 positions at a time.
  */
-static void
-sigquit_handler(int signum)
+__attribute__((target("avx2"))) static const char *
+findavx2(const char *s, size_t len, const char *pat, size_t patlen)
 {
+	const __m256i first = _mm256_set1_epi8(pat[0]);
+	const __m256i last = _mm256_set1_epi8(pat[patlen - 1]);
+	unsigned int mask;
+	size_t i;
+	int k;
 
-	// Prevent an "unused parameter" warning.
-	(void)signum;
-	Sio_puts("Terminating after receipt of SIGQUIT signal\n");
-	_exit(1);
+	for (i = 0; i + patlen - 1 + 32 <= len; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_and_si256(
+		    _mm256_cmpeq_epi8(first,
+		    _mm256_loadu_si256((const __m256i *)(s + i))),
+		    _mm256_cmpeq_epi8(last,
+		    _mm256_loadu_si256((const __m256i *)(s + i + patlen - 1)))));
+		for (; mask != 0; mask &= mask - 1) {
+			k = __builtin_ctz(mask);
+			if (memcmp(s + i + k + 1, pat + 1, patlen - 2) == 0)
+				return (s + i + k);
+		}
+	}
+	return (i < len ? memmem(s + i, len - i, pat, patlen) : NULL);
 }
+#endif
 
 /*
- * This comment marks the end of the signal handlers.
+ * This comment marks the end of the filter helper routines.
  */
 
 /*
- * The following helper routines manipulate the jobs list.
+ * The following helper routines index the executables in PATH.
  */
 
 /*
  * Requires:
- *   "job" points to a job structure.
+ *   "dir" is a valid Buf.
  *
  * Effects:
- *   Clears the fields in the referenced job structure.
+ *   Stores in "dir" the directory of the executable index files, which is
+ *   the shell variable TSH_EXEC_DIR or else tsh-exec in the user's cache
+ *   directory, creating it if necessary.  Returns true, or false if there
+ *   is no such directory, in which case indexes are kept only in memory.
  */
-static void
-clearjob(JobP job)
+static bool
+execdir(struct Buf *dir)
 {
+	const char *value;
 
-	job->pid = 0;
-	job->jid = 0;
-	job->state = UNDEF;
-	job->cmdline[0] = '\0';
+	dir->len = 0;
+	if ((value = getvar("TSH_EXEC_DIR")) != NULL && value[0] != '\0')
+		bufputn(dir, value, strlen(value));
+	else {
+		if ((value = getvar("XDG_CACHE_HOME")) != NULL &&
+		    value[0] != '\0')
+			bufputn(dir, value, strlen(value));
+		else if ((value = getvar("HOME")) != NULL &&
+		    value[0] != '\0') {
+			bufputn(dir, value, strlen(value));
+			bufputn(dir, "/.cache", 7);
+		} else
+			return (false);
+		mkdir(dir->s, 0700);
+		bufputn(dir, "/tsh-exec", 9);
+	}
+	return (mkdir(dir->s, 0700) == 0 || errno == EEXIST);
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   "dir" is an absolute directory of PATH.
  *
  * Effects:
- *   Initializes the jobs list to an empty state.
+ *   Indexes the executables in "dir".  The index file that another shell
+ *   left is mapped if it is still valid, and is otherwise rebuilt by
+ *   buildindex().  A directory that does not exist has no executables.
  */
 static void
-initjobs(JobP jobs)
+indexdir(struct PathDir *dir)
 {
-	int i;
+	struct Buf file = { NULL, 0, 0 };
+	struct stat st;
+	uint64_t hash = 14695981039346656037u;
+	const char *p;
+	char name[24];
+	bool shared;
+	int fd;
 
-	for (i = 0; i < MAXJOBS; i++)
-		clearjob(&jobs[i]);
+	freeindex(dir);
+	dir->dev = 0;
+	dir->ino = 0;
+	dir->racy = false;
+	if (stat(dir->path, &st) == -1 || !S_ISDIR(st.st_mode))
+		return;
+	dir->dev = st.st_dev;
+	dir->ino = st.st_ino;
+	dir->mtime = st.st_mtim;
+
+	// The index file is named after the FNV-1a hash of the path.
+	if ((shared = execdir(&file))) {
+		for (p = dir->path; *p != '\0'; p++) {
+			hash ^= (unsigned char)*p;
+			hash *= 1099511628211u;
+		}
+		snprintf(name, sizeof(name), "/%016llx",
+		    (unsigned long long)hash);
+		bufputn(&file, name, strlen(name));
+		if ((fd = open(file.s, O_RDONLY | O_CLOEXEC)) != -1) {
+			loadindex(dir, fd, &st);
+			close(fd);
+		}
+	}
+	if (dir->index == NULL)
+		buildindex(dir, shared ? file.s : NULL, &st);
+	free(file.s);
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   "fd" is an index file open for reading, and "st" is the status of
+ *   the directory "dir".
  *
  * Effects:
- *   Returns the largest allocated job ID.
+ *   Maps the index file as the index of "dir" and returns true if it is
+ *   well formed and was made from the same directory with the same
+ *   modification time.  Otherwise, returns false.
  */
-static int
-maxjid(JobP jobs) 
+static bool
+loadindex(struct PathDir *dir, int fd, const struct stat *st)
 {
-	int i, max = 0;
+	struct ExecHead *head;
+	struct stat fst;
+	const uint32_t *offs;
+	size_t len, base, pathlen = strlen(dir->path);
+	uint32_t i;
+	char *map;
 
-	for (i = 0; i < MAXJOBS; i++)
-		if (jobs[i].jid > max)
-			max = jobs[i].jid;
-	return (max);
+	if (fstat(fd, &fst) == -1 || fst.st_size < (off_t)sizeof(*head))
+		return (false);
+	len = fst.st_size;
+	if ((map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED)
+		return (false);
+	head = (struct ExecHead *)map;
+	base = sizeof(*head) + ((pathlen + 4) & ~(size_t)3);
+	if (memcmp(head->magic, "tshexec1", 8) != 0 ||
+	    head->dev != st->st_dev || head->ino != st->st_ino ||
+	    head->sec != st->st_mtim.tv_sec ||
+	    head->nsec != st->st_mtim.tv_nsec || head->pathlen != pathlen ||
+	    len < base || memcmp(map + sizeof(*head), dir->path,
+	    pathlen + 1) != 0 || (len - base) / 4 < head->n ||
+	    map[len - 1] != '\0') {
+		munmap(map, len);
+		return (false);
+	}
+	offs = (const uint32_t *)(map + base);
+	for (i = 0; i < head->n; i++) {
+		if (offs[i] < base + 4 * (size_t)head->n || offs[i] >= len) {
+			munmap(map, len);
+			return (false);
+		}
+	}
+	dir->index = head;
+	dir->indexlen = len;
+	dir->mapped = true;
+	return (true);
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures, and "cmdline" is
- *   a properly terminated string.
+ *   "st" is the status of the directory "dir", and "file" is the path of
+ *   its index file, or NULL.
  *
- * Effects: 
- *   Adds a job to the jobs list. 
+ * Effects:
+ *   Reads the directory and makes an index of the regular files in it
+ *   that have an execute permission bit set.  Unless the directory was
+ *   modified so recently that a later change might not move its
+ *   modification time, the index is also written to "file", through a
+ *   temporary file that is renamed into place so that other shells never
+ *   see it half written.  If the directory cannot be read, it is left
+ *   without an index, to be read again by refreshpath().
  */
-static int
-addjob(JobP jobs, pid_t pid, int state, const char *cmdline)
+static void
+buildindex(struct PathDir *dir, const char *file, const struct stat *st)
 {
-	int i;
-    
-	if (pid < 1)
-		return (0);
-	for (i = 0; i < MAXJOBS; i++) {
-		if (jobs[i].pid == 0) {
-			jobs[i].pid = pid;
-			jobs[i].state = state;
-			jobs[i].jid = nextjid++;
-			if (nextjid > MAXJOBS)
-				nextjid = 1;
-			// Remove the "volatile" qualifier using a cast.
-			strcpy((char *)jobs[i].cmdline, cmdline);
-			if (verbose) {
-				printf("Added job [%d] %d %s\n", jobs[i].jid,
-				    (int)jobs[i].pid, jobs[i].cmdline);
-			}
-			return (1);
+	static char *dentbuf;
+	struct Buf names = { NULL, 0, 0 }, image = { NULL, 0, 0 };
+	struct Buf tmp = { NULL, 0, 0 };
+	struct ExecHead head;
+	struct Dirent64 *ent;
+	struct timespec now;
+	struct stat est;
+	char **sorted, *p, pid[16];
+	size_t base;
+	uint32_t off;
+	long nread, pos;
+	int fd, i, n = 0;
+
+	dir->racy = true;
+	if ((fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return;
+	if (dentbuf == NULL && (dentbuf = malloc(DENTBUF)) == NULL)
+		unix_error("malloc error in buildindex");
+	while ((nread = syscall(SYS_getdents64, fd, dentbuf, DENTBUF)) > 0) {
+		for (pos = 0; pos < nread; pos += ent->d_reclen) {
+			ent = (struct Dirent64 *)(dentbuf + pos);
+			if (ent->d_type == DT_DIR ||
+			    fstatat(fd, ent->d_name, &est, 0) == -1 ||
+			    !S_ISREG(est.st_mode) || (est.st_mode & 0111) == 0)
+				continue;
+			bufputn(&names, ent->d_name, strlen(ent->d_name) + 1);
+			n++;
 		}
 	}
-	printf("Tried to create too many jobs\n");
-	return (0);
+	close(fd);
+	if (nread == -1) {
+		free(names.s);
+		return;
+	}
+
+	if ((sorted = malloc((n + 1) * sizeof(*sorted))) == NULL)
+		unix_error("malloc error in buildindex");
+	for (i = 0, p = names.s; i < n; i++, p += strlen(p) + 1)
+		sorted[i] = p;
+	qsort(sorted, n, sizeof(*sorted), cmpstr);
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, "tshexec1", 8);
+	head.dev = st->st_dev;
+	head.ino = st->st_ino;
+	head.sec = st->st_mtim.tv_sec;
+	head.nsec = st->st_mtim.tv_nsec;
+	head.n = n;
+	head.pathlen = strlen(dir->path);
+	bufputn(&image, (char *)&head, sizeof(head));
+	bufputn(&image, dir->path, head.pathlen + 1);
+	while (image.len % 4 != 0)
+		bufputc(&image, '\0');
+	base = image.len + 4 * (size_t)n;
+	for (i = 0, off = base; i < n; off += strlen(sorted[i++]) + 1)
+		bufputn(&image, (char *)&off, 4);
+	for (i = 0; i < n; i++)
+		bufputn(&image, sorted[i], strlen(sorted[i]) + 1);
+	free(sorted);
+	free(names.s);
+	dir->index = (struct ExecHead *)image.s;
+	dir->indexlen = image.len;
+	dir->mapped = false;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	dir->racy = now.tv_sec - st->st_mtim.tv_sec < 2;
+	if (dir->racy || file == NULL)
+		return;
+	bufputn(&tmp, file, strlen(file));
+	bufputn(&tmp, pid, snprintf(pid, sizeof(pid), ".%d", (int)getpid()));
+	if ((fd = open(tmp.s, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0600)) != -1) {
+		if (sio_writen(fd, image.s, image.len) != (ssize_t)image.len ||
+		    close(fd) == -1 || rename(tmp.s, file) == -1)
+			unlink(tmp.s);
+	}
+	free(tmp.s);
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   Nothing.
  *
  * Effects:
- *   Deletes a job from the jobs list whose PID equals "pid".
+ *   Unmaps or frees the index of "dir", if it has one.
  */
-static int
-deletejob(JobP jobs, pid_t pid) 
+static void
+freeindex(struct PathDir *dir)
+{
+
+	if (dir->index != NULL && dir->mapped)
+		munmap(dir->index, dir->indexlen);
+	else
+		free(dir->index);
+	dir->index = NULL;
+	dir->indexlen = 0;
+	dir->mapped = false;
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Indexes again every indexed directory of PATH whose identity or
+ *   modification time has changed, or whose index is not trusted.
+ *   Returns true if any directory was indexed again.
+ */
+static bool
+refreshpath(void)
 {
+	struct PathDir *dir;
+	struct stat st;
+	bool changed = false;
 	int i;
 
-	if (pid < 1)
-		return (0);
-	for (i = 0; i < MAXJOBS; i++) {
-		if (jobs[i].pid == pid) {
-			clearjob(&jobs[i]);
-			nextjid = maxjid(jobs) + 1;
-			return (1);
-		}
+	for (i = 0; i < npathdirs; i++) {
+		dir = &pathdirs[i];
+		if (!dir->indexed)
+			continue;
+		if (stat(dir->path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+			if (dir->dev == 0 && dir->ino == 0)
+				continue;
+		} else if (!dir->racy && dir->dev == st.st_dev &&
+		    dir->ino == st.st_ino &&
+		    dir->mtime.tv_sec == st.st_mtim.tv_sec &&
+		    dir->mtime.tv_nsec == st.st_mtim.tv_nsec)
+			continue;
+		indexdir(dir);
+		changed = true;
 	}
-	return (0);
+	return (changed);
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   "name" is a properly terminated string.
  *
  * Effects:
- *   Returns the PID of the current foreground job or 0 if no foreground
- *   job exists.
+ *   Returns true if the index of "dir" has an executable named "name",
+ *   found by binary search, and false otherwise.
  */
-static pid_t
-fgpid(JobP jobs)
+static bool
+hasexec(const struct PathDir *dir, const char *name)
 {
-	int i;
+	const char *index = (const char *)dir->index;
+	const uint32_t *offs;
+	uint32_t lo = 0, hi, mid;
+	int c;
 
-	for (i = 0; i < MAXJOBS; i++)
-		if (jobs[i].state == FG)
-			return (jobs[i].pid);
-	return (0);
+	if (index == NULL)
+		return (false);
+	offs = (const uint32_t *)(index + sizeof(*dir->index) +
+	    ((dir->index->pathlen + 4) & ~3u));
+	hi = dir->index->n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((c = strcmp(name, index + offs[mid])) == 0)
+			return (true);
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return (false);
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   "name" is a command name without a '/', and "path" is a valid Buf.
  *
  * Effects:
- *   Returns a pointer to the job structure with process ID "pid" or NULL if
- *   no such job exists.
+ *   Looks "name" up in the indexes of the directories of PATH, in order,
+ *   without a system call.  Returns 1 and stores the executable's path in
+ *   "path" if it is found, 0 if no directory has it, or -1 if a directory
+ *   that is not indexed comes before any that has it.  Only when it is not
+ *   found are the directories checked for changes by refreshpath(), and
+ *   the lookup repeated if any have changed.
  */
-static JobP
-getjobpid(JobP jobs, pid_t pid)
+static int
+findexec(const char *name, struct Buf *path)
 {
+	bool refreshed = false;
 	int i;
 
-	if (pid < 1)
-		return (NULL);
-	for (i = 0; i < MAXJOBS; i++)
-		if (jobs[i].pid == pid)
-			return (&jobs[i]);
-	return (NULL);
+	for (;;) {
+		for (i = 0; i < npathdirs; i++) {
+			if (!pathdirs[i].indexed)
+				return (-1);
+			if (hasexec(&pathdirs[i], name)) {
+				path->len = 0;
+				bufputn(path, pathdirs[i].path,
+				    strlen(pathdirs[i].path));
+				bufputc(path, '/');
+				bufputn(path, name, strlen(name));
+				return (1);
+			}
+		}
+		if (refreshed || !refreshpath())
+			return (0);
+		refreshed = true;
+	}
 }
 
+/*
+ * This comment marks the end of the executable index helper routines.
+ */
+
+/*
+ * Other helper routines follow.
+ */
+
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   "line" is a valid Buf.
  *
  * Effects:
- *   Returns a pointer to the job structure with job ID "jid" or NULL if no
- *   such job exists.
+ *   Reads the next line of input from stdin into "line", ending it with a
+ *   '\n' even if the input did not.  Returns false at end of file.  Input is
+ *   buffered here rather than by stdio, so that while no complete line is
+ *   available, the shell can wait in eventloop() for stdin to become
+ *   readable and service its other file descriptors meanwhile.  While
+ *   main() waits for a command line, the completion hooks of each job that
+ *   finishes are run by runhooks() right away.
  */
-static JobP
-getjobjid(JobP jobs, int jid) 
+static bool
+readline(struct Buf *line)
 {
-	int i;
+	static struct Buf in;      // input read but not yet returned
+	static size_t pos;         // start of the unreturned input in "in"
+	static bool eof;           // has stdin reached end of file?
+	sigset_t mask, prev;
+	char *nl;
+	size_t len;
+	ssize_t n;
 
-	if (jid < 1)
-		return (NULL);
-	for (i = 0; i < MAXJOBS; i++)
-		if (jobs[i].jid == jid)
-			return (&jobs[i]);
-	return (NULL);
+	bufputn(&in, "", 0);
+	for (;;) {
+		if ((nl = memchr(in.s + pos, '\n', in.len - pos)) != NULL)
+			len = nl + 1 - (in.s + pos);
+		else if (eof)
+			len = in.len - pos;
+		else
+			len = 0;
+		if (len > 0) {
+			line->len = 0;
+			bufputn(line, in.s + pos, len);
+			if (nl == NULL)
+				bufputc(line, '\n');
+			pos += len;
+			return (true);
+		}
+		if (eof)
+			return (false);
+
+		// Discard the returned input, then wait for more.
+		memmove(in.s, in.s + pos, in.len - pos);
+		in.len -= pos;
+		pos = 0;
+		if (sigemptyset(&mask) == -1)
+			unix_error("sigemptyset error in readline");
+		if (sigaddset(&mask, SIGCHLD) == -1)
+			unix_error("sigaddset error in readline");
+		if (sigprocmask(SIG_BLOCK, &mask, &prev) == -1)
+			unix_error("sigprocmask error in readline");
+		while (!eventloop(&prev, STDIN_FILENO)) {
+			// At the prompt, a job's hooks run as soon as it ends.
+			if (atprompt && hookdone != ndone) {
+				if (sigprocmask(SIG_SETMASK, &prev, NULL) == -1)
+					unix_error("sigprocmask error in readline");
+				runhooks();
+				if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+					unix_error("sigprocmask error in readline");
+			}
+		}
+		if (sigprocmask(SIG_SETMASK, &prev, NULL) == -1)
+			unix_error("sigprocmask error in readline");
+
+		if (in.len + READCHUNK + 1 > in.max) {
+			in.max = in.len + READCHUNK + 1;
+			if ((in.s = realloc(in.s, in.max)) == NULL)
+				unix_error("realloc error in readline");
+		}
+		if ((n = read(STDIN_FILENO, in.s + in.len, READCHUNK)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			app_error("read error");
+		}
+		if (n == 0)
+			eof = true;
+		in.len += n;
+		in.s[in.len] = '\0';
+	}
 }
 
 /*
  * Requires:
- *   Nothing.
+ *   "a" and "b" point to pointers to properly terminated strings.
  *
  * Effects:
- *   Returns the job ID for the job with process ID "pid" or 0 if no such
- *   job exists.
+ *   Compares the strings for qsort().
  */
 static int
-pid2jid(pid_t pid) 
+cmpstr(const void *a, const void *b)
 {
-	int i;
 
-	if (pid < 1)
-		return (0);
-	for (i = 0; i < MAXJOBS; i++)
-		if (jobs[i].pid == pid)
-			return (jobs[i].jid);
-	return (0);
+	return (strcmp(*(char *const *)a, *(char *const *)b));
 }
 
 /*
  * Requires:
- *   "jobs" points to an array of MAXJOBS job structures.
+ *   "buf" is a valid Buf.
  *
  * Effects:
- *   Prints the jobs list.
+ *   Appends the character "c" to "buf".
  */
 static void
-listjobs(JobP jobs) 
+bufputc(struct Buf *buf, char c)
 {
-	int i;
 
-	for (i = 0; i < MAXJOBS; i++) {
-		if (jobs[i].pid != 0) {
-			printf("[%d] (%d) ", jobs[i].jid, (int)jobs[i].pid);
-			switch (jobs[i].state) {
-			case BG: 
-				printf("Running ");
-				break;
-			case FG: 
-				printf("Foreground ");
-				break;
-			case ST: 
-				printf("Stopped ");
-				break;
-			default:
-				printf("listjobs: Internal error: "
-				    "job[%d].state=%d ", i, jobs[i].state);
-			}
-			printf("%s", jobs[i].cmdline);
-		}
-	}
+	bufputn(buf, &c, 1);
 }
 
 /*
- * This comment marks the end of the jobs list helper routines.
+ * Requires:
+ *   "buf" is a valid Buf, and "s" points to at least "n" characters.
+ *
+ * Effects:
+ *   Appends the first "n" characters of "s" to "buf", growing it as
+ *   necessary, and keeps it NUL-terminated.
  */
+static void
+bufputn(struct Buf *buf, const char *s, size_t n)
+{
+
+	if (buf->len + n + 1 > buf->max) {
+		while (buf->len + n + 1 > buf->max)
+			buf->max = buf->max == 0 ? 64 : buf->max * 2;
+		if ((buf->s = realloc(buf->s, buf->max)) == NULL)
+			unix_error("realloc error in bufputn");
+	}
+	memcpy(buf->s + buf->len, s, n);
+	buf->len += n;
+	buf->s[buf->len] = '\0';
+}
 
 /*
- * Other helper routines follow.
+ * Requires:
+ *   "name" is a properly terminated string.
+ *
+ * Effects:
+ *   Returns the number of the signal named by "name", which is either a
+ *   number or a name from signame with or without the "SIG" prefix, or -1
+ *   if there is no such signal.
  */
+static int
+parsesig(const char *name)
+{
+	int i;
+
+	if (isdigit((unsigned char)name[0]))
+		return ((i = atoi(name)) < NSIG ? i : -1);
+	if (strncmp(name, "SIG", 3) == 0)
+		name += 3;
+	for (i = 1; i < NSIG; i++)
+		if (signame[i] != NULL && strcmp(signame[i], name) == 0)
+			return (i);
+	return (-1);
+}
 
 /*
  * Requires:
@@ -1018,10 +10725,12 @@ static void
 usage(void) 
 {
 
-	printf("Usage: shell [-hvp]\n");
+	printf("Usage: shell [-hvps] [-l socket]\n");
 	printf("   -h   print this message\n");
 	printf("   -v   print additional diagnostic information\n");
 	printf("   -p   do not emit a command prompt\n");
+	printf("   -s   reap and track the orphaned descendants of jobs\n");
+	printf("   -l   run jobs submitted to the Unix domain socket\n");
 	exit(1);
 }
 
@@ -1149,6 +10858,34 @@ sio_puts(const char s[])
 	return (write(STDOUT_FILENO, s, sio_strlen(s)));
 }
 
+/*
+ * Requires:
+ *   "buf" points to at least "n" bytes.
+ *
+ * Effects:
+ *   Writes the "n" bytes at "buf" to "fd", retrying after short writes and
+ *   interruptions, using only functions that can be safely called by a
+ *   signal handler.  Returns "n", or -1 on error.
+ */
+static ssize_t
+sio_writen(int fd, const void *buf, size_t n)
+{
+	const char *p = buf;
+	size_t left = n;
+	ssize_t nw;
+
+	while (left > 0) {
+		if ((nw = write(fd, p, left)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		p += nw;
+		left -= nw;
+	}
+	return (n);
+}
+
 /*
  * Requires:
  *   "s" is a properly terminated string.
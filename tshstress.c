@@ -0,0 +1,880 @@
+/*
+ * tshstress.c - A signal-storm stress test and benchmark for the tiny shell
+ *
+ * usage: tshstress [-v] [-s shell] [-d dir] [-p probes] [-b burst]
+ *                  [-n cmds] [-r rate] [-l maxlost]
+ *
+ * Runs the shell on pipes, as sdriver.pl does, and drives it through
+ * three phases, using the myspin, mysplit, mystop, and myint programs in
+ * "dir":
+ *
+ *   probe   Each probe starts "burst" short background jobs, so that a
+ *           storm of SIGCHLDs is on its way, then a long foreground job,
+ *           and sends the shell one SIGINT or SIGTSTP once that job runs.
+ *           A signal whose job is not reported as terminated or stopped
+ *           within a second is counted as lost.  The time from the signal
+ *           to the report is the signal latency.
+ *   storm   Another process sends the shell SIGINT and SIGTSTP, in turn,
+ *           at "rate" per second, while the shell runs "cmds" short
+ *           foreground and background jobs, some of which stop or
+ *           interrupt themselves.
+ *   reap    The time from starting a short foreground job to the shell
+ *           taking the next command is the reap latency.
+ *
+ * After each phase, the jobs list is checked against the shell's children
+ * in /proc: a job whose process is gone is stale, a live child that is
+ * not a job is untracked, and a zombie child that the shell does not reap
+ * is leaked.  The shell is stuck if it stops taking commands.  The test
+ * fails, with exit status 1, on any of these or on more than "maxlost"
+ * lost signals.
+ *
+ * The shell is synchronized with through "jobs %tshstressN", a builtin
+ * that the signals cannot interrupt, which prints "%tshstressN: No such
+ * job".
+ */
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXLINE  1024       // max line of shell output
+#define MAXKIDS  4096       // max children of the shell looked at
+#define GROUP      50       // storm commands between synchronizations
+#define STUCK      10.0     // seconds without progress before giving up
+
+/*
+ * A growable array of latencies in seconds.
+ */
+struct Lat {
+	double *v;              // latencies
+	int n;                  // number of latencies
+	int max;                // allocated size of v
+};
+
+/*
+ * Counts shared with the process that sends the storm of signals.
+ */
+struct Fired {
+	unsigned long sigint;   // SIGINTs sent
+	unsigned long sigtstp;  // SIGTSTPs sent
+};
+
+static pid_t shell;                // the shell under test
+static int tosh = -1;              // the shell's stdin
+static int fromsh = -1;            // the shell's stdout and stderr
+static char in[1 << 16];           // shell output not yet taken as lines
+static size_t inlen;               // bytes in "in"
+static bool verbose;               // echo the shell's output?
+static const char *dir = ".";      // directory of the test programs
+static int marks;                  // synchronizations so far
+
+static unsigned long lost, stale, untracked, leaked, stuck, mismatched;
+static unsigned long reports, stops, terms;
+
+static void	usage(void);
+static double	now(void);
+static void	startshell(const char *path);
+static void	sendcmd(const char *fmt, ...);
+static bool	nextline(char *line, double deadline);
+static bool	syncshell(const char *phase);
+static bool	isreport(const char *line, pid_t *pidp, char *what,
+		    char *sig);
+static int	children(pid_t pid, pid_t *kids);
+static bool	procstat(pid_t pid, char *comm, char *state, pid_t *pgrp);
+static bool	hasarg(pid_t pid, const char *arg);
+static pid_t	waitfg(const char *comm, const char *arg, double deadline);
+static pid_t	startfirer(struct Fired *fired, double rate);
+static void	probe(int nprobes, int burst);
+static void	storm(int ncmds, double rate);
+static void	reap(int n);
+static void	check(const char *phase);
+static int	listed(pid_t *pids, char *states);
+static void	addlat(struct Lat *lat, double secs);
+static void	printlat(const char *name, struct Lat *lat);
+static int	cmpdouble(const void *a, const void *b);
+
+static struct Lat siglat, reaplat;
+
+int
+main(int argc, char **argv)
+{
+	const char *path = "./tsh";
+	int c, nprobes = 200, burst = 8, ncmds = 2000;
+	unsigned long maxlost = 0;
+	double rate = 2000, start;
+	bool failed;
+
+	while ((c = getopt(argc, argv, "vs:d:p:b:n:r:l:")) != -1) {
+		switch (c) {
+		case 'v':
+			verbose = true;
+			break;
+		case 's':
+			path = optarg;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'p':
+			nprobes = atoi(optarg);
+			break;
+		case 'b':
+			burst = atoi(optarg);
+			break;
+		case 'n':
+			ncmds = atoi(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'l':
+			maxlost = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || nprobes < 0 || burst < 0 || ncmds < 0 ||
+	    rate <= 0)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+	startshell(path);
+	start = now();
+	if (syncshell("start")) {
+		probe(nprobes, burst);
+		check("probe");
+	}
+	if (stuck == 0) {
+		storm(ncmds, rate);
+		check("storm");
+	}
+	if (stuck == 0) {
+		reap(nprobes);
+		check("reap");
+	}
+
+	// Let the shell exit at end of file, or else kill it.
+	close(tosh);
+	for (c = 0; c < 100 && waitpid(shell, NULL, WNOHANG) == 0; c++)
+		usleep(10000);
+	if (c == 100) {
+		kill(shell, SIGKILL);
+		waitpid(shell, NULL, 0);
+	}
+
+	printf("elapsed:           %.2fs\n", now() - start);
+	printf("reports:           %lu (%lu stopped, %lu terminated)\n",
+	    reports, stops, terms);
+	printf("lost signals:      %lu of %d (%.2f%%)\n", lost, nprobes,
+	    nprobes > 0 ? 100.0 * lost / nprobes : 0.0);
+	printlat("signal latency:", &siglat);
+	printlat("reap latency:", &reaplat);
+	printf("stale jobs:        %lu\n", stale);
+	printf("untracked jobs:    %lu\n", untracked);
+	printf("mismatched states: %lu\n", mismatched);
+	printf("leaked zombies:    %lu\n", leaked);
+	printf("stuck:             %s\n", stuck != 0 ? "yes" : "no");
+	failed = lost > maxlost || stale != 0 || untracked != 0 ||
+	    mismatched != 0 || leaked != 0 || stuck != 0;
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return (failed ? 1 : 0);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Prints a usage message and exits.
+ */
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: tshstress [-v] [-s shell] [-d dir] "
+	    "[-p probes] [-b burst]\n"
+	    "                 [-n cmds] [-r rate] [-l maxlost]\n");
+	exit(2);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns the time in seconds on the monotonic clock.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Requires:
+ *   "path" is the shell to test.
+ *
+ * Effects:
+ *   Starts the shell with "-p", reading commands from tosh and writing its
+ *   output to fromsh.
+ */
+static void
+startshell(const char *path)
+{
+	int inpipe[2], outpipe[2];
+
+	if (pipe2(inpipe, O_CLOEXEC) == -1 ||
+	    pipe2(outpipe, O_CLOEXEC) == -1) {
+		perror("pipe");
+		exit(2);
+	}
+	if ((shell = fork()) == -1) {
+		perror("fork");
+		exit(2);
+	}
+	if (shell == 0) {
+		setpgid(0, 0);
+		dup2(inpipe[0], STDIN_FILENO);
+		dup2(outpipe[1], STDOUT_FILENO);
+		execl(path, path, "-p", (char *)NULL);
+		perror(path);
+		_exit(127);
+	}
+	close(inpipe[0]);
+	close(outpipe[1]);
+	tosh = inpipe[1];
+	fromsh = outpipe[0];
+	fcntl(fromsh, F_SETFL, O_NONBLOCK);
+}
+
+/*
+ * Requires:
+ *   "fmt" is a printf() format for one or more command lines.
+ *
+ * Effects:
+ *   Writes the command lines to the shell, taking its output meanwhile so
+ *   that neither side blocks the other.
+ */
+static void
+sendcmd(const char *fmt, ...)
+{
+	struct pollfd fds[2];
+	char buf[MAXLINE];
+	va_list ap;
+	size_t len, off = 0;
+	ssize_t n;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	while (off < len) {
+		fds[0].fd = tosh;
+		fds[0].events = POLLOUT;
+		fds[1].fd = fromsh;
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, 1000) == -1 && errno != EINTR)
+			return;
+		if (fds[1].revents != 0 && inlen < sizeof(in) &&
+		    (n = read(fromsh, in + inlen, sizeof(in) - inlen)) > 0)
+			inlen += n;
+		if ((fds[0].revents & (POLLERR | POLLHUP)) != 0)
+			return;
+		if (fds[0].revents != 0 &&
+		    (n = write(tosh, buf + off, len - off)) > 0)
+			off += n;
+	}
+}
+
+/*
+ * Requires:
+ *   "line" has room for MAXLINE characters.
+ *
+ * Effects:
+ *   Reads the next line of the shell's output into "line", without its
+ *   newline, and tallies the job reports in it.  Returns true, or false if
+ *   none is complete by "deadline" or the shell has closed its output.
+ */
+static bool
+nextline(char *line, double deadline)
+{
+	struct pollfd pfd;
+	char *nl, what[16], sig[16];
+	size_t len;
+	ssize_t n;
+	pid_t pid;
+	double left;
+
+	for (;;) {
+		if ((nl = memchr(in, '\n', inlen)) != NULL ||
+		    inlen == sizeof(in)) {
+			len = nl != NULL ? (size_t)(nl - in) : inlen;
+			if (len >= MAXLINE)
+				len = MAXLINE - 1;
+			memcpy(line, in, len);
+			line[len] = '\0';
+			len = nl != NULL ? (size_t)(nl + 1 - in) : len;
+			memmove(in, in + len, inlen - len);
+			inlen -= len;
+			if (verbose)
+				printf("| %s\n", line);
+			if (isreport(line, &pid, what, sig)) {
+				reports++;
+				if (strcmp(what, "stopped") == 0)
+					stops++;
+				else
+					terms++;
+			}
+			return (true);
+		}
+		if ((left = deadline - now()) <= 0)
+			return (false);
+		pfd.fd = fromsh;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, (int)(left * 1000) + 1) == -1 &&
+		    errno != EINTR)
+			return (false);
+		n = read(fromsh, in + inlen, sizeof(in) - inlen);
+		if (n == 0)
+			return (false);
+		if (n > 0)
+			inlen += n;
+	}
+}
+
+/*
+ * Requires:
+ *   "phase" names the current phase.
+ *
+ * Effects:
+ *   Waits for the shell to take every command sent so far, by sending a
+ *   jobs builtin with a selector that matches nothing and waiting for its
+ *   complaint.  Returns true, or false, after counting the shell as stuck,
+ *   if it does not answer within STUCK seconds.
+ */
+static bool
+syncshell(const char *phase)
+{
+	char line[MAXLINE], want[64];
+	double deadline = now() + STUCK;
+
+	snprintf(want, sizeof(want), "%%tshstress%d: No such job", ++marks);
+	sendcmd("jobs %%tshstress%d\n", marks);
+	while (nextline(line, deadline))
+		if (strcmp(line, want) == 0)
+			return (true);
+	printf("%s: shell is stuck\n", phase);
+	stuck++;
+	return (false);
+}
+
+/*
+ * Requires:
+ *   "what" and "sig" have room for 16 characters.
+ *
+ * Effects:
+ *   Returns true if "line" is the shell's report that a job was stopped or
+ *   terminated by a signal, and stores the PID, "stopped" or "terminated",
+ *   and the signal's name without "SIG".
+ */
+static bool
+isreport(const char *line, pid_t *pidp, char *what, char *sig)
+{
+	int jid, pid;
+
+	if (sscanf(line, "Job [%d] (%d) %15s by signal SIG%15s", &jid, &pid,
+	    what, sig) != 4)
+		return (false);
+	*pidp = pid;
+	return (true);
+}
+
+/*
+ * Requires:
+ *   "kids" has room for MAXKIDS PIDs.
+ *
+ * Effects:
+ *   Stores the PIDs of the children of "pid", zombies included, and
+ *   returns how many there are.
+ */
+static int
+children(pid_t pid, pid_t *kids)
+{
+	char path[64];
+	FILE *fp;
+	int n = 0;
+	long kid;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)pid,
+	    (int)pid);
+	if ((fp = fopen(path, "r")) == NULL)
+		return (0);
+	while (n < MAXKIDS && fscanf(fp, "%ld", &kid) == 1)
+		kids[n++] = kid;
+	fclose(fp);
+	return (n);
+}
+
+/*
+ * Requires:
+ *   "comm" has room for 32 characters.
+ *
+ * Effects:
+ *   Reads the command name, state, and process group of "pid" from
+ *   /proc.  Returns true, or false if there is no such process.
+ */
+static bool
+procstat(pid_t pid, char *comm, char *state, pid_t *pgrp)
+{
+	char path[64], buf[512], *p;
+	int fd, group;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return (false);
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return (false);
+	buf[n] = '\0';
+	if ((p = strrchr(buf, ')')) == NULL ||
+	    sscanf(p + 2, "%c %*d %d", state, &group) != 2)
+		return (false);
+	*pgrp = group;
+	n = p - strchr(buf, '(') - 1;
+	if (n > 31)
+		n = 31;
+	memcpy(comm, strchr(buf, '(') + 1, n);
+	comm[n] = '\0';
+	return (true);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Returns true if the last argument of "pid" is "arg".
+ */
+static bool
+hasarg(pid_t pid, const char *arg)
+{
+	char path[64], buf[256], *p;
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", (int)pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return (false);
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 1)
+		return (false);
+	buf[n - 1] = '\0';
+	p = memrchr(buf, '\0', n - 1);
+	return (strcmp(p != NULL ? p + 1 : buf, arg) == 0);
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Waits for a child of the shell that is the leader of its own process
+ *   group and is running "comm" with the last argument "arg", and is not
+ *   stopped.  Returns its
+ *   PID, or 0 if there is none by "deadline".
+ */
+static pid_t
+waitfg(const char *comm, const char *arg, double deadline)
+{
+	static pid_t kids[MAXKIDS];
+	char name[32], state;
+	pid_t pgrp;
+	int i, n;
+
+	do {
+		n = children(shell, kids);
+		for (i = 0; i < n; i++) {
+			if (procstat(kids[i], name, &state, &pgrp) &&
+			    pgrp == kids[i] && state != 'Z' && state != 'T' &&
+			    strcmp(name, comm) == 0 && hasarg(kids[i], arg))
+				return (kids[i]);
+		}
+		usleep(200);
+	} while (now() < deadline);
+	return (0);
+}
+
+/*
+ * Requires:
+ *   "fired" is shared with the child.
+ *
+ * Effects:
+ *   Starts a process that sends the shell SIGINT and SIGTSTP, in turn, at
+ *   "rate" signals per second until it is killed, and counts them in
+ *   "fired".  Returns its PID.
+ */
+static pid_t
+startfirer(struct Fired *fired, double rate)
+{
+	struct timespec next;
+	long step = (long)(1e9 / rate);
+	pid_t pid;
+	bool flip = false;
+
+	if ((pid = fork()) == -1) {
+		perror("fork");
+		exit(2);
+	}
+	if (pid != 0)
+		return (pid);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;;) {
+		if (kill(shell, flip ? SIGTSTP : SIGINT) == -1)
+			_exit(0);
+		if (flip)
+			fired->sigtstp++;
+		else
+			fired->sigint++;
+		flip = !flip;
+		next.tv_nsec += step;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the probe phase, described above, "nprobes" times.
+ */
+static void
+probe(int nprobes, int burst)
+{
+	char line[MAXLINE], what[16], sig[16];
+	double sent, deadline;
+	pid_t pid, got;
+	int i, j, signum;
+	bool reported;
+
+	for (i = 0; i < nprobes && stuck == 0; i++) {
+		for (j = 0; j < burst; j++)
+			sendcmd("%s/%s 0 &\n", dir, j % 2 ? "mysplit" : "myspin");
+		sendcmd("%s/myspin 30\n", dir);
+		if ((pid = waitfg("myspin", "30", now() + STUCK)) == 0) {
+			printf("probe: foreground job never started\n");
+			stuck++;
+			return;
+		}
+
+		// Send the signal, and wait for the shell to report the job.
+		signum = i % 2 ? SIGTSTP : SIGINT;
+		sent = now();
+		kill(shell, signum);
+		reported = false;
+		deadline = sent + 1;
+		while (!reported && nextline(line, deadline))
+			if (isreport(line, &got, what, sig) && got == pid)
+				reported = true;
+		if (reported)
+			addlat(&siglat, now() - sent);
+		else {
+			lost++;
+			printf("probe %d: SIG%s to job %d was lost\n", i,
+			    signum == SIGINT ? "INT" : "TSTP", (int)pid);
+		}
+
+		// Take the job down, stopped or not, so the shell goes on.
+		if (!reported || strcmp(what, "stopped") == 0) {
+			sendcmd("kill -KILL %d\n", (int)pid);
+			if (!reported)
+				kill(pid, SIGKILL);
+			reported = false;
+			deadline = now() + STUCK;
+			while (!reported && nextline(line, deadline))
+				if (isreport(line, &got, what, sig) &&
+				    got == pid)
+					reported = true;
+			if (!reported) {
+				printf("probe: job %d was not reaped\n",
+				    (int)pid);
+				stuck++;
+				return;
+			}
+		}
+		if (!syncshell("probe"))
+			return;
+	}
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the storm phase, described above, with "ncmds" commands while
+ *   signals are sent at "rate" per second.  The stopped jobs are killed
+ *   every few groups so that the jobs list does not fill up.
+ */
+static void
+storm(int ncmds, double rate)
+{
+	static const char *const mix[] = {
+		"myspin 0", "myspin 0 &", "mystop 0", "mysplit 0 &",
+		"myint 0", "mysplit 0", "myspin 0 &", "myspin 0"
+	};
+	struct Fired *fired;
+	double start;
+	pid_t firer;
+	int i;
+
+	if ((fired = mmap(NULL, sizeof(*fired), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		perror("mmap");
+		exit(2);
+	}
+	start = now();
+	firer = startfirer(fired, rate);
+	for (i = 0; i < ncmds && stuck == 0; i++) {
+		sendcmd("%s/%s\n", dir, mix[i % (sizeof(mix) /
+		    sizeof(mix[0]))]);
+		if ((i + 1) % GROUP == 0 || i + 1 == ncmds) {
+			if ((i + 1) % (4 * GROUP) == 0)
+				sendcmd("kill -KILL %%stopped\n");
+			syncshell("storm");
+		}
+	}
+	kill(firer, SIGKILL);
+	waitpid(firer, NULL, 0);
+	printf("storm:             %d commands in %.2fs, %lu SIGINT and "
+	    "%lu SIGTSTP sent\n", ncmds, now() - start, fired->sigint,
+	    fired->sigtstp);
+	munmap(fired, sizeof(*fired));
+}
+
+/*
+ * Requires:
+ *   Nothing.
+ *
+ * Effects:
+ *   Runs the reap phase, described above, "n" times.
+ */
+static void
+reap(int n)
+{
+	double start;
+	int i;
+
+	for (i = 0; i < n && stuck == 0; i++) {
+		start = now();
+		sendcmd("%s/myspin 0\n", dir);
+		if (syncshell("reap"))
+			addlat(&reaplat, now() - start);
+	}
+}
+
+/*
+ * Requires:
+ *   "pids" has room for MAXKIDS PIDs and "states" for MAXKIDS characters.
+ *
+ * Effects:
+ *   Runs the jobs builtin and stores the PID of each job listed, and 'R'
+ *   or 'T' for a running or stopped job.  Returns how many are listed, or
+ *   -1 if the shell is stuck.
+ */
+static int
+listed(pid_t *pids, char *states)
+{
+	char line[MAXLINE], want[64], state[16];
+	double deadline = now() + STUCK;
+	int jid, pid, n = 0;
+
+	sendcmd("jobs\n");
+	snprintf(want, sizeof(want), "%%tshstress%d: No such job", ++marks);
+	sendcmd("jobs %%tshstress%d\n", marks);
+	while (nextline(line, deadline)) {
+		if (strcmp(line, want) == 0)
+			return (n);
+		if (n < MAXKIDS && sscanf(line, "[%d] (%d) %15s", &jid, &pid,
+		    state) == 3) {
+			pids[n] = pid;
+			states[n++] = strcmp(state, "Stopped") == 0 ? 'T' : 'R';
+		}
+	}
+	stuck++;
+	return (-1);
+}
+
+/*
+ * Requires:
+ *   "phase" names the phase just run.
+ *
+ * Effects:
+ *   Checks the jobs list against the shell's children, twice so that a
+ *   job that ends between the jobs builtin and the look at /proc is not
+ *   counted, then kills every job and checks that the shell reaps them
+ *   all and lists none.
+ */
+static void
+check(const char *phase)
+{
+	static pid_t kids[MAXKIDS], pids[2][MAXKIDS];
+	static char states[2][MAXKIDS];
+	char name[32], state, *seen;
+	pid_t pgrp;
+	int i, j, k, n[2], nkids, bad[3] = { 0, 0, 0 };
+	double deadline;
+
+	// Start some jobs that will still be running when they are checked.
+	for (i = 0; i < 4; i++)
+		sendcmd("%s/myspin 30 &\n", dir);
+	if (!syncshell(phase))
+		return;
+	for (k = 0; k < 2; k++) {
+		if ((n[k] = listed(pids[k], states[k])) == -1)
+			return;
+		if (k == 0)
+			usleep(100000);
+	}
+	nkids = children(shell, kids);
+	if ((seen = calloc(nkids + 1, 1)) == NULL)
+		exit(2);
+	for (i = 0; i < n[1]; i++) {
+		for (j = 0; j < n[0] && pids[0][j] != pids[1][i]; j++)
+			;
+		if (j == n[0])
+			continue;	// Not listed both times.
+		for (k = 0; k < nkids && kids[k] != pids[1][i]; k++)
+			;
+		if (k < nkids)
+			seen[k] = 1;
+		if (!procstat(pids[1][i], name, &state, &pgrp) ||
+		    state == 'Z' || k == nkids) {
+			printf("%s: job %d is stale\n", phase, (int)pids[1][i]);
+			bad[0]++;
+		} else if ((state == 'T') != (states[1][i] == 'T') &&
+		    states[0][j] == states[1][i]) {
+			printf("%s: job %d is listed as %s but is %c\n", phase,
+			    (int)pids[1][i], states[1][i] == 'T' ? "stopped" :
+			    "running", state);
+			bad[1]++;
+		}
+	}
+	for (k = 0; k < nkids; k++) {
+		if (!seen[k] && procstat(kids[k], name, &state, &pgrp) &&
+		    state != 'Z' && pgrp == kids[k]) {
+			printf("%s: child %d (%s) is not a job\n", phase,
+			    (int)kids[k], name);
+			bad[2]++;
+		}
+	}
+	free(seen);
+	stale += bad[0];
+	mismatched += bad[1];
+	untracked += bad[2];
+
+	// Kill every job, and wait for the shell to reap them.
+	sendcmd("kill -KILL %%all\n");
+	if (!syncshell(phase))
+		return;
+	deadline = now() + 2;
+	do {
+		nkids = children(shell, kids);
+		if (nkids == 0)
+			break;
+		usleep(1000);
+	} while (now() < deadline);
+	for (k = 0; k < nkids; k++) {
+		if (procstat(kids[k], name, &state, &pgrp) && state == 'Z') {
+			printf("%s: zombie %d (%s) was not reaped\n", phase,
+			    (int)kids[k], name);
+			leaked++;
+		}
+	}
+	if ((n[0] = listed(pids[0], states[0])) > 0) {
+		for (i = 0; i < n[0]; i++)
+			printf("%s: job %d is still listed after it was "
+			    "killed\n", phase, (int)pids[0][i]);
+		stale += n[0];
+	}
+}
+
+/*
+ * Requires:
+ *   "lat" is a valid Lat.
+ *
+ * Effects:
+ *   Adds "secs" to the latencies in "lat".
+ */
+static void
+addlat(struct Lat *lat, double secs)
+{
+
+	if (lat->n == lat->max) {
+		lat->max = lat->max == 0 ? 256 : lat->max * 2;
+		if ((lat->v = realloc(lat->v, lat->max * sizeof(*lat->v))) ==
+		    NULL)
+			exit(2);
+	}
+	lat->v[lat->n++] = secs;
+}
+
+/*
+ * Requires:
+ *   "lat" is a valid Lat.
+ *
+ * Effects:
+ *   Prints the median, 99th percentile, and maximum of the latencies in
+ *   "lat", in microseconds.
+ */
+static void
+printlat(const char *name, struct Lat *lat)
+{
+
+	if (lat->n == 0) {
+		printf("%-18s none\n", name);
+		return;
+	}
+	qsort(lat->v, lat->n, sizeof(*lat->v), cmpdouble);
+	printf("%-18s p50 %.0fus, p99 %.0fus, max %.0fus (%d samples)\n",
+	    name, lat->v[lat->n / 2] * 1e6, lat->v[lat->n * 99 / 100] * 1e6,
+	    lat->v[lat->n - 1] * 1e6, lat->n);
+}
+
+/*
+ * Requires:
+ *   "a" and "b" point to doubles.
+ *
+ * Effects:
+ *   Compares the doubles for qsort().
+ */
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}